@@ -0,0 +1,412 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "datatype.h"
+#include "rpc.h"
+#include "topology.h"
+#include "shuffle.h"
+#include "trace.h"
+
+// Communication microbenchmarks.
+//
+// Measures ping-pong latency, streaming bandwidth and broadcast, scatter,
+// gather, allgather and any-source gather throughput for each Comm
+// strategy, sweeping message sizes by factors of 8.  Broadcast and
+// allgather are also run node-aware through HierComm, with the transport's
+// node map or --ranks_per_node consecutive ranks per node, and alltoallv
+// with both its pairwise and Bruck algorithms.  Results are written to
+// stdout as one JSON object per line.  With --trace=PREFIX the traffic of
+// the last worker count is also recorded for bench/trace_replay.cc.  The
+// dummy transport emulates a network given --latency_us, --jitter_us,
+// --link_bandwidth or --node_bandwidth (bytes per second), with
+// --ranks_per_node workers per node.
+//
+//   build/bench_comm --workers=2,4,8 --max_bytes=1073741824
+//   build/bench_comm --workers=16 --ranks_per_node=4 --latency_us=2 --node_bandwidth=12.5e9
+//   mpirun -n 4 build/bench_comm --transport=mpi
+using namespace synchromesh;
+using std::vector;
+
+static const int kBenchTag = 7;
+static const int kBarrierTag = 8;
+
+// Bytes moved per (benchmark, size) point; bounds the iteration count.
+static const size_t kBytesPerPoint = 1 << 26;
+static const int kMaxIters = 1000;
+
+struct Options {
+  const char* transport;
+  vector<int> workers;
+  size_t min_bytes;
+  size_t max_bytes;
+  int ranks_per_node;
+  const char* trace;
+  NetworkModel net;
+};
+
+static Options options;
+
+static int iters_for(size_t bytes) {
+  size_t iters = kBytesPerPoint / bytes;
+  if (iters < 1) {
+    return 1;
+  }
+  if (iters > kMaxIters) {
+    return kMaxIters;
+  }
+  return iters;
+}
+
+// Everyone reports to 0, then 0 releases everyone.
+static void barrier(RPC* rpc) {
+  char c = 0;
+  if (rpc->id() == 0) {
+    for (int i = 1; i <= rpc->last(); ++i) {
+      rpc->recv_data(i, kBarrierTag, &c, 1);
+    }
+    for (int i = 1; i <= rpc->last(); ++i) {
+      delete rpc->send_data(i, kBarrierTag, &c, 1);
+    }
+  } else {
+    Request::Ptr r(rpc->send_data(0, kBarrierTag, &c, 1));
+    rpc->recv_data(0, kBarrierTag, &c, 1);
+    r->wait();
+  }
+}
+
+static void report(RPC* rpc, const char* bench, const char* comm, size_t bytes,
+                   int iters, double secs, size_t bytes_moved) {
+  if (rpc->id() != 0) {
+    return;
+  }
+  printf("{\"transport\": \"%s\", \"workers\": %d, \"bench\": \"%s\", "
+         "\"comm\": \"%s\", \"bytes\": %zu, \"iters\": %d, "
+         "\"usec_per_op\": %.3f, \"mb_per_sec\": %.3f}\n",
+         options.transport, rpc->num_workers(), bench, comm, bytes, iters,
+         secs * 1e6 / iters, bytes_moved / secs / 1e6);
+  fflush(stdout);
+}
+
+static double now() {
+  return now_ns() * 1e-9;
+}
+
+// Rank 0 and 1 bounce a message back and forth.  Reports one-way latency.
+static void bench_pingpong(RPC* rpc, vector<char>& buf, size_t bytes) {
+  int iters = iters_for(bytes);
+  barrier(rpc);
+  double start = now();
+  if (rpc->id() == 0) {
+    OneComm peer(rpc, Endpoint(1, 1, kBenchTag), 1);
+    for (int i = 0; i < iters; ++i) {
+      Request::Ptr r(send(peer, buf.data(), bytes));
+      recv(peer, buf.data(), bytes);
+      r->wait();
+    }
+  } else if (rpc->id() == 1) {
+    OneComm peer(rpc, Endpoint(0, 0, kBenchTag), 0);
+    for (int i = 0; i < iters; ++i) {
+      recv(peer, buf.data(), bytes);
+      send(peer, buf.data(), bytes)->wait();
+    }
+  }
+  barrier(rpc);
+  double secs = now() - start;
+  report(rpc, "pingpong", "OneComm", bytes, iters * 2, secs, 2 * iters * bytes);
+}
+
+// Rank 0 streams messages to rank 1 without waiting for replies.
+static void bench_stream(RPC* rpc, vector<char>& buf, size_t bytes) {
+  int iters = iters_for(bytes);
+  barrier(rpc);
+  double start = now();
+  if (rpc->id() == 0) {
+    OneComm peer(rpc, Endpoint(1, 1, kBenchTag), 1);
+    RequestGroup rg;
+    for (int i = 0; i < iters; ++i) {
+      rg.add(send(peer, buf.data(), bytes));
+    }
+    rg.wait();
+  } else if (rpc->id() == 1) {
+    OneComm peer(rpc, Endpoint(0, 0, kBenchTag), 0);
+    for (int i = 0; i < iters; ++i) {
+      recv(peer, buf.data(), bytes);
+    }
+  }
+  barrier(rpc);
+  double secs = now() - start;
+  report(rpc, "stream", "OneComm", bytes, iters, secs, iters * bytes);
+}
+
+// Rank 0 sends the whole buffer to every other rank.
+static void bench_broadcast(RPC* rpc, vector<char>& buf, size_t bytes) {
+  int iters = iters_for(bytes * rpc->num_workers());
+  Endpoint others(1, rpc->last(), kBenchTag);
+  barrier(rpc);
+  double start = now();
+  for (int i = 0; i < iters; ++i) {
+    if (rpc->id() == 0) {
+      AllComm all(rpc, others);
+      send(all, buf.data(), bytes)->wait();
+    } else {
+      OneComm one(rpc, others, 0);
+      recv(one, buf.data(), bytes);
+    }
+  }
+  barrier(rpc);
+  double secs = now() - start;
+  report(rpc, "broadcast", "AllComm", bytes, iters, secs,
+         iters * bytes * others.count());
+}
+
+// Rank 0 splits the buffer across every rank.
+static void bench_scatter(RPC* rpc, vector<char>& buf, size_t bytes) {
+  int iters = iters_for(bytes);
+  Endpoint everyone(rpc->first(), rpc->last(), kBenchTag);
+  ShardCalc sc(bytes, 1, everyone.count());
+  barrier(rpc);
+  double start = now();
+  for (int i = 0; i < iters; ++i) {
+    Request::Ptr r;
+    if (rpc->id() == 0) {
+      ShardedComm sharded(rpc, everyone);
+      r.reset(send(sharded, buf.data(), bytes));
+    }
+    OneComm one(rpc, everyone, 0);
+    recv(one, buf.data(), sc.num_elems(rpc->id()));
+    if (r) {
+      r->wait();
+    }
+  }
+  barrier(rpc);
+  double secs = now() - start;
+  report(rpc, "scatter", "ShardedComm", bytes, iters, secs, iters * bytes);
+}
+
+// Every rank sends its shard to rank 0, which assembles the buffer.
+static void bench_gather(RPC* rpc, vector<char>& buf, size_t bytes) {
+  int iters = iters_for(bytes);
+  Endpoint everyone(rpc->first(), rpc->last(), kBenchTag);
+  ShardCalc sc(bytes, 1, everyone.count());
+  barrier(rpc);
+  double start = now();
+  for (int i = 0; i < iters; ++i) {
+    OneComm one(rpc, everyone, 0);
+    Request::Ptr r(send(one, buf.data() + sc.start_byte(rpc->id()), sc.num_elems(rpc->id())));
+    if (rpc->id() == 0) {
+      ShardedComm sharded(rpc, everyone);
+      recv(sharded, buf.data(), bytes);
+    }
+    r->wait();
+  }
+  barrier(rpc);
+  double secs = now() - start;
+  report(rpc, "gather", "ShardedComm", bytes, iters, secs, iters * bytes);
+}
+
+// Every rank sends its shard to every rank: the nbody exchange.
+static void bench_allgather(RPC* rpc, vector<char>& buf, size_t bytes) {
+  int iters = iters_for(bytes * rpc->num_workers());
+  Endpoint everyone(rpc->first(), rpc->last(), kBenchTag);
+  ShardCalc sc(bytes, 1, everyone.count());
+  barrier(rpc);
+  double start = now();
+  for (int i = 0; i < iters; ++i) {
+    AllComm all(rpc, everyone);
+    Request::Ptr r(send(all, buf.data() + sc.start_byte(rpc->id()), sc.num_elems(rpc->id())));
+    ShardedComm sharded(rpc, everyone);
+    recv(sharded, buf.data(), bytes);
+    r->wait();
+  }
+  barrier(rpc);
+  double secs = now() - start;
+  report(rpc, "allgather", "AllComm+ShardedComm", bytes, iters, secs,
+         iters * bytes * everyone.count());
+}
+
+// Every other rank sends to rank 0, which takes messages in arrival order.
+static void bench_any(RPC* rpc, vector<char>& buf, size_t bytes) {
+  int iters = iters_for(bytes * rpc->num_workers());
+  Endpoint others(1, rpc->last(), kBenchTag);
+  barrier(rpc);
+  double start = now();
+  for (int i = 0; i < iters; ++i) {
+    if (rpc->id() == 0) {
+      for (int j = 0; j < others.count(); ++j) {
+        AnyComm any(rpc, others);
+        any.recv_pod(buf.data(), bytes);
+      }
+    } else {
+      OneComm one(rpc, Endpoint(0, 0, kBenchTag), 0);
+      delete one.send_pod(buf.data(), bytes);
+    }
+  }
+  barrier(rpc);
+  double secs = now() - start;
+  report(rpc, "any_gather", "AnyComm", bytes, iters, secs,
+         iters * bytes * others.count());
+}
+
+static Topology topology(RPC* rpc) {
+  if (options.ranks_per_node > 0) {
+    return Topology::blocked(rpc->num_workers(), options.ranks_per_node);
+  }
+  return Topology::detect(rpc);
+}
+
+// bench_broadcast through node leaders and shared memory.
+static void bench_hier_broadcast(RPC* rpc, vector<char>& buf, size_t bytes) {
+  int iters = iters_for(bytes * rpc->num_workers());
+  Endpoint everyone(rpc->first(), rpc->last(), kBenchTag);
+  HierComm hier(rpc, everyone, topology(rpc), 0);
+  barrier(rpc);
+  double start = now();
+  for (int i = 0; i < iters; ++i) {
+    if (rpc->id() == 0) {
+      send(hier, buf.data(), bytes)->wait();
+    } else {
+      recv(hier, buf.data(), bytes);
+    }
+  }
+  barrier(rpc);
+  double secs = now() - start;
+  report(rpc, "broadcast", "HierComm", bytes, iters, secs,
+         iters * bytes * (everyone.count() - 1));
+}
+
+// bench_allgather through node leaders and shared memory, with equal
+// shards.
+static void bench_hier_allgather(RPC* rpc, vector<char>& buf, size_t bytes) {
+  size_t shard = bytes / rpc->num_workers();
+  if (shard == 0) {
+    return;
+  }
+  int iters = iters_for(bytes * rpc->num_workers());
+  Endpoint everyone(rpc->first(), rpc->last(), kBenchTag);
+  HierComm hier(rpc, everyone, topology(rpc), 0);
+  vector<char> local(shard, 1);
+  barrier(rpc);
+  double start = now();
+  for (int i = 0; i < iters; ++i) {
+    hier.allgather(local.data(), shard, buf.data());
+  }
+  barrier(rpc);
+  double secs = now() - start;
+  report(rpc, "allgather", "HierComm", shard * everyone.count(), iters, secs,
+         iters * shard * everyone.count() * everyone.count());
+}
+
+// Every rank sends an equal share of the buffer to every rank.
+static void bench_alltoallv(RPC* rpc, vector<char>& buf, size_t bytes,
+                            AlltoallOptions::Algorithm algorithm) {
+  Endpoint everyone(rpc->first(), rpc->last(), kBenchTag);
+  int iters = iters_for(bytes * rpc->num_workers());
+  vector<size_t> send_bytes(rpc->num_workers(), bytes / rpc->num_workers());
+  vector<char> recv;
+  vector<size_t> recv_bytes;
+  AlltoallOptions opts;
+  opts.algorithm = algorithm;
+  barrier(rpc);
+  double start = now();
+  for (int i = 0; i < iters; ++i) {
+    alltoallv(rpc, everyone, buf.data(), send_bytes, &recv, &recv_bytes, opts);
+  }
+  barrier(rpc);
+  double secs = now() - start;
+  report(rpc, "alltoallv", algorithm == AlltoallOptions::kBruck ? "Bruck" : "Pairwise",
+         bytes, iters, secs, iters * bytes * everyone.count());
+}
+
+static void run_benches(RPC* rpc) {
+  vector<char> buf(options.max_bytes, 1);
+  for (size_t bytes = options.min_bytes; bytes <= options.max_bytes; bytes *= 8) {
+    bench_pingpong(rpc, buf, bytes);
+    bench_stream(rpc, buf, bytes);
+    bench_broadcast(rpc, buf, bytes);
+    bench_scatter(rpc, buf, bytes);
+    bench_gather(rpc, buf, bytes);
+    bench_allgather(rpc, buf, bytes);
+    bench_hier_broadcast(rpc, buf, bytes);
+    bench_hier_allgather(rpc, buf, bytes);
+    bench_alltoallv(rpc, buf, bytes, AlltoallOptions::kPairwise);
+    bench_alltoallv(rpc, buf, bytes, AlltoallOptions::kBruck);
+    bench_any(rpc, buf, bytes);
+  }
+}
+
+static void runner(RPC* rpc) {
+  if (rpc->num_workers() < 2) {
+    PANIC("Benchmarks need at least 2 workers.");
+  }
+  if (options.trace == NULL) {
+    run_benches(rpc);
+    return;
+  }
+  TracingRPC traced(rpc);
+  run_benches(&traced);
+  traced.write(options.trace);
+}
+
+static void parse_workers(const char* list, vector<int>* out) {
+  out->clear();
+  while (*list) {
+    out->push_back(atoi(list));
+    const char* comma = strchr(list, ',');
+    if (comma == NULL) {
+      break;
+    }
+    list = comma + 1;
+  }
+}
+
+int main(int argc, char** argv) {
+  options.transport = "dummy";
+  options.min_bytes = 8;
+  options.max_bytes = 1 << 24;
+  options.ranks_per_node = 0;
+  options.trace = NULL;
+  parse_workers("2,4,8", &options.workers);
+
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--transport=", 12) == 0) {
+      options.transport = argv[i] + 12;
+    } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+      parse_workers(argv[i] + 10, &options.workers);
+    } else if (strncmp(argv[i], "--min_bytes=", 12) == 0) {
+      options.min_bytes = strtoull(argv[i] + 12, NULL, 10);
+    } else if (strncmp(argv[i], "--max_bytes=", 12) == 0) {
+      options.max_bytes = strtoull(argv[i] + 12, NULL, 10);
+    } else if (strncmp(argv[i], "--ranks_per_node=", 17) == 0) {
+      options.ranks_per_node = atoi(argv[i] + 17);
+    } else if (strncmp(argv[i], "--latency_us=", 13) == 0) {
+      options.net.latency_ns = strtod(argv[i] + 13, NULL) * 1000;
+    } else if (strncmp(argv[i], "--jitter_us=", 12) == 0) {
+      options.net.jitter_ns = strtod(argv[i] + 12, NULL) * 1000;
+    } else if (strncmp(argv[i], "--link_bandwidth=", 17) == 0) {
+      options.net.link_bytes_per_sec = strtod(argv[i] + 17, NULL);
+    } else if (strncmp(argv[i], "--node_bandwidth=", 17) == 0) {
+      options.net.node_bytes_per_sec = strtod(argv[i] + 17, NULL);
+    } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+      options.trace = argv[i] + 8;
+    } else {
+      fprintf(stderr, "Usage: %s [--transport=dummy|mpi] [--workers=2,4,8] "
+              "[--min_bytes=N] [--max_bytes=N] [--ranks_per_node=N] [--trace=PREFIX] "
+              "[--latency_us=N] [--jitter_us=N] [--link_bandwidth=N] [--node_bandwidth=N]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  options.net.ranks_per_node = options.ranks_per_node;
+  log_level = kWarn;
+  if (strcmp(options.transport, "mpi") == 0) {
+    MPIRPC rpc;
+    runner(&rpc);
+  } else {
+    for (auto n : options.workers) {
+      DummyRPC::run(n, &runner, options.net);
+    }
+  }
+}
@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rpc.h"
+#include "topology.h"
+#include "trace.h"
+
+// Replays a communication trace written by TracingRPC.
+//
+// Either re-runs it on a transport, reporting the measured time, or runs
+// it through the LogGP simulator to predict the time on other links.
+// Results are written to stdout as one JSON object per line.
+//
+//   build/bench_comm --workers=64 --trace=/tmp/bc.trace
+//   build/trace_replay --trace=/tmp/bc.trace --simulate --network=ethernet --ranks_per_node=8
+//   mpirun -n 64 build/trace_replay --trace=/tmp/bc.trace --transport=mpi
+using namespace synchromesh;
+
+struct Options {
+  const char* trace;
+  const char* transport;
+  const char* network;
+  bool simulate;
+  int ranks_per_node;
+  double compute_scale;
+};
+
+static Options options;
+static Trace trace;
+
+static void report(const char* mode, int workers, double secs) {
+  printf("{\"trace\": \"%s\", \"mode\": \"%s\", \"workers\": %d, \"secs\": %.6f}\n",
+         options.trace, mode, workers, secs);
+  fflush(stdout);
+}
+
+static void runner(RPC* rpc) {
+  ReplayOptions opts;
+  opts.compute_scale = options.compute_scale;
+  uint64_t ns = replay(rpc, trace, opts);
+  if (rpc->id() == 0) {
+    report(options.transport, rpc->num_workers(), ns * 1e-9);
+  }
+}
+
+static void run_simulation() {
+  SimOptions opts;
+  opts.compute_scale = options.compute_scale;
+  if (strcmp(options.network, "ethernet") == 0) {
+    opts.inter = LogGP::ethernet();
+  } else if (strcmp(options.network, "infiniband") == 0) {
+    opts.inter = LogGP::infiniband();
+  } else {
+    PANIC("Unknown network %s", options.network);
+  }
+  if (options.ranks_per_node > 0) {
+    opts.topo = Topology::blocked(trace.num_workers(), options.ranks_per_node);
+  }
+
+  SimResult r = simulate(trace, opts);
+  printf("{\"trace\": \"%s\", \"mode\": \"simulate\", \"network\": \"%s\", \"workers\": %d, "
+         "\"ranks_per_node\": %d, \"secs\": %.6f, \"max_wait_secs\": %.6f, "
+         "\"messages\": %lu, \"bytes\": %lu, \"deadlocked\": %s}\n",
+         options.trace, options.network, trace.num_workers(), options.ranks_per_node,
+         r.makespan_ns * 1e-9, *std::max_element(r.wait_ns.begin(), r.wait_ns.end()) * 1e-9,
+         r.messages, r.bytes, r.deadlocked ? "true" : "false");
+}
+
+int main(int argc, char** argv) {
+  options.trace = NULL;
+  options.transport = "dummy";
+  options.network = "infiniband";
+  options.simulate = false;
+  options.ranks_per_node = 0;
+  options.compute_scale = 1.0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--trace=", 8) == 0) {
+      options.trace = argv[i] + 8;
+    } else if (strncmp(argv[i], "--transport=", 12) == 0) {
+      options.transport = argv[i] + 12;
+    } else if (strcmp(argv[i], "--simulate") == 0) {
+      options.simulate = true;
+    } else if (strncmp(argv[i], "--network=", 10) == 0) {
+      options.network = argv[i] + 10;
+    } else if (strncmp(argv[i], "--ranks_per_node=", 17) == 0) {
+      options.ranks_per_node = atoi(argv[i] + 17);
+    } else if (strncmp(argv[i], "--compute_scale=", 16) == 0) {
+      options.compute_scale = atof(argv[i] + 16);
+    } else {
+      options.trace = NULL;
+      break;
+    }
+  }
+  if (options.trace == NULL) {
+    fprintf(stderr, "Usage: %s --trace=PREFIX [--simulate [--network=infiniband|ethernet] "
+            "[--ranks_per_node=N]] [--transport=dummy|mpi] [--compute_scale=X]\n", argv[0]);
+    return 1;
+  }
+
+  log_level = kWarn;
+  trace = Trace::load(options.trace);
+  if (options.simulate) {
+    run_simulation();
+  } else if (strcmp(options.transport, "mpi") == 0) {
+    MPIRPC rpc;
+    runner(&rpc);
+  } else {
+    DummyRPC::run(trace.num_workers(), &runner);
+  }
+}
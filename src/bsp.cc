@@ -0,0 +1,24 @@
+#include "bsp.h"
+
+namespace synchromesh {
+
+// Flags are OR-ed along the way; after round k a rank has heard from the
+// 2^(k+1) - 1 ranks before it, so after the last round from all of them.
+bool barrier_any(RPC* rpc, const Endpoint& ep, bool flag) {
+  const int n = ep.count();
+  const int me = ep.index_of(rpc->id());
+  ASSERT_GE(me, 0);
+  uint8_t any = flag;
+  for (int d = 1; d < n; d *= 2) {
+    Request* r = send_pod(rpc, ep[(me + d) % n], ep.tag(), any);
+    any |= recv_pod<uint8_t>(rpc, ep[(me - d + n) % n], ep.tag());
+    delete r;
+  }
+  return any;
+}
+
+void barrier(RPC* rpc, const Endpoint& ep) {
+  barrier_any(rpc, ep, false);
+}
+
+} // namespace synchromesh
@@ -0,0 +1,212 @@
+#ifndef SYNCHROMESH_BSP_H
+#define SYNCHROMESH_BSP_H
+
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <boost/function.hpp>
+
+#include "util.h"
+#include "rpc.h"
+#include "datatype.h"
+#include "shuffle.h"
+#include "sparse.h"
+
+// Bulk synchronous supersteps, Pregel style.
+//
+//   BSP<int, MinCombiner> bsp(rpc, ep);
+//   bsp.run([&](BSP<int, MinCombiner>& s) {
+//     for (auto& m : s.inbox()) {
+//       if (m.val < dist[m.idx]) {
+//         dist[m.idx] = m.val;
+//         for (uint64_t v : neighbours(m.idx)) {
+//           s.send(v, m.val + 1);
+//         }
+//       }
+//     }
+//     s.vote_to_halt();
+//   });
+//
+// Messages are addressed to vertex ids, owned by rank owner(id) of the
+// endpoint.  Messages to the same vertex are combined as they are sent,
+// then once more across senders, so each vertex gets at most one message
+// per superstep.  Each superstep ends with one alltoallv of the combined
+// messages and a dissemination barrier that also counts the votes: the
+// run stops once every rank has voted to halt and no messages are left.
+// Uses the tag of 'ep' and the one after it.
+namespace synchromesh {
+
+// Returns once every rank of 'ep' has called it: ceil(log2 n) rounds, in
+// round k each rank signalling the rank 2^k after it and waiting for the
+// one 2^k before.
+void barrier(RPC* rpc, const Endpoint& ep);
+
+// A barrier that also returns whether 'flag' was set on any rank.
+bool barrier_any(RPC* rpc, const Endpoint& ep, bool flag);
+
+struct MinCombiner {
+  template<class M>
+  M operator()(const M& a, const M& b) const {
+    return std::min(a, b);
+  }
+};
+
+template<class M, class Combine = std::plus<M> >
+class BSP {
+public:
+  static_assert(std::is_trivially_copyable<M>::value, "BSP messages must be trivially copyable.");
+
+  // A message for vertex 'idx'.
+  typedef detail::SparseEntry<M> Message;
+
+private:
+  static const size_t kPackedBytes = sizeof(uint64_t) + sizeof(M);
+
+  RPC* rpc_;
+  Endpoint ep_;
+  Endpoint barrier_ep_;
+  Combine combine_;
+  boost::function<int(uint64_t)> owner_;
+  int superstep_;
+  bool halted_;
+
+  // Per destination rank, combined as sent.
+  std::vector<std::unordered_map<uint64_t, M> > outbox_;
+  std::vector<Message> inbox_;
+
+  uint64_t emitted_;
+  uint64_t exchanged_;
+
+public:
+  BSP(RPC* rpc, const Endpoint& ep, Combine combine = Combine()) :
+      rpc_(rpc), ep_(ep), barrier_ep_(ep.with_tag(ep.tag() + 1)), combine_(combine),
+      superstep_(0), halted_(false), outbox_(ep.count()), emitted_(0), exchanged_(0) {
+    ASSERT(ep.contains(rpc->id()), "Rank %d is not in the BSP endpoint.", rpc->id());
+    const int n = ep.count();
+    owner_ = [n](uint64_t v) {
+      return (int) (v % n);
+    };
+  }
+
+  // Which rank (position in the endpoint) owns each vertex; vertex id
+  // modulo the number of ranks by default.  Every rank must use the same.
+  void set_owner(boost::function<int(uint64_t)> owner) {
+    owner_ = owner;
+  }
+
+  int owner(uint64_t v) const {
+    return owner_(v);
+  }
+
+  // Whether this rank owns vertex 'v'.
+  bool owns(uint64_t v) const {
+    return ep_[owner_(v)] == rpc_->id();
+  }
+
+  int superstep() const {
+    return superstep_;
+  }
+
+  // Queue 'm' for vertex 'dst' next superstep.
+  void send(uint64_t dst, const M& m) {
+    ++emitted_;
+    std::unordered_map<uint64_t, M>& box = outbox_[owner_(dst)];
+    auto it = box.find(dst);
+    if (it == box.end()) {
+      box.emplace(dst, m);
+    } else {
+      it->second = combine_(it->second, m);
+    }
+  }
+
+  // This superstep's messages for vertices of this rank, one per vertex,
+  // sorted by vertex.
+  const std::vector<Message>& inbox() const {
+    return inbox_;
+  }
+
+  // This rank has nothing more to do unless messages arrive.  Cleared at
+  // the start of each superstep.
+  void vote_to_halt() {
+    halted_ = true;
+  }
+
+  // End the superstep: exchange the queued messages and wait at the
+  // barrier.  Returns whether another superstep is needed: some rank did
+  // not vote to halt, or has messages.
+  bool sync() {
+    const int n = ep_.count();
+    std::vector<char> out;
+    std::vector<size_t> send_bytes(n);
+    for (int r = 0; r < n; ++r) {
+      std::vector<Message> sorted;
+      for (auto& kv : outbox_[r]) {
+        sorted.push_back(Message { kv.first, kv.second });
+      }
+      std::sort(sorted.begin(), sorted.end(), [](const Message& a, const Message& b) {
+        return a.idx < b.idx;
+      });
+      // Packed as (vertex, message) without the struct's padding.
+      for (auto& m : sorted) {
+        out.insert(out.end(), (const char*) &m.idx, (const char*) &m.idx + sizeof(m.idx));
+        out.insert(out.end(), (const char*) &m.val, (const char*) &m.val + sizeof(m.val));
+      }
+      send_bytes[r] = sorted.size() * kPackedBytes;
+      exchanged_ += sorted.size();
+      outbox_[r].clear();
+    }
+
+    std::vector<char> received;
+    std::vector<size_t> recv_bytes;
+    alltoallv_into(rpc_, ep_, out.data(), send_bytes, [&received](size_t bytes) {
+      received.resize(bytes);
+      return received.data();
+    }, &recv_bytes);
+
+    std::vector<Message> unpacked(received.size() / kPackedBytes);
+    for (size_t k = 0; k < unpacked.size(); ++k) {
+      const char* p = received.data() + k * kPackedBytes;
+      memcpy(&unpacked[k].idx, p, sizeof(uint64_t));
+      memcpy(&unpacked[k].val, p + sizeof(uint64_t), sizeof(M));
+    }
+    std::vector<std::pair<const Message*, size_t> > runs;
+    const Message* p = unpacked.data();
+    for (int r = 0; r < n; ++r) {
+      runs.push_back(std::make_pair(p, recv_bytes[r] / kPackedBytes));
+      p += recv_bytes[r] / kPackedBytes;
+    }
+    inbox_.clear();
+    detail::merge_runs(runs, combine_, &inbox_);
+
+    const bool active = !halted_ || !inbox_.empty();
+    halted_ = false;
+    ++superstep_;
+    return barrier_any(rpc_, barrier_ep_, active);
+  }
+
+  // Call 'compute' once per superstep until every rank halts.  Returns the
+  // number of supersteps run.
+  template<class Fn>
+  int run(Fn compute) {
+    do {
+      compute(*this);
+    } while (sync());
+    return superstep_;
+  }
+
+  // Messages passed to send(), and those left to exchange after combining
+  // at the sender.
+  uint64_t emitted() const {
+    return emitted_;
+  }
+
+  uint64_t exchanged() const {
+    return exchanged_;
+  }
+};
+
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_BSP_H */
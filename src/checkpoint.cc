@@ -0,0 +1,408 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/scoped_ptr.hpp>
+
+#include "checkpoint.h"
+#include "metrics.h"
+
+namespace synchromesh {
+
+Mapping::Mapping(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  ASSERT(fd >= 0, "Failed to open %s: %s", path.c_str(), strerror(errno));
+
+  struct stat st;
+  ASSERT(fstat(fd, &st) == 0, "Failed to stat %s: %s", path.c_str(), strerror(errno));
+  len_ = st.st_size;
+  ASSERT_GE(len_, ShardHeader::kBytes);
+
+  base_ = (char*) mmap(NULL, len_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  ASSERT(base_ != MAP_FAILED, "Failed to map %s: %s", path.c_str(), strerror(errno));
+
+  // Start reading ahead in the background, but don't wait for it.
+  madvise(base_, len_, MADV_SEQUENTIAL);
+  madvise(base_, len_, MADV_WILLNEED);
+
+  memcpy(&header_, base_, sizeof(header_));
+  ASSERT(header_.magic == ShardHeader::kMagic, "%s is not a checkpoint shard.", path.c_str());
+  ASSERT_EQ(len_, ShardHeader::kBytes + header_.count * header_.elem_size);
+}
+
+Mapping::~Mapping() {
+  munmap(base_, len_);
+}
+
+namespace {
+
+enum BlockState {
+  kLive = 0,    // not yet copied; the live container holds the snapshot
+  kCopied = 1,  // touch() saved a private copy
+  kSaved = 2,   // the writer has taken its copy
+};
+
+// Writes to a temporary file, renamed into place by finish(), so a crash
+// mid-write never leaves a truncated shard behind.
+class FileSink: public AsyncSave::Sink {
+private:
+  std::string path_;
+  std::string tmp_;
+  int fd_;
+public:
+  FileSink(const std::string& path) :
+      path_(path), tmp_(path + ".tmp") {
+    fd_ = open(tmp_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT(fd_ >= 0, "Failed to create %s: %s", tmp_.c_str(), strerror(errno));
+  }
+
+  ~FileSink() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  void write(const void* ptr, size_t len) {
+    const char* p = (const char*) ptr;
+    while (len > 0) {
+      ssize_t n = ::write(fd_, p, len);
+      ASSERT(n >= 0, "Failed to write %s: %s", tmp_.c_str(), strerror(errno));
+      p += n;
+      len -= n;
+    }
+  }
+
+  void finish() {
+    ASSERT(fsync(fd_) == 0, "Failed to sync %s: %s", tmp_.c_str(), strerror(errno));
+    close(fd_);
+    fd_ = -1;
+    ASSERT(rename(tmp_.c_str(), path_.c_str()) == 0, "Failed to rename %s: %s",
+           tmp_.c_str(), strerror(errno));
+  }
+};
+
+// Sends each write as one message; recv_replica() expects the header and
+// then the data in kBlockBytes pieces.
+class PeerSink: public AsyncSave::Sink {
+private:
+  RPC* rpc_;
+  int peer_;
+  int tag_;
+public:
+  PeerSink(RPC* rpc, int peer, int tag) :
+      rpc_(rpc), peer_(peer), tag_(tag) {
+  }
+
+  void write(const void* ptr, size_t len) {
+    Request* r = rpc_->send_data(peer_, tag_, ptr, len);
+    r->wait();
+    delete r;
+  }
+
+  void finish() {
+  }
+};
+
+// Fill in the header for 'worker's shard of 'v', and find the shard's
+// first element in 'v'.
+size_t make_header(const ArrayLike& v, size_t num_elements, int worker, int num_workers,
+                   char* header) {
+  ShardCalc sc(num_elements, v.element_size(), num_workers);
+  memset(header, 0, ShardHeader::kBytes);
+  ShardHeader* h = (ShardHeader*) header;
+  h->magic = ShardHeader::kMagic;
+  h->num_elements = num_elements;
+  h->start_elem = sc.start_elem(worker);
+  h->count = sc.num_elems(worker);
+  h->elem_size = v.element_size();
+  h->num_workers = num_workers;
+  h->worker = worker;
+
+  if (v.count() == num_elements) {
+    return h->start_elem;
+  }
+  ASSERT_EQ(v.count(), h->count);
+  return 0;
+}
+
+} // namespace
+
+void write_shard(const std::string& path, const ArrayLike& v, size_t num_elements,
+                 int worker, int num_workers) {
+  char header[ShardHeader::kBytes];
+  size_t first = make_header(v, num_elements, worker, num_workers, header);
+  const ShardHeader* h = (const ShardHeader*) header;
+
+  FileSink sink(path);
+  sink.write(header, sizeof(header));
+  sink.write((const char*) v.data_ptr() + first * h->elem_size, h->count * h->elem_size);
+  sink.finish();
+}
+
+struct AsyncSave::Region {
+  const ArrayLike* v;
+  size_t first_elem;
+  size_t count;
+  size_t elem_size;
+  const char* base;
+  char header[ShardHeader::kBytes];
+  boost::scoped_ptr<Sink> sink;
+
+  size_t num_blocks;
+  boost::scoped_array<std::atomic<int> > state;
+  boost::scoped_array<boost::mutex> locks;
+  std::vector<char*> copies;
+
+  size_t block_bytes(size_t b) const {
+    return std::min(kBlockBytes, count * elem_size - b * kBlockBytes);
+  }
+};
+
+AsyncSave::AsyncSave() :
+    thread_(NULL), finished_(false) {
+}
+
+AsyncSave::~AsyncSave() {
+  wait();
+  delete thread_;
+  for (auto r : regions_) {
+    for (auto c : r->copies) {
+      delete[] c;
+    }
+    delete r;
+  }
+}
+
+void AsyncSave::add(const ArrayLike& v, size_t num_elements, int worker, int num_workers,
+                    Sink* sink) {
+  ASSERT(thread_ == NULL, "Regions must be added before start().");
+  Region* r = new Region;
+  r->v = &v;
+  r->first_elem = make_header(v, num_elements, worker, num_workers, r->header);
+  r->count = ((ShardHeader*) r->header)->count;
+  r->elem_size = v.element_size();
+  r->base = (const char*) v.data_ptr() + r->first_elem * r->elem_size;
+  r->sink.reset(sink);
+
+  r->num_blocks = (r->count * r->elem_size + kBlockBytes - 1) / kBlockBytes;
+  r->state.reset(new std::atomic<int>[r->num_blocks]);
+  r->locks.reset(new boost::mutex[r->num_blocks]);
+  r->copies.resize(r->num_blocks, NULL);
+  for (size_t b = 0; b < r->num_blocks; ++b) {
+    r->state[b].store(kLive, std::memory_order_relaxed);
+  }
+  regions_.push_back(r);
+}
+
+void AsyncSave::start() {
+  thread_ = new boost::thread(boost::bind(&AsyncSave::run, this));
+}
+
+void AsyncSave::touch(const ArrayLike& v, size_t first, size_t count) {
+  for (auto r : regions_) {
+    if (r->v != &v) {
+      continue;
+    }
+
+    size_t lo = std::max(first, r->first_elem);
+    size_t hi = std::min(first + count, r->first_elem + r->count);
+    if (lo >= hi) {
+      continue;
+    }
+
+    size_t first_block = (lo - r->first_elem) * r->elem_size / kBlockBytes;
+    size_t last_block = ((hi - r->first_elem) * r->elem_size - 1) / kBlockBytes;
+    for (size_t b = first_block; b <= last_block; ++b) {
+      if (r->state[b].load(std::memory_order_acquire) == kSaved) {
+        continue;
+      }
+
+      boost::mutex::scoped_lock l(r->locks[b]);
+      if (r->state[b].load(std::memory_order_relaxed) == kLive) {
+        size_t len = r->block_bytes(b);
+        r->copies[b] = new char[len];
+        memcpy(r->copies[b], r->base + b * kBlockBytes, len);
+        r->state[b].store(kCopied, std::memory_order_release);
+      }
+    }
+  }
+}
+
+void AsyncSave::run() {
+  boost::scoped_array<char> staging(new char[kBlockBytes]);
+  for (auto r : regions_) {
+    uint64_t start = now_ns();
+    r->sink->write(r->header, sizeof(r->header));
+    for (size_t b = 0; b < r->num_blocks; ++b) {
+      const char* src;
+      {
+        boost::mutex::scoped_lock l(r->locks[b]);
+        if (r->state[b].load(std::memory_order_relaxed) == kLive) {
+          memcpy(staging.get(), r->base + b * kBlockBytes, r->block_bytes(b));
+          src = staging.get();
+        } else {
+          src = r->copies[b];
+        }
+        r->state[b].store(kSaved, std::memory_order_release);
+      }
+
+      r->sink->write(src, r->block_bytes(b));
+      if (src != staging.get()) {
+        delete[] r->copies[b];
+        r->copies[b] = NULL;
+      }
+    }
+    r->sink->finish();
+    metrics::record_snapshot_write(r->count * r->elem_size, now_ns() - start);
+  }
+  finished_.store(true, std::memory_order_release);
+}
+
+bool AsyncSave::done() {
+  return finished_.load(std::memory_order_acquire);
+}
+
+void AsyncSave::wait() {
+  if (thread_ != NULL && thread_->joinable()) {
+    thread_->join();
+  }
+}
+
+std::string Checkpoint::path(const std::string& name, int worker) const {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d", worker);
+  return dir_ + "/" + name + suffix;
+}
+
+void Checkpoint::add(const std::string& name, ArrayLike* v, size_t num_elements) {
+  Entry e = { name, v, num_elements };
+  entries_.push_back(e);
+}
+
+void Checkpoint::save() {
+  mkdir(dir_.c_str(), 0755);
+  for (auto& e : entries_) {
+    write_shard(path(e.name, rpc_->id()), *e.v, e.num_elements, rpc_->id(), rpc_->num_workers());
+  }
+}
+
+AsyncSave* Checkpoint::save_async() {
+  uint64_t start = now_ns();
+  mkdir(dir_.c_str(), 0755);
+  AsyncSave* save = new AsyncSave;
+  for (auto& e : entries_) {
+    save->add(*e.v, e.num_elements, rpc_->id(), rpc_->num_workers(),
+              new FileSink(path(e.name, rpc_->id())));
+  }
+  save->start();
+  metrics::record_snapshot_pause(now_ns() - start);
+  return save;
+}
+
+AsyncSave* Checkpoint::replicate_async(int peer) {
+  uint64_t start = now_ns();
+  AsyncSave* save = new AsyncSave;
+  for (auto& e : entries_) {
+    save->add(*e.v, e.num_elements, rpc_->id(), rpc_->num_workers(),
+              new PeerSink(rpc_, peer, tag_));
+  }
+  save->start();
+  metrics::record_snapshot_pause(now_ns() - start);
+  return save;
+}
+
+std::vector<Replica> Checkpoint::recv_replica(int src) {
+  std::vector<Replica> replicas(entries_.size());
+  for (auto& r : replicas) {
+    char header[ShardHeader::kBytes];
+    rpc_->recv_data(src, tag_, header, sizeof(header));
+    memcpy(&r.header, header, sizeof(r.header));
+    ASSERT(r.header.magic == ShardHeader::kMagic, "Bad replica header from %d", src);
+
+    size_t bytes = r.header.count * r.header.elem_size;
+    r.data.reset(new HeapBuffer(bytes));
+    for (size_t pos = 0; pos < bytes; pos += AsyncSave::kBlockBytes) {
+      size_t len = std::min(AsyncSave::kBlockBytes, bytes - pos);
+      rpc_->recv_data(src, tag_, r.data->data() + pos, len);
+    }
+  }
+  return replicas;
+}
+
+void Checkpoint::restore() {
+  for (auto& e : entries_) {
+    int old_workers = Mapping(path(e.name, 0)).header().num_workers;
+    if (old_workers != rpc_->num_workers()) {
+      redistribute(e, old_workers);
+      continue;
+    }
+
+    Mapping m(path(e.name, rpc_->id()));
+    const ShardHeader& h = m.header();
+    ASSERT_EQ(h.elem_size, e.v->element_size());
+    e.num_elements = h.num_elements;
+    e.v->resize(h.count);
+    memcpy(e.v->data_ptr(), m.data(), h.count * h.elem_size);
+  }
+}
+
+// Each rank maps a contiguous block of the old shard files, then sends
+// every rank the part of its new shard that block covers.  Blocks are
+// ordered by rank, so a ShardedComm recv assembles the new shard in order.
+void Checkpoint::redistribute(Entry& e, int old_workers) {
+  const int n = rpc_->num_workers();
+  const int me = rpc_->id();
+  Log_Info("%d: redistributing %s from %d to %d workers", me, e.name.c_str(), old_workers, n);
+
+  ShardCalc files(old_workers, 1, n);
+  std::vector<Mapping::Ptr> maps;
+  for (size_t f = files.start_elem(me); f < files.end_elem(me); ++f) {
+    maps.push_back(Mapping::Ptr(new Mapping(path(e.name, f))));
+    ASSERT_EQ(maps.back()->header().elem_size, e.v->element_size());
+  }
+
+  Mapping first(path(e.name, 0));
+  e.num_elements = first.header().num_elements;
+  const size_t es = e.v->element_size();
+  ShardCalc dst(e.num_elements, es, n);
+
+  RequestGroup rg;
+  for (int j = 0; j < n; ++j) {
+    size_t lo = dst.start_elem(j);
+    size_t hi = dst.end_elem(j);
+
+    size_t count = 0;
+    for (auto m : maps) {
+      size_t s = std::max<size_t>(lo, m->header().start_elem);
+      size_t t = std::min<size_t>(hi, m->header().start_elem + m->header().count);
+      if (s < t) {
+        count += t - s;
+      }
+    }
+
+    BufferRequest* br = new BufferRequest(count * es);
+    char* p = br->data();
+    for (auto m : maps) {
+      size_t start = m->header().start_elem;
+      size_t s = std::max<size_t>(lo, start);
+      size_t t = std::min<size_t>(hi, start + m->header().count);
+      if (s < t) {
+        memcpy(p, m->data() + (s - start) * es, (t - s) * es);
+        p += (t - s) * es;
+      }
+    }
+    br->add(send_pod(rpc_, j, tag_, count));
+    br->add(rpc_->send_data(j, tag_, br->data(), br->size()));
+    rg.add(br);
+  }
+
+  Endpoint everyone(rpc_->first(), rpc_->last(), tag_);
+  ShardedComm sharded(rpc_, everyone);
+  sharded.recv_array(*e.v);
+  rg.wait();
+}
+
+} // namespace synchromesh
@@ -0,0 +1,237 @@
+#ifndef SYNCHROMESH_CHECKPOINT_H
+#define SYNCHROMESH_CHECKPOINT_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include "util.h"
+#include "rpc.h"
+#include "datatype.h"
+
+// Checkpoint and restart of sharded state.
+//
+// Each rank writes its shard of every registered container, plus the
+// ShardCalc layout, to its own file with one sequential write:
+//
+//   Checkpoint ckpt(rpc, "/scratch/run", kCheckpointTag);
+//   ckpt.add("points", &points, kNumPoints);
+//   ckpt.save();
+//   ...
+//   ckpt.restore();
+//
+// Restoring maps the files rather than reading them.  map<V>() hands back
+// the mapping itself, so a rank can start computing before the whole shard
+// is paged in.  restore() also handles a different number of workers than
+// the checkpoint was written with, by redistributing the shards.
+//
+// save_async() takes a snapshot without stopping the application: the
+// shards are written by a background thread while the live containers keep
+// changing.  Before modifying a container the application calls touch(),
+// which saves a private copy of any block the writer hasn't reached yet:
+//
+//   AsyncSave* save = ckpt.save_async();
+//   while (!save->done()) {
+//     save->touch(points, first, count);
+//     ... update points[first, first + count) ...
+//   }
+//   delete save;
+namespace synchromesh {
+
+struct ShardHeader {
+  static const uint64_t kMagic = 0x53594e434b505431ULL;  // "SYNCKPT1"
+  static const size_t kBytes = 64;
+
+  uint64_t magic;
+  uint64_t num_elements;
+  uint64_t start_elem;
+  uint64_t count;
+  uint32_t elem_size;
+  uint32_t num_workers;
+  uint32_t worker;
+};
+
+// A private, copy-on-write mapping of a shard file.  Pages are read in on
+// first touch; writes never reach the file.
+class Mapping {
+private:
+  char* base_;
+  size_t len_;
+  ShardHeader header_;
+public:
+  typedef boost::shared_ptr<Mapping> Ptr;
+
+  Mapping(const std::string& path);
+  ~Mapping();
+
+  const ShardHeader& header() const {
+    return header_;
+  }
+
+  char* data() {
+    return base_ + ShardHeader::kBytes;
+  }
+};
+
+// Write 'v' to 'path' as 'worker's shard of a 'num_elements' array split
+// over 'num_workers'.  'v' may hold either the whole array or just the
+// shard.
+void write_shard(const std::string& path, const ArrayLike& v, size_t num_elements,
+                 int worker, int num_workers);
+
+// A shard used in place from its mapping.  Ignores growing resizes, like
+// FixedArray.
+template<class V>
+class MappedArray: public ArrayLike {
+private:
+  Mapping::Ptr m_;
+  V* v_;
+  size_t len_;
+public:
+  MappedArray() :
+      v_(NULL), len_(0) {
+  }
+
+  MappedArray(Mapping::Ptr m) :
+      m_(m), v_((V*) m->data()), len_(m->header().count) {
+    ASSERT_EQ(m->header().elem_size, sizeof(V));
+  }
+
+  void* data_ptr() {
+    return (void*) v_;
+  }
+
+  const void* data_ptr() const {
+    return (void*) v_;
+  }
+
+  const V& operator[](size_t idx) const {
+    return v_[idx];
+  }
+
+  V& operator[](size_t idx) {
+    return v_[idx];
+  }
+
+  void resize(size_t sz) {
+    ASSERT_LE(sz, len_);
+  }
+
+  size_t count() const {
+    return len_;
+  }
+
+  size_t element_size() const {
+    return sizeof(V);
+  }
+
+  // Index of element 0 in the whole array.
+  size_t start_elem() const {
+    return m_->header().start_elem;
+  }
+};
+
+// Writes a consistent snapshot of a set of shards from a background
+// thread.  Shards are tracked in blocks of kBlockBytes: a block is copied
+// either by the writer when it reaches it or by touch(), whichever comes
+// first, so each block is copied at most once.  Registered containers must
+// not be resized until the save is done.
+class AsyncSave: public Request {
+public:
+  static const size_t kBlockBytes = 1 << 20;
+
+  // Where a snapshot is written to.
+  class Sink {
+  public:
+    virtual ~Sink() {
+    }
+
+    virtual void write(const void* ptr, size_t len) = 0;
+    virtual void finish() = 0;
+  };
+
+  struct Region;
+
+  AsyncSave();
+  ~AsyncSave();
+
+  // Snapshot 'worker's shard of 'v' into 'sink', which the save takes
+  // ownership of.  Regions must all be added before start().
+  void add(const ArrayLike& v, size_t num_elements, int worker, int num_workers, Sink* sink);
+  void start();
+
+  // Call before modifying elements [first, first + count) of 'v'.
+  void touch(const ArrayLike& v, size_t first, size_t count);
+
+  bool done();
+  void wait();
+
+private:
+  std::vector<Region*> regions_;
+  boost::thread* thread_;
+  std::atomic<bool> finished_;
+
+  void run();
+};
+
+// A shard received from a peer's replicate_async().
+struct Replica {
+  ShardHeader header;
+  boost::shared_ptr<HeapBuffer> data;
+};
+
+class Checkpoint {
+private:
+  struct Entry {
+    std::string name;
+    ArrayLike* v;
+    size_t num_elements;
+  };
+
+  RPC* rpc_;
+  std::string dir_;
+  int tag_;
+  std::vector<Entry> entries_;
+
+  std::string path(const std::string& name, int worker) const;
+  void redistribute(Entry& e, int old_workers);
+
+public:
+  Checkpoint(RPC* rpc, const std::string& dir, int tag) :
+      rpc_(rpc), dir_(dir), tag_(tag) {
+  }
+
+  // Register a container holding this rank's shard (or all) of a
+  // 'num_elements' array.
+  void add(const std::string& name, ArrayLike* v, size_t num_elements);
+
+  void save();
+
+  // Write the same files as save() from a background thread.
+  AsyncSave* save_async();
+
+  // Stream a snapshot to 'peer', which must call recv_replica(), to hold
+  // a copy in its memory.  The RPC must allow calls from the background
+  // thread concurrently with the application's.
+  AsyncSave* replicate_async(int peer);
+
+  // Receive the shards 'src' replicates, one per registered container.
+  std::vector<Replica> recv_replica(int src);
+
+  // Load every registered container with this rank's shard.
+  void restore();
+
+  // This rank's shard of 'name', paged in lazily.  The checkpoint must have
+  // been written by the same number of workers.
+  template<class V>
+  MappedArray<V> map(const std::string& name) {
+    Mapping::Ptr m(new Mapping(path(name, rpc_->id())));
+    ASSERT_EQ(m->header().num_workers, rpc_->num_workers());
+    return MappedArray<V>(m);
+  }
+};
+
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_CHECKPOINT_H */
@@ -0,0 +1,64 @@
+#include "coro.h"
+
+namespace synchromesh {
+namespace coro {
+
+static thread_local Executor* current_executor = NULL;
+
+Executor* Executor::current() {
+  return current_executor;
+}
+
+Executor::~Executor() {
+  for (auto h : roots_) {
+    h.destroy();
+  }
+}
+
+void Executor::wait_until(ReadyFn ready, std::coroutine_handle<> h) {
+  Waiter w = { ready, h };
+  waiting_.push_back(w);
+}
+
+void Executor::run() {
+  Executor* prev = current_executor;
+  current_executor = this;
+
+  size_t started = 0;
+  while (started < roots_.size() || !waiting_.empty()) {
+    // Start newly spawned coroutines; they run until their first suspension.
+    while (started < roots_.size()) {
+      roots_[started++].resume();
+    }
+
+    std::deque<Waiter> pending;
+    pending.swap(waiting_);
+
+    bool progress = false;
+    while (!pending.empty()) {
+      Waiter w = pending.front();
+      pending.pop_front();
+      if (w.ready()) {
+        progress = true;
+        w.handle.resume();
+      } else {
+        waiting_.push_back(w);
+      }
+    }
+
+    if (!progress) {
+      sched_yield();
+    }
+  }
+
+  for (auto h : roots_) {
+    ASSERT(h.done(), "Coroutine suspended without waiting on the executor.");
+    h.destroy();
+  }
+  roots_.clear();
+
+  current_executor = prev;
+}
+
+} // namespace coro
+} // namespace synchromesh
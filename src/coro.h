@@ -0,0 +1,325 @@
+#ifndef SYNCHROMESH_CORO_H
+#define SYNCHROMESH_CORO_H
+
+#include <coroutine>
+#include <deque>
+#include <optional>
+#include <vector>
+#include <boost/function.hpp>
+
+#include "util.h"
+#include "rpc.h"
+#include "datatype.h"
+
+// C++20 coroutine wrappers for sends, receives and collectives.
+//
+// Each rank owns an Executor.  Coroutines suspend on a communication
+// operation; the executor polls the transport (Request::done, Comm::poll)
+// and resumes them once the operation can complete without blocking.
+//
+//   coro::Task<void> phase(Comm& c) {
+//     co_await coro::send(c, 42);
+//     int x = co_await coro::recv<int>(c);
+//   }
+//
+//   coro::Executor ex;
+//   ex.spawn(phase(c));
+//   ex.run();
+namespace synchromesh {
+namespace coro {
+
+typedef boost::function<bool(void)> ReadyFn;
+
+class Executor {
+private:
+  struct Waiter {
+    ReadyFn ready;
+    std::coroutine_handle<> handle;
+  };
+
+  std::deque<Waiter> waiting_;
+  std::vector<std::coroutine_handle<> > roots_;
+
+public:
+  Executor() {}
+  ~Executor();
+
+  // Start running 't' the next time run() is called.  The executor takes
+  // ownership of the coroutine frame.
+  template<class TaskT>
+  void spawn(TaskT t) {
+    roots_.push_back(t.release());
+  }
+
+  // Resume 'h' once 'ready' returns true.
+  void wait_until(ReadyFn ready, std::coroutine_handle<> h);
+
+  // Drive all spawned coroutines until they have finished.
+  void run();
+
+  // The executor currently running on this thread.
+  static Executor* current();
+};
+
+template<class T>
+class Task;
+
+namespace internal {
+
+struct FinalAwaiter {
+  bool await_ready() noexcept {
+    return false;
+  }
+
+  template<class Promise>
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+    if (h.promise().continuation) {
+      return h.promise().continuation;
+    }
+    return std::noop_coroutine();
+  }
+
+  void await_resume() noexcept {
+  }
+};
+
+struct PromiseBase {
+  std::coroutine_handle<> continuation;
+
+  std::suspend_always initial_suspend() noexcept {
+    return std::suspend_always();
+  }
+
+  FinalAwaiter final_suspend() noexcept {
+    return FinalAwaiter();
+  }
+
+  void unhandled_exception() {
+    PANIC("Unhandled exception in coroutine.");
+  }
+};
+
+template<class T>
+struct Promise: public PromiseBase {
+  std::optional<T> value;
+
+  Task<T> get_return_object();
+
+  void return_value(T v) {
+    value = std::move(v);
+  }
+
+  T result() {
+    return std::move(*value);
+  }
+};
+
+template<>
+struct Promise<void> : public PromiseBase {
+  Task<void> get_return_object();
+
+  void return_void() {
+  }
+
+  void result() {
+  }
+};
+
+} // namespace internal
+
+// A lazily started coroutine.  Either co_await it from another coroutine or
+// hand it to Executor::spawn().
+template<class T = void>
+class Task {
+public:
+  typedef internal::Promise<T> promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+private:
+  Handle h_;
+
+public:
+  explicit Task(Handle h) :
+      h_(h) {
+  }
+
+  Task(Task&& other) :
+      h_(other.h_) {
+    other.h_ = nullptr;
+  }
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task() {
+    if (h_) {
+      h_.destroy();
+    }
+  }
+
+  bool done() const {
+    return h_.done();
+  }
+
+  Handle release() {
+    Handle h = h_;
+    h_ = nullptr;
+    return h;
+  }
+
+  bool await_ready() {
+    return false;
+  }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) {
+    h_.promise().continuation = cont;
+    return h_;
+  }
+
+  T await_resume() {
+    return h_.promise().result();
+  }
+};
+
+namespace internal {
+
+template<class T>
+Task<T> Promise<T>::get_return_object() {
+  return Task<T>(Task<T>::Handle::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>(Task<void>::Handle::from_promise(*this));
+}
+
+} // namespace internal
+
+// Suspend until 'ready' returns true.
+class Ready {
+private:
+  ReadyFn ready_;
+public:
+  explicit Ready(ReadyFn ready) :
+      ready_(ready) {
+  }
+
+  bool await_ready() {
+    return ready_();
+  }
+
+  void await_suspend(std::coroutine_handle<> h) {
+    Executor* ex = Executor::current();
+    ASSERT(ex != NULL, "co_await outside of a running Executor.");
+    ex->wait_until(ready_, h);
+  }
+
+  void await_resume() {
+  }
+};
+
+// Suspend until an outstanding request has completed.  Takes ownership of
+// the request.
+class RequestAwaitable {
+private:
+  Request::Ptr req_;
+public:
+  explicit RequestAwaitable(Request* req) :
+      req_(req) {
+  }
+
+  bool await_ready() {
+    return req_->done();
+  }
+
+  void await_suspend(std::coroutine_handle<> h) {
+    Executor* ex = Executor::current();
+    ASSERT(ex != NULL, "co_await outside of a running Executor.");
+    ex->wait_until(boost::bind(&Request::done, req_), h);
+  }
+
+  void await_resume() {
+  }
+};
+
+// Suspend until a recv on 'comm' would not block, then read a 'T'.
+template<class T>
+class RecvAwaitable {
+private:
+  Comm& comm_;
+  T* dst_;
+public:
+  RecvAwaitable(Comm& comm, T* dst) :
+      comm_(comm), dst_(dst) {
+  }
+
+  bool await_ready() {
+    return comm_.poll();
+  }
+
+  void await_suspend(std::coroutine_handle<> h) {
+    Executor* ex = Executor::current();
+    ASSERT(ex != NULL, "co_await outside of a running Executor.");
+    ex->wait_until(boost::bind(&Comm::poll, &comm_), h);
+  }
+
+  T await_resume() {
+    T v;
+    synchromesh::recv(comm_, v);
+    if (dst_ != NULL) {
+      *dst_ = v;
+    }
+    return v;
+  }
+};
+
+static inline Ready wait(Request::Ptr req) {
+  return Ready(boost::bind(&Request::done, req));
+}
+
+template<class T>
+RequestAwaitable send(Comm& comm, const T& v) {
+  return RequestAwaitable(synchromesh::send(comm, v));
+}
+
+template<class V>
+RequestAwaitable send(Comm& comm, const V* v, size_t len) {
+  return RequestAwaitable(synchromesh::send(comm, v, len));
+}
+
+template<class T>
+RecvAwaitable<T> recv(Comm& comm) {
+  return RecvAwaitable<T>(comm, NULL);
+}
+
+template<class T>
+RecvAwaitable<T> recv(Comm& comm, T& v) {
+  return RecvAwaitable<T>(comm, &v);
+}
+
+// Receive into a fixed array of 'len' elements.
+template<class V>
+Task<void> recv(Comm& comm, V* v, size_t len) {
+  co_await Ready(boost::bind(&Comm::poll, &comm));
+  synchromesh::recv(comm, v, len);
+}
+
+// Send 'count' local elements to every worker in 'ep' and gather all of
+// their contributions into 'out', in endpoint order.  Equivalent to an
+// AllComm send followed by a ShardedComm recv.
+template<class V>
+Task<void> allgather(RPC* rpc, Endpoint ep, const V* local, size_t count,
+                     V* out, size_t total) {
+  AllComm all(rpc, ep);
+  Request::Ptr req(synchromesh::send(all, local, count));
+
+  ShardedComm sharded(rpc, ep);
+  co_await Ready(boost::bind(&Comm::poll, &sharded));
+  synchromesh::recv(sharded, out, total);
+
+  co_await wait(req);
+}
+
+} // namespace coro
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_CORO_H */
@@ -1,4 +1,5 @@
 #include "datatype.h"
+#include "sparse.h"
 
 using std::vector;
 using std::map;
@@ -46,13 +47,40 @@ size_t ShardCalc::num_elems(int worker) {
 }
 
 
+Request* Comm::send_quantized(const ArrayLike& v, const Quantization& q) {
+  BufferRequest* br = new BufferRequest(q.message_bytes(v.count()));
+  Quantizer::encode(v.quantizer(), q, v.data_ptr(), v.element_size(), 0, v.count(), br->data());
+  br->add(send_pod(br->data(), br->size()));
+  return br;
+}
+
+void Comm::recv_quantized(ArrayLike& v) {
+  Buffer::Ptr buf = recv_buffer();
+  v.resize(quantized_count(buf->data(), buf->size()));
+  dequantize(buf->data(), buf->size(), v.data_ptr(), v.element_size());
+}
+
+Request* Comm::send_sparse(const SparseArray& v) {
+  BufferRequest* br = new BufferRequest(v.encoded_bytes(0, v.size()));
+  v.encode(0, v.size(), br->data());
+  br->add(send_pod(br->data(), br->size()));
+  return br;
+}
+
+void Comm::recv_sparse(SparseArray& v) {
+  Buffer::Ptr buf = recv_buffer();
+  v.resize(0);
+  v.append_encoded(buf->data(), buf->size());
+}
+
 Request* ShardedComm::send_array(const ArrayLike& v) {
+  METRICS_COMM_SCOPE(kShardedComm);
   RequestGroup* rg = new RequestGroup;
   Log_Info("send_array: %d %d", v.count(), ep_.count());
   ShardCalc sc(v.count(), v.element_size(), ep_.count());
   const char* cv = (const char*) (v.data_ptr());
   for (int i = 0; i < ep_.count(); ++i) {
-    int dst = *(ep_.begin() + i);
+    int dst = ep_[i];
     // skip self.
 //    if (dst == rpc_->id()) {
 //      continue;
@@ -67,9 +95,10 @@ Request* ShardedComm::send_array(const ArrayLike& v) {
 }
 
 void ShardedComm::recv_array(ArrayLike& v) {
+  METRICS_COMM_SCOPE(kShardedComm);
   size_t pos = 0;
   for (int i = 0; i < ep_.count(); ++i) {
-    int src = *(ep_.begin() + i);
+    int src = ep_[i];
 
     // skip self.
 //    if (src == rpc_->id()) {
@@ -87,13 +116,79 @@ void ShardedComm::recv_array(ArrayLike& v) {
   }
 }
 
+Request* ShardedComm::send_quantized(const ArrayLike& v, const Quantization& q) {
+  METRICS_COMM_SCOPE(kShardedComm);
+  RequestGroup* rg = new RequestGroup;
+  ShardCalc sc(v.count(), v.element_size(), ep_.count());
+  for (int i = 0; i < ep_.count(); ++i) {
+    BufferRequest* br = new BufferRequest(q.message_bytes(sc.num_elems(i)));
+    Quantizer::encode(v.quantizer(), q, v.data_ptr(), v.element_size(), sc.start_elem(i),
+                      sc.num_elems(i), br->data());
+    br->add(rpc_->send_data(ep_[i], ep_.tag(), br->data(), br->size()));
+    rg->add(br);
+  }
+  return rg;
+}
+
+// Grows 'v' as the parts arrive but never shrinks it before the end, so
+// error feedback updates land on the values they were made against.
+void ShardedComm::recv_quantized(ArrayLike& v) {
+  METRICS_COMM_SCOPE(kShardedComm);
+  size_t pos = 0;
+  for (auto src : ep_) {
+    Buffer::Ptr buf = rpc_->recv_buffer(src, ep_.tag());
+    size_t n = quantized_count(buf->data(), buf->size());
+    if (v.count() < pos + n) {
+      v.resize(pos + n);
+    }
+    if (src != rpc_->id()) {
+      char* cv = (char*) v.data_ptr() + pos * v.element_size();
+      dequantize(buf->data(), buf->size(), cv, v.element_size());
+    }
+    pos += n;
+  }
+  v.resize(pos);
+}
+
+Request* ShardedComm::send_sparse(const SparseArray& v) {
+  METRICS_COMM_SCOPE(kShardedComm);
+  RequestGroup* rg = new RequestGroup;
+  ShardCalc sc(v.size(), v.element_size(), ep_.count());
+  for (int i = 0; i < ep_.count(); ++i) {
+    BufferRequest* br = new BufferRequest(v.encoded_bytes(sc.start_elem(i), sc.num_elems(i)));
+    v.encode(sc.start_elem(i), sc.num_elems(i), br->data());
+    br->add(rpc_->send_data(ep_[i], ep_.tag(), br->data(), br->size()));
+    rg->add(br);
+  }
+  return rg;
+}
+
+void ShardedComm::recv_sparse(SparseArray& v) {
+  METRICS_COMM_SCOPE(kShardedComm);
+  v.resize(0);
+  for (auto src : ep_) {
+    Buffer::Ptr buf = rpc_->recv_buffer(src, ep_.tag());
+    v.append_encoded(buf->data(), buf->size());
+  }
+}
+
 void ShardedComm::recv_pod(void* v, size_t len) {
   PANIC("Not implemented.");
   // rpc_->recv_data(dst_, ep_.tag(), v, len);
 }
 
+bool ShardedComm::poll() const {
+  for (auto src : ep_) {
+    if (!rpc_->poll(src, ep_.tag())) {
+      return false;
+    }
+  }
+  return true;
+}
+
 
 Request* AllComm::send_pod(const void* v, size_t len) {
+  METRICS_COMM_SCOPE(kAllComm);
   RequestGroup* rg = new RequestGroup();
   for (auto d : ep_) {
     Log_Info("%d: sending %d bytes to %d", rpc_->id(), len, d);
@@ -102,13 +197,28 @@ Request* AllComm::send_pod(const void* v, size_t len) {
   return rg;
 }
 
+Request* AllComm::send_layout(const void* base, const Layout& layout) {
+  METRICS_COMM_SCOPE(kAllComm);
+  RequestGroup* rg = new RequestGroup();
+  for (auto d : ep_) {
+    rg->add(rpc_->send_layout(d, ep_.tag(), base, layout));
+  }
+  return rg;
+}
+
 void AllComm::recv_pod(void* v, size_t len) {
   // Recv should either:
   //  read into a vector or perform a user reduction.
   PANIC("Not implemented yet.");
 }
 
-void AnyComm::recv_pod(void* v, size_t len) {
+bool AllComm::poll() const {
+  PANIC("Not implemented yet.");
+  return false;
+}
+
+// Pick the first worker with a message waiting; later receives stick to it.
+void AnyComm::wait_for_target() {
   while (tgt_ == -1) {
     for (auto proc : ep_) {
       if (rpc_->poll(proc, ep_.tag())) {
@@ -117,9 +227,38 @@ void AnyComm::recv_pod(void* v, size_t len) {
       }
     }
   }
+}
+
+void AnyComm::recv_pod(void* v, size_t len) {
+  METRICS_COMM_SCOPE(kAnyComm);
+  wait_for_target();
   rpc_->recv_data(tgt_, ep_.tag(), v, len);
 }
 
+Buffer::Ptr AnyComm::recv_buffer() {
+  METRICS_COMM_SCOPE(kAnyComm);
+  wait_for_target();
+  return rpc_->recv_buffer(tgt_, ep_.tag());
+}
+
+void AnyComm::recv_layout(void* base, const Layout& layout) {
+  METRICS_COMM_SCOPE(kAnyComm);
+  wait_for_target();
+  rpc_->recv_layout(tgt_, ep_.tag(), base, layout);
+}
+
+bool AnyComm::poll() const {
+  if (tgt_ != -1) {
+    return rpc_->poll(tgt_, ep_.tag());
+  }
+  for (auto proc : ep_) {
+    if (rpc_->poll(proc, ep_.tag())) {
+      return true;
+    }
+  }
+  return false;
+}
+
 
 
 } // namespace synchromesh
@@ -1,12 +1,17 @@
 #ifndef SYNC_DATATYPE_H
 #define SYNC_DATATYPE_H
 
+#include <iterator>
 #include <map>
+#include <typeinfo>
 #include <vector>
 #include <boost/shared_ptr.hpp>
 
 #include "util.h"
 #include "rpc.h"
+#include "metrics.h"
+#include "quantize.h"
+#include "serialize.h"
 
 // Marshalling implementations for common datatypes:
 //
@@ -14,38 +19,211 @@
 // Fixed size arrays
 // std::vector (resizable)
 // std::map
+// std::string and structs declared with SYNCHROMESH_FIELDS (flat packed)
 namespace synchromesh {
 
+// A group of workers plus the tag used to talk to them.  Groups are
+// compact descriptors: a range, a strided range, or a shared explicit list,
+// so copying an endpoint over 100k workers costs O(1).
+//
+//   Endpoint all(0, rpc->last(), kTag);                 // 0 .. last
+//   Endpoint evens = Endpoint::strided(0, n / 2, 2, kTag); // 0, 2, 4, ...
+//   Endpoint some = Endpoint::list({ 3, 1, 4 }, kTag);
 class Endpoint {
 private:
-  std::vector<int> v_;
+  int first_;
+  int count_;
+  int stride_;
   int tag_;
+  boost::shared_ptr<const std::vector<int> > list_;
+
 public:
-  Endpoint(int f, int l, int tag) {
-    for (int i = f; i <= l; ++i) {
-      v_.push_back(i);
+  class const_iterator {
+  private:
+    const Endpoint* ep_;
+    int i_;
+  public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef int value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const int* pointer;
+    typedef int reference;
+
+    const_iterator() :
+        ep_(NULL), i_(0) {
+    }
+    const_iterator(const Endpoint* ep, int i) :
+        ep_(ep), i_(i) {
     }
 
-    tag_ = tag;
+    int operator*() const {
+      return (*ep_)[i_];
+    }
+    int operator[](difference_type n) const {
+      return (*ep_)[i_ + n];
+    }
+    const_iterator& operator++() {
+      ++i_;
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator t = *this;
+      ++i_;
+      return t;
+    }
+    const_iterator& operator--() {
+      --i_;
+      return *this;
+    }
+    const_iterator operator--(int) {
+      const_iterator t = *this;
+      --i_;
+      return t;
+    }
+    const_iterator& operator+=(difference_type n) {
+      i_ += n;
+      return *this;
+    }
+    const_iterator& operator-=(difference_type n) {
+      i_ -= n;
+      return *this;
+    }
+    const_iterator operator+(difference_type n) const {
+      return const_iterator(ep_, i_ + n);
+    }
+    const_iterator operator-(difference_type n) const {
+      return const_iterator(ep_, i_ - n);
+    }
+    difference_type operator-(const const_iterator& o) const {
+      return i_ - o.i_;
+    }
+    bool operator==(const const_iterator& o) const {
+      return i_ == o.i_;
+    }
+    bool operator!=(const const_iterator& o) const {
+      return i_ != o.i_;
+    }
+    bool operator<(const const_iterator& o) const {
+      return i_ < o.i_;
+    }
+    bool operator>(const const_iterator& o) const {
+      return i_ > o.i_;
+    }
+    bool operator<=(const const_iterator& o) const {
+      return i_ <= o.i_;
+    }
+    bool operator>=(const const_iterator& o) const {
+      return i_ >= o.i_;
+    }
+  };
+
+  // Workers f through l inclusive.
+  Endpoint(int f, int l, int tag) :
+      first_(f), count_(l >= f ? l - f + 1 : 0), stride_(1), tag_(tag) {
+  }
+
+  // 'count' workers starting at 'first', 'stride' apart.
+  static Endpoint strided(int first, int count, int stride, int tag) {
+    ASSERT_GT(stride, 0);
+    Endpoint ep(first, first + count - 1, tag);
+    ep.stride_ = stride;
+    return ep;
+  }
+
+  // The workers in 'ranks', in that order.
+  static Endpoint list(const std::vector<int>& ranks, int tag) {
+    Endpoint ep(0, (int) ranks.size() - 1, tag);
+    ep.list_.reset(new std::vector<int>(ranks));
+    return ep;
   }
 
   int tag() const {
     return tag_;
   }
 
+  // The same group, under another tag.
+  Endpoint with_tag(int tag) const {
+    Endpoint ep = *this;
+    ep.tag_ = tag;
+    return ep;
+  }
+
   int count() const {
-    return v_.size();
+    return count_;
+  }
+
+  // Distance between consecutive workers of a range; 0 for lists.
+  int stride() const {
+    return list_ ? 0 : stride_;
+  }
+
+  // The i'th worker of the group.
+  int operator[](int i) const {
+    return list_ ? (*list_)[i] : first_ + i * stride_;
   }
 
-  std::vector<int>::const_iterator begin() const {
-    return v_.begin();
+  // The position of worker 'rank' in the group, or -1.  O(1) for ranges;
+  // lists are scanned.
+  int index_of(int rank) const {
+    if (list_) {
+      for (int i = 0; i < count_; ++i) {
+        if ((*list_)[i] == rank) {
+          return i;
+        }
+      }
+      return -1;
+    }
+    int d = rank - first_;
+    if (d < 0 || d % stride_ != 0 || d / stride_ >= count_) {
+      return -1;
+    }
+    return d / stride_;
+  }
+
+  bool contains(int rank) const {
+    return index_of(rank) >= 0;
+  }
+
+  // Identifies the group (not the tag) for RPC::cached().
+  GroupKey key() const {
+    GroupKey k;
+    if (list_) {
+      k.list = list_;
+      // FNV-1a.
+      k.list_hash = 14695981039346656037ULL;
+      for (int r : *list_) {
+        k.list_hash = (k.list_hash ^ (uint32_t) r) * 1099511628211ULL;
+      }
+    } else {
+      k.first = first_;
+      k.stride = count_ > 1 ? stride_ : 1;
+    }
+    k.count = count_;
+    return k;
+  }
+
+  const_iterator begin() const {
+    return const_iterator(this, 0);
   }
 
-  std::vector<int>::const_iterator end() const {
-    return v_.end();
+  const_iterator end() const {
+    return const_iterator(this, count_);
   }
 };
 
+// State derived from the group of 'ep' and 'salt', built from make() (which
+// returns a new T) on the first call and shared by later calls with the
+// same group on this RPC.
+template<class T, class F>
+boost::shared_ptr<T> group_state(RPC* rpc, const Endpoint& ep, uint64_t salt, F make) {
+  GroupKey key = ep.key();
+  key.salt = salt;
+  key.type = typeid(T).name();
+  return boost::static_pointer_cast<T>(rpc->cached(key, [&]() {
+    return boost::shared_ptr<void>(boost::shared_ptr<T>(make()));
+  }));
+}
+
 class ArrayLike {
 public:
   virtual const void* data_ptr() const = 0;
@@ -54,6 +232,12 @@ public:
   virtual void resize(size_t) = 0;
   virtual size_t element_size() const = 0;
   virtual size_t count() const= 0;
+
+  // The container's quantization mode and error feedback state, if it
+  // has them; see quantize.h.
+  virtual Quantizer* quantizer() const {
+    return NULL;
+  }
 };
 
 class ShardCalc {
@@ -75,6 +259,7 @@ public:
 };
 
 class Marshalled;
+class SparseArray;
 
 class Comm {
 protected:
@@ -94,12 +279,44 @@ public:
   }
 
   virtual void recv_pod(void* v, size_t len) = 0;
+
+  // True if a message is waiting from every worker a recv would read from,
+  // i.e. a recv on this comm would not block.
+  virtual bool poll() const = 0;
+
+  // Receive one whole message, leaving it in the transport's buffer.
+  virtual Buffer::Ptr recv_buffer() {
+    PANIC("Not implemented.");
+    return Buffer::Ptr();
+  }
+
   virtual void recv_array(ArrayLike& v) {
     size_t count;
     recv_pod(&count, sizeof(count));
     v.resize(count);
     return recv_pod(v.data_ptr(), v.element_size() * v.count());
   }
+
+  // send_array and recv_array for float and double arrays, encoded by 'q'
+  // as one message (per worker, for sharded comms).  Messages describe
+  // their own encoding.
+  virtual Request* send_quantized(const ArrayLike& v, const Quantization& q);
+  virtual void recv_quantized(ArrayLike& v);
+
+  // Sparse vectors as one message (per worker, for sharded comms), each
+  // encoded sparse or dense by its density; see sparse.h.
+  virtual Request* send_sparse(const SparseArray& v);
+  virtual void recv_sparse(SparseArray& v);
+
+  // Non-contiguous versions of send_pod and recv_pod; see Layout.
+  virtual Request* send_layout(const void* base, const Layout& layout) {
+    PANIC("Not implemented.");
+    return NULL;
+  }
+
+  virtual void recv_layout(void* base, const Layout& layout) {
+    PANIC("Not implemented.");
+  }
 };
 
 class AllComm: public Comm {
@@ -111,11 +328,14 @@ public:
   virtual Request* send_pod(const void* v, size_t len);
 
   virtual void recv_pod(void* v, size_t len);
+  virtual bool poll() const;
+  virtual Request* send_layout(const void* base, const Layout& layout);
 };
 
 class AnyComm: public Comm {
 private:
   int tgt_;
+  void wait_for_target();
 public:
   AnyComm(RPC* rpc, const Endpoint& ep) :
       Comm(rpc, ep), tgt_(-1) {
@@ -126,6 +346,9 @@ public:
   }
 
   virtual void recv_pod(void* v, size_t len);
+  virtual bool poll() const;
+  virtual Buffer::Ptr recv_buffer();
+  virtual void recv_layout(void* base, const Layout& layout);
 };
 
 class OneComm: public Comm {
@@ -136,12 +359,33 @@ public:
       Comm(rpc, ep), dst_(dst) {
   }
   virtual Request* send_pod(const void* v, size_t len) {
+    METRICS_COMM_SCOPE(kOneComm);
     return rpc_->send_data(dst_, ep_.tag(), v, len);
   }
 
   virtual void recv_pod(void* v, size_t len) {
+    METRICS_COMM_SCOPE(kOneComm);
     rpc_->recv_data(dst_, ep_.tag(), v, len);
   }
+
+  virtual bool poll() const {
+    return rpc_->poll(dst_, ep_.tag());
+  }
+
+  virtual Buffer::Ptr recv_buffer() {
+    METRICS_COMM_SCOPE(kOneComm);
+    return rpc_->recv_buffer(dst_, ep_.tag());
+  }
+
+  virtual Request* send_layout(const void* base, const Layout& layout) {
+    METRICS_COMM_SCOPE(kOneComm);
+    return rpc_->send_layout(dst_, ep_.tag(), base, layout);
+  }
+
+  virtual void recv_layout(void* base, const Layout& layout) {
+    METRICS_COMM_SCOPE(kOneComm);
+    rpc_->recv_layout(dst_, ep_.tag(), base, layout);
+  }
 };
 
 // The 'sharded' comm strategy doesn't actually require the top level object
@@ -152,6 +396,7 @@ public:
       Comm(rpc, ep) {
   }
   virtual Request* send_pod(const void* v, size_t len) {
+    METRICS_COMM_SCOPE(kShardedComm);
     RequestGroup *rg = new RequestGroup();
     for (auto d : ep_) {
       rg->add(rpc_->send_data(d, ep_.tag(), v, len));
@@ -160,9 +405,27 @@ public:
   }
 
   virtual void recv_pod(void* v, size_t len);
+  virtual bool poll() const;
+
+  virtual Request* send_layout(const void* base, const Layout& layout) {
+    METRICS_COMM_SCOPE(kShardedComm);
+    RequestGroup *rg = new RequestGroup();
+    for (auto d : ep_) {
+      rg->add(rpc_->send_layout(d, ep_.tag(), base, layout));
+    }
+    return rg;
+  }
 
   virtual Request* send_array(const ArrayLike& v);
   virtual void recv_array(ArrayLike& v);
+
+  // A worker's own part of 'v' is left as it is: it already holds the
+  // exact values it sent.
+  virtual Request* send_quantized(const ArrayLike& v, const Quantization& q);
+  virtual void recv_quantized(ArrayLike& v);
+
+  virtual Request* send_sparse(const SparseArray& v);
+  virtual void recv_sparse(SparseArray& v);
 };
 
 template<class T>
@@ -182,31 +445,67 @@ void recv(Comm& comm, T& v, typename boost::enable_if<boost::is_pod<T> >::type*
   comm.recv_pod(&v, sizeof(v));
 }
 
+// Pack 'v' into a single buffer with Serializer and send it as a size
+// followed by the packed bytes.
+template<class T>
+Request* send_packed(Comm& comm, const T& v) {
+  BufferRequest* br = new BufferRequest(Serializer<T>::size(v));
+  char* p = br->data();
+  Serializer<T>::pack(p, v);
+  size_t sz = br->size();
+  br->add(send(comm, sz));
+  br->add(comm.send_pod(br->data(), sz));
+  return br;
+}
+
+template<class T>
+void recv_packed(Comm& comm, T& v) {
+  size_t sz = recv<size_t>(comm);
+  boost::scoped_array<char> buf(new char[sz]);
+  comm.recv_pod(buf.get(), sz);
+  const char* p = buf.get();
+  Serializer<T>::unpack(p, v);
+}
+
+template<class T>
+Request* send(Comm& comm, const T& v,
+              typename boost::enable_if_c<Reflect<T>::defined && !boost::is_pod<T>::value>::type* = 0) {
+  return send_packed(comm, v);
+}
+
+template<class T>
+void recv(Comm& comm, T& v,
+          typename boost::enable_if_c<Reflect<T>::defined && !boost::is_pod<T>::value>::type* = 0) {
+  recv_packed(comm, v);
+}
+
+static inline Request* send(Comm& comm, const std::string& v) {
+  return send_packed(comm, v);
+}
+
+static inline void recv(Comm& comm, std::string& v) {
+  recv_packed(comm, v);
+}
+
 template<class V>
 Request* send(Comm& comm, const std::vector<V>& v) {
+  if (!boost::is_pod<V>::value) {
+    return send_packed(comm, v);
+  }
   RequestGroup* rg = new RequestGroup;
   rg->add(send(comm, v.size()));
-  if (boost::is_pod<V>::value) {
-    rg->add(comm.send_pod(v.data(), v.size() * sizeof(V)));
-  } else {
-    for (auto i : v) {
-      rg->add(send(comm, i));
-    }
-  }
+  rg->add(comm.send_pod(v.data(), v.size() * sizeof(V)));
   return rg;
 }
 
 template<class V>
 void recv(Comm& comm, std::vector<V>& v) {
+  if (!boost::is_pod<V>::value) {
+    return recv_packed(comm, v);
+  }
   size_t sz = recv<size_t>(comm);
   v.resize(sz);
-  if (boost::is_pod<V>::value) {
-    comm.recv_pod(&v[0], v.size() * sizeof(V));
-  } else {
-    for (auto i : v) {
-      recv(comm, i);
-    }
-  }
+  comm.recv_pod(v.data(), v.size() * sizeof(V));
 }
 
 // Like a vector, but should be sharded.
@@ -214,6 +513,7 @@ template<class V>
 class ShardedVector: public ArrayLike {
 private:
   std::vector<V> m_;
+  mutable Quantizer quant_;
 public:
   void* data_ptr() {
     return (void*) m_.data();
@@ -246,6 +546,16 @@ public:
   size_t element_size() const {
     return sizeof(V);
   }
+
+  // Send float and double vectors lossily; see quantize.h.
+  void set_quantization(const Quantization& q) {
+    static_assert(boost::is_floating_point<V>::value, "Only floating point vectors can be quantized.");
+    quant_.set_quantization(q);
+  }
+
+  Quantizer* quantizer() const {
+    return &quant_;
+  }
 };
 
 
@@ -254,11 +564,28 @@ Request* send(Comm& comm, const ShardedVector<V>& v) {
   if (!boost::is_pod<V>::value) {
     PANIC("Sharding non-pod types not supported.");
   }
-  return comm.send_array(v);
+  return send(comm, v, v.quantizer()->quantization());
 }
 
 template<class V>
 void recv(Comm& comm, ShardedVector<V>& v) {
+  return recv(comm, v, v.quantizer()->quantization());
+}
+
+// With the quantization 'q' for this call only.
+template<class V>
+Request* send(Comm& comm, const ShardedVector<V>& v, const Quantization& q) {
+  if (q.enabled()) {
+    return comm.send_quantized(v, q);
+  }
+  return comm.send_array(v);
+}
+
+template<class V>
+void recv(Comm& comm, ShardedVector<V>& v, const Quantization& q) {
+  if (q.enabled()) {
+    return comm.recv_quantized(v);
+  }
   return comm.recv_array(v);
 }
 
@@ -327,26 +654,39 @@ void recv(Comm& comm, V* v, size_t len) {
   recv(comm, f);
 }
 
+// 'count' elements 'stride' elements apart, e.g. a matrix column.  Unlike
+// send(comm, v, len) no count is sent; the receiver passes the same shape.
+template<class V>
+Request* send_strided(Comm& comm, const V* first, size_t count, size_t stride) {
+  return comm.send_layout(first, Layout::strided(count, sizeof(V), stride * sizeof(V)));
+}
+
+template<class V>
+void recv_strided(Comm& comm, V* first, size_t count, size_t stride) {
+  comm.recv_layout(first, Layout::strided(count, sizeof(V), stride * sizeof(V)));
+}
+
+// One field of each of 'count' structs:
+//   send_field(comm, particles, n, &Particle::mass)
+template<class S, class F>
+Request* send_field(Comm& comm, const S* s, size_t count, F S::*field) {
+  return comm.send_layout(&(s->*field), Layout::strided(count, sizeof(F), sizeof(S)));
+}
+
+template<class S, class F>
+void recv_field(Comm& comm, S* s, size_t count, F S::*field) {
+  comm.recv_layout(&(s->*field), Layout::strided(count, sizeof(F), sizeof(S)));
+}
+
 
 template<class K, class V>
 Request* send(Comm& comm, const std::map<K, V>& v) {
-  RequestGroup* rg = new RequestGroup;
-  rg->add(send(comm, v.size()));
-  for (auto i : v) {
-    rg->add(send(comm, i.first));
-    rg->add(send(comm, i.second));
-  }
-  return rg;
+  return send_packed(comm, v);
 }
 
 template<class K, class V>
 void recv(Comm& comm, std::map<K, V>& m) {
-  size_t sz = recv<size_t>(comm);
-  for (size_t i = 0; i < sz; ++i) {
-    K k;
-    recv(comm, k);
-    recv(comm, m[k]);
-  }
+  recv_packed(comm, m);
 }
 
 } // namespace synchromesh
@@ -0,0 +1,471 @@
+#include <atomic>
+#include <sstream>
+
+#include "metrics.h"
+
+namespace synchromesh {
+namespace metrics {
+
+#if SYNCHROMESH_METRICS
+thread_local CommKind current_kind = kRaw;
+#endif
+
+const char* comm_kind_name(CommKind kind) {
+  switch (kind) {
+  case kRaw:
+    return "RPC";
+  case kOneComm:
+    return "OneComm";
+  case kAllComm:
+    return "AllComm";
+  case kAnyComm:
+    return "AnyComm";
+  case kShardedComm:
+    return "ShardedComm";
+  case kHierComm:
+    return "HierComm";
+  default:
+    return "unknown";
+  }
+}
+
+Histogram::Histogram() :
+    total(0), sum_ns(0), max_ns(0) {
+  memset(counts, 0, sizeof(counts));
+}
+
+int Histogram::bucket_for(uint64_t ns) {
+  if (ns < (uint64_t) kSubBuckets) {
+    return ns;
+  }
+  int exp = 63 - __builtin_clzll(ns);
+  int sub = (ns >> (exp - kSubBits)) - kSubBuckets;
+  return (exp - kSubBits + 1) * kSubBuckets + sub;
+}
+
+uint64_t Histogram::bucket_value(int bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket;
+  }
+  int exp = bucket / kSubBuckets + kSubBits - 1;
+  uint64_t sub = bucket % kSubBuckets;
+  return (kSubBuckets + sub) << (exp - kSubBits);
+}
+
+void Histogram::record(uint64_t ns) {
+  counts[bucket_for(ns)] += 1;
+  total += 1;
+  sum_ns += ns;
+  if (ns > max_ns) {
+    max_ns = ns;
+  }
+}
+
+void Histogram::merge(const Histogram& other) {
+  for (int i = 0; i < kBuckets; ++i) {
+    counts[i] += other.counts[i];
+  }
+  total += other.total;
+  sum_ns += other.sum_ns;
+  if (other.max_ns > max_ns) {
+    max_ns = other.max_ns;
+  }
+}
+
+uint64_t Histogram::percentile(double p) const {
+  uint64_t target = p * total;
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    seen += counts[i];
+    if (counts[i] > 0 && seen >= target) {
+      return bucket_value(i);
+    }
+  }
+  return max_ns;
+}
+
+double Histogram::mean() const {
+  return total == 0 ? 0 : double(sum_ns) / total;
+}
+
+// Per-thread state.  Only the owning thread writes; snapshot() and reset()
+// read and clear with relaxed atomics from other threads.
+namespace {
+
+struct AtomicHistogram {
+  std::atomic<uint64_t> counts[Histogram::kBuckets];
+  std::atomic<uint64_t> total;
+  std::atomic<uint64_t> sum_ns;
+  std::atomic<uint64_t> max_ns;
+
+  void clear() {
+    for (int i = 0; i < Histogram::kBuckets; ++i) {
+      counts[i].store(0, std::memory_order_relaxed);
+    }
+    total.store(0, std::memory_order_relaxed);
+    sum_ns.store(0, std::memory_order_relaxed);
+    max_ns.store(0, std::memory_order_relaxed);
+  }
+
+  void record(uint64_t ns) {
+    std::atomic<uint64_t>& c = counts[Histogram::bucket_for(ns)];
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    total.store(total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum_ns.store(sum_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    if (ns > max_ns.load(std::memory_order_relaxed)) {
+      max_ns.store(ns, std::memory_order_relaxed);
+    }
+  }
+
+  void read(Histogram* h) const {
+    Histogram tmp;
+    for (int i = 0; i < Histogram::kBuckets; ++i) {
+      tmp.counts[i] = counts[i].load(std::memory_order_relaxed);
+    }
+    tmp.total = total.load(std::memory_order_relaxed);
+    tmp.sum_ns = sum_ns.load(std::memory_order_relaxed);
+    tmp.max_ns = max_ns.load(std::memory_order_relaxed);
+    h->merge(tmp);
+  }
+};
+
+struct Slot {
+  // 0 marks an empty slot; see pack().
+  std::atomic<uint64_t> key;
+  std::atomic<uint64_t> bytes_sent;
+  std::atomic<uint64_t> msgs_sent;
+  std::atomic<uint64_t> bytes_recv;
+  std::atomic<uint64_t> msgs_recv;
+
+  void clear() {
+    bytes_sent.store(0, std::memory_order_relaxed);
+    msgs_sent.store(0, std::memory_order_relaxed);
+    bytes_recv.store(0, std::memory_order_relaxed);
+    msgs_recv.store(0, std::memory_order_relaxed);
+  }
+};
+
+static inline void bump(std::atomic<uint64_t>& c, uint64_t v) {
+  c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+// Key layout: tag (32) | used (1) | peer + 1 (23) | kind (8).
+static inline uint64_t pack(int peer, int tag, CommKind kind) {
+  return ((uint64_t) (uint32_t) tag << 32) | (1ULL << 31)
+      | ((uint64_t) ((peer + 1) & 0x7fffff) << 8) | kind;
+}
+
+static inline void unpack(uint64_t key, PeerStats* s) {
+  s->tag = (int) (uint32_t) (key >> 32);
+  s->peer = (int) ((key >> 8) & 0x7fffff) - 1;
+  s->kind = (CommKind) (key & 0xff);
+}
+
+struct ThreadMetrics {
+  // Keys seen beyond kSlots distinct (peer, tag, kind) triples are folded
+  // into 'overflow', reported as peer -1, tag -1.
+  static const int kSlots = 1024;
+
+  std::atomic<int> rank;
+  Slot slots[kSlots];
+  Slot overflow;
+  AtomicHistogram send_latency;
+  AtomicHistogram recv_wait;
+
+  ThreadMetrics() {
+    rank.store(-1, std::memory_order_relaxed);
+    for (int i = 0; i < kSlots; ++i) {
+      slots[i].key.store(0, std::memory_order_relaxed);
+      slots[i].clear();
+    }
+    overflow.key.store(pack(-1, -1, kRaw), std::memory_order_relaxed);
+    overflow.clear();
+    send_latency.clear();
+    recv_wait.clear();
+  }
+
+  Slot& lookup(int peer, int tag, CommKind kind) {
+    uint64_t key = pack(peer, tag, kind);
+    size_t h = (key * 0x9e3779b97f4a7c15ULL) >> 54;
+    for (int probe = 0; probe < kSlots; ++probe) {
+      Slot& s = slots[(h + probe) % kSlots];
+      uint64_t k = s.key.load(std::memory_order_relaxed);
+      if (k == key) {
+        return s;
+      }
+      if (k == 0) {
+        s.key.store(key, std::memory_order_release);
+        return s;
+      }
+    }
+    return overflow;
+  }
+};
+
+// Snapshots are rare and may be written from short-lived threads, so their
+// counters are shared rather than per-thread.
+static AtomicHistogram snapshot_pause;
+static std::atomic<uint64_t> snapshot_bytes(0);
+static std::atomic<uint64_t> snapshot_write_ns(0);
+
+static boost::mutex registry_mutex;
+static std::vector<ThreadMetrics*> registry;
+static thread_local ThreadMetrics* local_metrics = NULL;
+
+static ThreadMetrics* thread_metrics() {
+  if (local_metrics == NULL) {
+    local_metrics = new ThreadMetrics;
+    boost::mutex::scoped_lock l(registry_mutex);
+    registry.push_back(local_metrics);
+  }
+  return local_metrics;
+}
+
+static void read_slot(const Slot& s, int rank, Snapshot* snap) {
+  uint64_t key = s.key.load(std::memory_order_acquire);
+  if (key == 0) {
+    return;
+  }
+
+  PeerStats p;
+  p.rank = rank;
+  unpack(key, &p);
+  p.bytes_sent = s.bytes_sent.load(std::memory_order_relaxed);
+  p.msgs_sent = s.msgs_sent.load(std::memory_order_relaxed);
+  p.bytes_recv = s.bytes_recv.load(std::memory_order_relaxed);
+  p.msgs_recv = s.msgs_recv.load(std::memory_order_relaxed);
+  if (p.msgs_sent + p.msgs_recv > 0) {
+    snap->peers.push_back(p);
+  }
+}
+
+static CommKind active_kind() {
+#if SYNCHROMESH_METRICS
+  return current_kind;
+#else
+  return kRaw;
+#endif
+}
+
+} // namespace
+
+void record_send(int rank, int dst, int tag, uint64_t bytes) {
+  ThreadMetrics* m = thread_metrics();
+  m->rank.store(rank, std::memory_order_relaxed);
+  Slot& s = m->lookup(dst, tag, active_kind());
+  bump(s.bytes_sent, bytes);
+  bump(s.msgs_sent, 1);
+}
+
+void record_recv(int rank, int src, int tag, uint64_t bytes, uint64_t wait_ns) {
+  ThreadMetrics* m = thread_metrics();
+  m->rank.store(rank, std::memory_order_relaxed);
+  Slot& s = m->lookup(src, tag, active_kind());
+  bump(s.bytes_recv, bytes);
+  bump(s.msgs_recv, 1);
+  m->recv_wait.record(wait_ns);
+}
+
+void record_send_complete(uint64_t latency_ns) {
+  thread_metrics()->send_latency.record(latency_ns);
+}
+
+void record_snapshot_pause(uint64_t ns) {
+  boost::mutex::scoped_lock l(registry_mutex);
+  snapshot_pause.record(ns);
+}
+
+void record_snapshot_write(uint64_t bytes, uint64_t ns) {
+  snapshot_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  snapshot_write_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+Snapshot snapshot() {
+  Snapshot snap;
+  boost::mutex::scoped_lock l(registry_mutex);
+  snapshot_pause.read(&snap.snapshot_pause);
+  snap.snapshot_bytes = snapshot_bytes.load(std::memory_order_relaxed);
+  snap.snapshot_write_ns = snapshot_write_ns.load(std::memory_order_relaxed);
+  for (auto m : registry) {
+    int rank = m->rank.load(std::memory_order_relaxed);
+    for (int i = 0; i < ThreadMetrics::kSlots; ++i) {
+      read_slot(m->slots[i], rank, &snap);
+    }
+    read_slot(m->overflow, rank, &snap);
+    m->send_latency.read(&snap.send_latency);
+    m->recv_wait.read(&snap.recv_wait);
+  }
+  return snap;
+}
+
+void reset() {
+  boost::mutex::scoped_lock l(registry_mutex);
+  snapshot_pause.clear();
+  snapshot_bytes.store(0, std::memory_order_relaxed);
+  snapshot_write_ns.store(0, std::memory_order_relaxed);
+  for (auto m : registry) {
+    for (int i = 0; i < ThreadMetrics::kSlots; ++i) {
+      m->slots[i].clear();
+    }
+    m->overflow.clear();
+    m->send_latency.clear();
+    m->recv_wait.clear();
+  }
+}
+
+static void histogram_json(std::ostringstream& out, const Histogram& h) {
+  out << "{\"count\": " << h.total
+      << ", \"mean\": " << h.mean()
+      << ", \"p50\": " << h.percentile(0.5)
+      << ", \"p90\": " << h.percentile(0.9)
+      << ", \"p99\": " << h.percentile(0.99)
+      << ", \"max\": " << h.max_ns << "}";
+}
+
+std::string Snapshot::to_json() const {
+  std::ostringstream out;
+  out << "{\"peers\": [";
+  for (size_t i = 0; i < peers.size(); ++i) {
+    const PeerStats& p = peers[i];
+    out << (i == 0 ? "" : ", ")
+        << "{\"rank\": " << p.rank
+        << ", \"peer\": " << p.peer
+        << ", \"tag\": " << p.tag
+        << ", \"comm\": \"" << comm_kind_name(p.kind) << "\""
+        << ", \"bytes_sent\": " << p.bytes_sent
+        << ", \"msgs_sent\": " << p.msgs_sent
+        << ", \"bytes_recv\": " << p.bytes_recv
+        << ", \"msgs_recv\": " << p.msgs_recv << "}";
+  }
+  out << "], \"send_latency_ns\": ";
+  histogram_json(out, send_latency);
+  out << ", \"recv_wait_ns\": ";
+  histogram_json(out, recv_wait);
+  out << ", \"snapshot_pause_ns\": ";
+  histogram_json(out, snapshot_pause);
+  double mb_per_s = snapshot_write_ns == 0 ? 0 : snapshot_bytes * 1e3 / snapshot_write_ns;
+  out << ", \"snapshot_bytes\": " << snapshot_bytes
+      << ", \"snapshot_mb_per_s\": " << mb_per_s << "}";
+  return out.str();
+}
+
+} // namespace metrics
+
+#if SYNCHROMESH_METRICS
+// Records the time from send_data() until the request is first observed
+// complete.
+class TimedRequest: public Request {
+private:
+  Request* req_;
+  uint64_t start_;
+  bool recorded_;
+
+  void complete() {
+    if (!recorded_) {
+      recorded_ = true;
+      metrics::record_send_complete(now_ns() - start_);
+    }
+  }
+
+public:
+  TimedRequest(Request* req) :
+      req_(req), start_(now_ns()), recorded_(false) {
+  }
+
+  ~TimedRequest() {
+    delete req_;
+  }
+
+  bool done() {
+    if (req_->done()) {
+      complete();
+      return true;
+    }
+    return false;
+  }
+
+  void wait() {
+    req_->wait();
+    complete();
+  }
+};
+
+Request* MetricsRPC::send_data(int dst, int tag, const void* ptr, int bytes) {
+  metrics::record_send(rpc_->id(), dst, tag, bytes);
+  return new TimedRequest(rpc_->send_data(dst, tag, ptr, bytes));
+}
+
+void MetricsRPC::recv_data(int src, int tag, void* ptr, int bytes) {
+  uint64_t start = now_ns();
+  rpc_->recv_data(src, tag, ptr, bytes);
+  metrics::record_recv(rpc_->id(), src, tag, bytes, now_ns() - start);
+}
+
+// Counted when posted; the wait is the caller's, not the transport's.
+Request* MetricsRPC::irecv_data(int src, int tag, void* ptr, int bytes) {
+  metrics::record_recv(rpc_->id(), src, tag, bytes, 0);
+  return rpc_->irecv_data(src, tag, ptr, bytes);
+}
+
+Buffer::Ptr MetricsRPC::recv_buffer(int src, int tag) {
+  uint64_t start = now_ns();
+  Buffer::Ptr buf = rpc_->recv_buffer(src, tag);
+  metrics::record_recv(rpc_->id(), src, tag, buf->size(), now_ns() - start);
+  return buf;
+}
+
+Request* MetricsRPC::send_layout(int dst, int tag, const void* base, const Layout& layout) {
+  metrics::record_send(rpc_->id(), dst, tag, layout.bytes());
+  return new TimedRequest(rpc_->send_layout(dst, tag, base, layout));
+}
+
+void MetricsRPC::recv_layout(int src, int tag, void* base, const Layout& layout) {
+  uint64_t start = now_ns();
+  rpc_->recv_layout(src, tag, base, layout);
+  metrics::record_recv(rpc_->id(), src, tag, layout.bytes(), now_ns() - start);
+}
+#else
+Request* MetricsRPC::send_data(int dst, int tag, const void* ptr, int bytes) {
+  return rpc_->send_data(dst, tag, ptr, bytes);
+}
+
+void MetricsRPC::recv_data(int src, int tag, void* ptr, int bytes) {
+  rpc_->recv_data(src, tag, ptr, bytes);
+}
+
+Request* MetricsRPC::irecv_data(int src, int tag, void* ptr, int bytes) {
+  return rpc_->irecv_data(src, tag, ptr, bytes);
+}
+
+Buffer::Ptr MetricsRPC::recv_buffer(int src, int tag) {
+  return rpc_->recv_buffer(src, tag);
+}
+
+Request* MetricsRPC::send_layout(int dst, int tag, const void* base, const Layout& layout) {
+  return rpc_->send_layout(dst, tag, base, layout);
+}
+
+void MetricsRPC::recv_layout(int src, int tag, void* base, const Layout& layout) {
+  rpc_->recv_layout(src, tag, base, layout);
+}
+#endif
+
+MetricsRPC::~MetricsRPC() {
+  for (auto& kv : channels_) {
+    delete kv.second;
+  }
+}
+
+RPC* MetricsRPC::channel(int c) {
+  if (c == 0) {
+    return this;
+  }
+  boost::mutex::scoped_lock l(channels_mu_);
+  MetricsRPC*& ch = channels_[c];
+  if (ch == NULL) {
+    ch = new MetricsRPC(rpc_->channel(c));
+  }
+  return ch;
+}
+
+} // namespace synchromesh
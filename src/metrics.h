@@ -0,0 +1,185 @@
+#ifndef SYNCHROMESH_METRICS_H
+#define SYNCHROMESH_METRICS_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "rpc.h"
+
+// Communication metrics.
+//
+// Wrap any RPC in a MetricsRPC to count bytes and messages by (peer, tag,
+// Comm type) and to record send-to-complete and recv-wait latencies:
+//
+//   MetricsRPC m(rpc);
+//   AllComm all(&m, ep);
+//   ...
+//   fprintf(stderr, "%s\n", metrics::snapshot().to_json().c_str());
+//
+// Counters live in per-thread tables that only their owning thread writes,
+// so recording never takes a lock.  Build with -DSYNCHROMESH_METRICS=0 to
+// compile the recording hooks out entirely.
+#ifndef SYNCHROMESH_METRICS
+#define SYNCHROMESH_METRICS 1
+#endif
+
+namespace synchromesh {
+namespace metrics {
+
+// The Comm strategy a message was sent or received through.
+enum CommKind {
+  kRaw = 0,
+  kOneComm = 1,
+  kAllComm = 2,
+  kAnyComm = 3,
+  kShardedComm = 4,
+  kHierComm = 5,
+  kNumCommKinds = 6,
+};
+
+const char* comm_kind_name(CommKind kind);
+
+// Log-linear (HDR-style) histogram of nanosecond latencies.  Each power of
+// two is split into kSubBuckets linear buckets, for ~12% relative error.
+class Histogram {
+public:
+  static const int kSubBits = 3;
+  static const int kSubBuckets = 1 << kSubBits;
+  static const int kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+  uint64_t counts[kBuckets];
+  uint64_t total;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+
+  Histogram();
+
+  void record(uint64_t ns);
+  void merge(const Histogram& other);
+
+  // Smallest bucket value below which a fraction 'p' of samples fall.
+  uint64_t percentile(double p) const;
+  double mean() const;
+
+  static int bucket_for(uint64_t ns);
+  static uint64_t bucket_value(int bucket);
+};
+
+struct PeerStats {
+  int rank;
+  int peer;
+  int tag;
+  CommKind kind;
+  uint64_t bytes_sent;
+  uint64_t msgs_sent;
+  uint64_t bytes_recv;
+  uint64_t msgs_recv;
+};
+
+struct Snapshot {
+  std::vector<PeerStats> peers;
+  Histogram send_latency;
+  Histogram recv_wait;
+
+  // Background checkpoints: how long the application was paused to take
+  // each snapshot, and the bytes and time spent writing them out.
+  Histogram snapshot_pause;
+  uint64_t snapshot_bytes = 0;
+  uint64_t snapshot_write_ns = 0;
+
+  std::string to_json() const;
+};
+
+// Aggregate the counters of every thread that has recorded anything.
+Snapshot snapshot();
+
+// Zero all counters and histograms.  Updates racing with a reset may be
+// lost.
+void reset();
+
+void record_send(int rank, int dst, int tag, uint64_t bytes);
+void record_recv(int rank, int src, int tag, uint64_t bytes, uint64_t wait_ns);
+void record_send_complete(uint64_t latency_ns);
+void record_snapshot_pause(uint64_t ns);
+void record_snapshot_write(uint64_t bytes, uint64_t ns);
+
+#if SYNCHROMESH_METRICS
+extern thread_local CommKind current_kind;
+
+// Attribute traffic on this thread to 'kind' until the scope exits.
+class CommScope {
+private:
+  CommKind prev_;
+public:
+  CommScope(CommKind kind) :
+      prev_(current_kind) {
+    current_kind = kind;
+  }
+
+  ~CommScope() {
+    current_kind = prev_;
+  }
+};
+
+#define METRICS_COMM_SCOPE(kind)\
+    synchromesh::metrics::CommScope metrics_scope_(synchromesh::metrics::kind)
+#else
+#define METRICS_COMM_SCOPE(kind)
+#endif
+
+} // namespace metrics
+
+// An RPC decorator which records traffic through 'rpc' before forwarding.
+class MetricsRPC: public RPC {
+private:
+  RPC* rpc_;
+  // Wrappers of rpc_'s other channels, made on first use.
+  boost::mutex channels_mu_;
+  std::map<int, MetricsRPC*> channels_;
+public:
+  MetricsRPC(RPC* rpc) :
+      rpc_(rpc) {
+  }
+
+  ~MetricsRPC();
+
+  Request* send_data(int dst, int tag, const void* ptr, int bytes);
+  void recv_data(int src, int tag, void* ptr, int bytes);
+  Request* irecv_data(int src, int tag, void* ptr, int bytes);
+  Buffer::Ptr recv_buffer(int src, int tag);
+  Request* send_layout(int dst, int tag, const void* base, const Layout& layout);
+  void recv_layout(int src, int tag, void* base, const Layout& layout);
+
+  bool poll(int src, int tag) const {
+    return rpc_->poll(src, tag);
+  }
+
+  int first() const {
+    return rpc_->first();
+  }
+
+  int last() const {
+    return rpc_->last();
+  }
+
+  int id() const {
+    return rpc_->id();
+  }
+
+  int num_workers() const {
+    return rpc_->num_workers();
+  }
+
+  std::vector<int> node_map() const {
+    return rpc_->node_map();
+  }
+
+  // Channel 'c' of the wrapped RPC, recorded the same way.
+  RPC* channel(int c);
+};
+
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_METRICS_H */
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <climits>
+
+#include "ndarray.h"
+
+namespace synchromesh {
+
+ProcessGrid::ProcessGrid(const Endpoint& ep, const std::vector<int>& dims) :
+    ep_(ep), dims_(dims) {
+  int size = 1;
+  strides_.resize(dims_.size());
+  for (int d = dims_.size() - 1; d >= 0; --d) {
+    strides_[d] = size;
+    size *= dims_[d];
+  }
+  ASSERT_EQ(size, ep.count());
+}
+
+// Deal the prime factors of the size, largest first, to the smallest
+// dimension so far.
+ProcessGrid ProcessGrid::balanced(const Endpoint& ep, int ndims) {
+  std::vector<int> factors;
+  int n = ep.count();
+  for (int f = 2; f * f <= n; ++f) {
+    while (n % f == 0) {
+      factors.push_back(f);
+      n /= f;
+    }
+  }
+  if (n > 1) {
+    factors.push_back(n);
+  }
+
+  std::vector<int> dims(ndims, 1);
+  for (auto f = factors.rbegin(); f != factors.rend(); ++f) {
+    *std::min_element(dims.begin(), dims.end()) *= *f;
+  }
+  std::sort(dims.rbegin(), dims.rend());
+  return ProcessGrid(ep, dims);
+}
+
+DimMap::DimMap(size_t extent, int p, const Dist& d) :
+    n(extent), procs(p) {
+  if (d.kind == Dist::kBlock) {
+    block = std::max<size_t>(1, (n + procs - 1) / procs);
+  } else {
+    ASSERT_GT(d.block_size, 0);
+    block = d.block_size;
+  }
+}
+
+size_t DimMap::count(int coord) const {
+  size_t blocks = n / block;
+  size_t c = (blocks / procs) * block;
+  size_t extra = blocks % procs;
+  if ((size_t) coord < extra) {
+    c += block;
+  } else if ((size_t) coord == extra) {
+    c += n % block;
+  }
+  return c;
+}
+
+namespace ndarray {
+
+void exchange(RPC* rpc, const ProcessGrid& grid, int me,
+              std::vector<std::vector<char> >& out, std::vector<std::vector<char> >& in) {
+  const int n = grid.size();
+  ASSERT_EQ(in[me].size(), out[me].size());
+  in[me].swap(out[me]);
+
+  RequestGroup rg;
+  for (int k = 1; k < n; ++k) {
+    int peer = (me + k) % n;
+    if (!out[peer].empty()) {
+      ASSERT_LE(out[peer].size(), (size_t) INT_MAX);
+      rg.add(rpc->send_data(grid.worker(peer), grid.tag(), out[peer].data(), out[peer].size()));
+    }
+  }
+  for (int k = 1; k < n; ++k) {
+    int peer = (me - k + n) % n;
+    if (!in[peer].empty()) {
+      rpc->recv_data(grid.worker(peer), grid.tag(), in[peer].data(), in[peer].size());
+    }
+  }
+  rg.wait();
+}
+
+} // namespace ndarray
+
+} // namespace synchromesh
@@ -0,0 +1,435 @@
+#ifndef SYNCHROMESH_NDARRAY_H
+#define SYNCHROMESH_NDARRAY_H
+
+#include <array>
+#include <vector>
+
+#include "util.h"
+#include "rpc.h"
+#include "datatype.h"
+#include "soa.h"
+
+// N-dimensional arrays distributed over a process grid.
+//
+// Dimension d of a ShardedArray is split over dimension d of a
+// ProcessGrid, in blocks or block-cyclically; a grid dimension of 1 keeps
+// that array dimension whole on every rank.  Each rank stores its part as
+// a dense row-major local array:
+//
+//   ProcessGrid rows(Endpoint(0, rpc->last(), kTag), { rpc->num_workers(), 1 });
+//   ShardedArray<double, 2> a(rpc, rows, { 1024, 512 }, { Dist::block(), Dist::block() });
+//   for (size_t i = 0; i < a.local_shape(0); ++i)
+//     for (size_t j = 0; j < a.local_shape(1); ++j)
+//       a.local(i, j) = f(a.global_index(0, i), a.global_index(1, j));
+//
+//   ProcessGrid cols(Endpoint(0, rpc->last(), kTag), { 1, rpc->num_workers() });
+//   ShardedArray<double, 2> b(rpc, cols, { 1024, 512 }, { Dist::block(), Dist::block() });
+//   redistribute(a, &b);
+//
+// redistribute() converts between any two distributions over the same
+// ranks, optionally permuting the axes (transpose()), with one message per
+// pair of ranks that share elements.
+namespace synchromesh {
+
+// How one array dimension is split over its grid dimension.
+struct Dist {
+  enum Kind {
+    kBlock = 0,
+    kCyclic = 1,
+  };
+
+  Kind kind;
+  size_t block_size;
+
+  // One contiguous block per process.
+  static Dist block() {
+    Dist d = { kBlock, 0 };
+    return d;
+  }
+
+  // Blocks of 'b' elements dealt round-robin.
+  static Dist cyclic(size_t b = 1) {
+    Dist d = { kCyclic, b };
+    return d;
+  }
+};
+
+// A logical grid of the ranks in an Endpoint, in row-major order.
+class ProcessGrid {
+private:
+  Endpoint ep_;
+  std::vector<int> dims_;
+  std::vector<int> strides_;
+public:
+  ProcessGrid(const Endpoint& ep, const std::vector<int>& dims);
+
+  // A grid of 'ndims' dimensions as close to square as possible.
+  static ProcessGrid balanced(const Endpoint& ep, int ndims);
+
+  int ndims() const {
+    return dims_.size();
+  }
+
+  int dim(int d) const {
+    return dims_[d];
+  }
+
+  int size() const {
+    return ep_.count();
+  }
+
+  int tag() const {
+    return ep_.tag();
+  }
+
+  // The worker at grid position 'index' (row-major), and back.
+  int worker(int index) const {
+    return ep_[index];
+  }
+
+  int index_of(int worker) const {
+    return ep_.index_of(worker);
+  }
+
+  int stride(int d) const {
+    return strides_[d];
+  }
+
+  int coord(int index, int d) const {
+    return index / strides_[d] % dims_[d];
+  }
+};
+
+// The mapping between global and local indices along one dimension.
+// Block distributions are block-cyclic with one block per process.
+struct DimMap {
+  size_t n;
+  size_t procs;
+  size_t block;
+
+  DimMap() :
+      n(0), procs(1), block(1) {
+  }
+
+  DimMap(size_t extent, int p, const Dist& d);
+
+  int owner(size_t g) const {
+    return (g / block) % procs;
+  }
+
+  size_t local(size_t g) const {
+    return (g / (block * procs)) * block + g % block;
+  }
+
+  size_t global(int coord, size_t l) const {
+    return ((l / block) * procs + coord) * block + l % block;
+  }
+
+  size_t count(int coord) const;
+};
+
+template<class V, size_t N>
+class ShardedArray {
+public:
+  typedef std::array<size_t, N> Index;
+
+private:
+  RPC* rpc_;
+  ProcessGrid grid_;
+  Index shape_;
+  std::array<DimMap, N> maps_;
+  int me_;
+  Index local_shape_;
+  Index local_strides_;
+  std::vector<V, AlignedAllocator<V> > data_;
+
+public:
+  ShardedArray(RPC* rpc, const ProcessGrid& grid, const Index& shape,
+               const std::array<Dist, N>& dists) :
+      rpc_(rpc), grid_(grid), shape_(shape) {
+    ASSERT_EQ(grid.ndims(), (int) N);
+    me_ = grid.index_of(rpc->id());
+    ASSERT_GE(me_, 0);
+    size_t total = 1;
+    for (int d = N - 1; d >= 0; --d) {
+      maps_[d] = DimMap(shape[d], grid.dim(d), dists[d]);
+      local_shape_[d] = maps_[d].count(grid.coord(me_, d));
+      local_strides_[d] = total;
+      total *= local_shape_[d];
+    }
+    data_.resize(total);
+  }
+
+  RPC* rpc() const {
+    return rpc_;
+  }
+
+  const ProcessGrid& grid() const {
+    return grid_;
+  }
+
+  const DimMap& dim_map(int d) const {
+    return maps_[d];
+  }
+
+  size_t shape(int d) const {
+    return shape_[d];
+  }
+
+  const Index& shape() const {
+    return shape_;
+  }
+
+  size_t local_shape(int d) const {
+    return local_shape_[d];
+  }
+
+  size_t local_stride(int d) const {
+    return local_strides_[d];
+  }
+
+  size_t local_size() const {
+    return data_.size();
+  }
+
+  V* local_data() {
+    return data_.data();
+  }
+
+  const V* local_data() const {
+    return data_.data();
+  }
+
+  // This rank's position along grid dimension 'd'.
+  int coord(int d) const {
+    return grid_.coord(me_, d);
+  }
+
+  size_t global_index(int d, size_t local) const {
+    return maps_[d].global(coord(d), local);
+  }
+
+  // The worker holding global element 'g'.
+  int owner(const Index& g) const {
+    int index = 0;
+    for (size_t d = 0; d < N; ++d) {
+      index += maps_[d].owner(g[d]) * grid_.stride(d);
+    }
+    return grid_.worker(index);
+  }
+
+  bool is_local(const Index& g) const {
+    for (size_t d = 0; d < N; ++d) {
+      if (maps_[d].owner(g[d]) != coord(d)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template<class... I>
+  V& local(I... idx) {
+    static_assert(sizeof...(I) == N, "wrong number of indices");
+    return data_[offset(Index { (size_t) idx... })];
+  }
+
+  template<class... I>
+  const V& local(I... idx) const {
+    static_assert(sizeof...(I) == N, "wrong number of indices");
+    return data_[offset(Index { (size_t) idx... })];
+  }
+
+  size_t offset(const Index& l) const {
+    size_t off = 0;
+    for (size_t d = 0; d < N; ++d) {
+      off += l[d] * local_strides_[d];
+    }
+    return off;
+  }
+
+  // The element at global index 'g', which must be local.
+  V& at(const Index& g) {
+    Index l;
+    for (size_t d = 0; d < N; ++d) {
+      l[d] = maps_[d].local(g[d]);
+    }
+    return data_[offset(l)];
+  }
+};
+
+namespace ndarray {
+
+// Per-dimension tables used to walk one rank's local elements: for each
+// local index along each dimension, the contribution to the peer's grid
+// index and to the element's local offset.
+struct Walk {
+  std::vector<std::vector<int> > peer;
+  std::vector<std::vector<size_t> > offset;
+  std::vector<size_t> extent;
+};
+
+// Visit the local elements of an array in the nesting order 'order' (the
+// outermost dimension first), calling f(peer grid index, local offset).
+template<class F>
+void walk(const Walk& w, const std::vector<int>& order, F f) {
+  const size_t n = order.size();
+  for (auto e : w.extent) {
+    if (e == 0) {
+      return;
+    }
+  }
+
+  std::vector<size_t> idx(n, 0);
+  std::vector<int> peer(n + 1, 0);
+  std::vector<size_t> off(n + 1, 0);
+  size_t d = 0;
+  while (true) {
+    // Fill in the running sums down to the innermost dimension.
+    for (; d + 1 < n; ++d) {
+      int dim = order[d];
+      peer[d + 1] = peer[d] + w.peer[dim][idx[d]];
+      off[d + 1] = off[d] + w.offset[dim][idx[d]];
+    }
+
+    // The innermost dimension is a tight loop.
+    int inner = order[n - 1];
+    const std::vector<int>& ip = w.peer[inner];
+    const std::vector<size_t>& io = w.offset[inner];
+    for (size_t i = 0; i < w.extent[inner]; ++i) {
+      f(peer[n - 1] + ip[i], off[n - 1] + io[i]);
+    }
+
+    // Advance the odometer over the outer dimensions.
+    if (n == 1) {
+      return;
+    }
+    d = n - 2;
+    while (true) {
+      if (++idx[d] < w.extent[order[d]]) {
+        break;
+      }
+      idx[d] = 0;
+      if (d == 0) {
+        return;
+      }
+      --d;
+    }
+  }
+}
+
+// Exchange per-peer buffers: one message to and from each grid index with
+// a non-zero count, in pairwise order.  'out' and 'in' are indexed by grid
+// index; our own buffer is swapped rather than sent.
+void exchange(RPC* rpc, const ProcessGrid& grid, int me,
+              std::vector<std::vector<char> >& out, std::vector<std::vector<char> >& in);
+
+} // namespace ndarray
+
+// Copy 'src' into 'dst', which must have the same shape after permuting
+// its axes: dst[g[perm[0]], ..., g[perm[N-1]]] = src[g].  Every rank of
+// either grid must call this; both grids must cover the same ranks.
+template<class V, size_t N>
+void redistribute(const ShardedArray<V, N>& src, ShardedArray<V, N>* dst,
+                  const std::array<int, N>& perm) {
+  const ProcessGrid& sg = src.grid();
+  const ProcessGrid& dg = dst->grid();
+  ASSERT_EQ(sg.size(), dg.size());
+  for (size_t k = 0; k < N; ++k) {
+    ASSERT_EQ(dst->shape(k), src.shape(perm[k]));
+  }
+
+  // Both sides walk the elements they share in dst's global row-major
+  // order: dst in its own local order, src with its loops nested by
+  // 'perm'.  Per-dimension maps are monotonic, so the orders agree.
+  std::vector<int> src_order(perm.begin(), perm.end());
+  std::vector<int> dst_order(N);
+  ndarray::Walk sw, dw;
+  sw.peer.resize(N);
+  sw.offset.resize(N);
+  sw.extent.resize(N);
+  dw.peer.resize(N);
+  dw.offset.resize(N);
+  dw.extent.resize(N);
+  for (size_t k = 0; k < N; ++k) {
+    dst_order[k] = k;
+    int s = perm[k];
+
+    sw.extent[s] = src.local_shape(s);
+    for (size_t l = 0; l < sw.extent[s]; ++l) {
+      size_t g = src.global_index(s, l);
+      sw.peer[s].push_back(dst->dim_map(k).owner(g) * dg.stride(k));
+      sw.offset[s].push_back(l * src.local_stride(s));
+    }
+
+    dw.extent[k] = dst->local_shape(k);
+    for (size_t l = 0; l < dw.extent[k]; ++l) {
+      size_t g = dst->global_index(k, l);
+      dw.peer[k].push_back(src.dim_map(s).owner(g) * sg.stride(s));
+      dw.offset[k].push_back(l * dst->local_stride(k));
+    }
+  }
+
+  // Peers are exchanged by dst grid index on the send side and src grid
+  // index on the receive side; translate both to src grid indices.
+  const int n = sg.size();
+  std::vector<int> dst_to_src(n);
+  for (int i = 0; i < n; ++i) {
+    dst_to_src[i] = sg.index_of(dg.worker(i));
+    ASSERT_GE(dst_to_src[i], 0);
+  }
+  const int me = sg.index_of(src.rpc()->id());
+
+  std::vector<size_t> counts(n, 0);
+  ndarray::walk(sw, src_order, [&](int peer, size_t) {
+    ++counts[dst_to_src[peer]];
+  });
+
+  std::vector<std::vector<char> > out(n), in(n);
+  std::vector<V*> pos(n);
+  for (int i = 0; i < n; ++i) {
+    out[i].resize(counts[i] * sizeof(V));
+    pos[i] = (V*) out[i].data();
+  }
+  const V* s = src.local_data();
+  ndarray::walk(sw, src_order, [&](int peer, size_t off) {
+    *pos[dst_to_src[peer]]++ = s[off];
+  });
+
+  std::fill(counts.begin(), counts.end(), 0);
+  ndarray::walk(dw, dst_order, [&](int peer, size_t) {
+    ++counts[peer];
+  });
+  for (int i = 0; i < n; ++i) {
+    in[i].resize(counts[i] * sizeof(V));
+  }
+
+  ndarray::exchange(src.rpc(), sg, me, out, in);
+
+  std::vector<const V*> rpos(n);
+  for (int i = 0; i < n; ++i) {
+    rpos[i] = (const V*) in[i].data();
+  }
+  V* d = dst->local_data();
+  ndarray::walk(dw, dst_order, [&](int peer, size_t off) {
+    d[off] = *rpos[peer]++;
+  });
+}
+
+template<class V, size_t N>
+void redistribute(const ShardedArray<V, N>& src, ShardedArray<V, N>* dst) {
+  std::array<int, N> perm;
+  for (size_t k = 0; k < N; ++k) {
+    perm[k] = k;
+  }
+  redistribute(src, dst, perm);
+}
+
+// dst = src^T for 2-D arrays.
+template<class V>
+void transpose(const ShardedArray<V, 2>& src, ShardedArray<V, 2>* dst) {
+  redistribute(src, dst, std::array<int, 2> { 1, 0 });
+}
+
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_NDARRAY_H */
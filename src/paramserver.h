@@ -0,0 +1,306 @@
+#ifndef SYNCHROMESH_PARAMSERVER_H
+#define SYNCHROMESH_PARAMSERVER_H
+
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <vector>
+
+#include "util.h"
+#include "rpc.h"
+#include "datatype.h"
+#include "sparse.h"
+
+// A parameter server with bounded staleness (stale synchronous parallel).
+//
+// The state is sharded over the 'servers' ranks by ShardCalc.  Worker
+// ranks push updates, which servers add in, and pull the whole state,
+// without waiting for each other:
+//
+//   ParamServer<double> ps(rpc, servers, workers, n, 2);
+//   if (servers.contains(rpc->id())) {
+//     init(ps.shard(), ps.shard_size());
+//     ps.serve();                      // until every worker finishes
+//   } else {
+//     for (int epoch = 0; epoch < epochs; ++epoch) {
+//       const std::vector<double>& w = ps.pull();
+//       delete ps.push(gradient(w));
+//       ps.clock();
+//     }
+//     ps.finish();
+//   }
+//
+// A worker that has called clock() c times sees, in pull(), every update
+// pushed before clock() by every worker up to epoch c - staleness - 1, and
+// all of its own.  It only waits when it is more than 'staleness' epochs
+// ahead of the slowest worker; staleness 0 is bulk synchronous.  Servers
+// and workers must be different ranks, and requests and replies use the
+// tags of 'servers' and 'workers'.
+namespace synchromesh {
+
+template<class V>
+class ParamServer {
+private:
+  enum Type {
+    kPush = 0,
+    kPushSparse = 1,
+    kPull = 2,
+    kClock = 3,
+    kFinish = 4,
+  };
+
+  struct Header {
+    int32_t type;
+    // Position in the workers endpoint.
+    int32_t worker;
+    // kPull, kClock: the worker's clock.  Replies: the slowest worker's.
+    int64_t clock;
+  };
+
+  static const int64_t kFinished = std::numeric_limits<int64_t>::max();
+
+  RPC* rpc_;
+  Endpoint servers_;
+  Endpoint workers_;
+  size_t size_;
+  int staleness_;
+  ShardCalc sc_;
+
+  // Server.
+  int server_;
+  std::vector<V> shard_;
+  std::vector<int64_t> clocks_;
+  // Pulls waiting for the slowest worker: (worker, clock).
+  std::deque<std::pair<int, int64_t> > pending_;
+
+  // Worker.
+  int worker_;
+  int64_t clock_;
+  std::vector<V> view_;
+  // For each server, the slowest clock its part of view_ reflects.
+  std::vector<int64_t> fresh_;
+  uint64_t stall_ns_;
+
+  int64_t min_clock() const {
+    return *std::min_element(clocks_.begin(), clocks_.end());
+  }
+
+  void reply(int w) {
+    BufferRequest br(sizeof(Header) + shard_.size() * sizeof(V));
+    Header h = { kPull, server_, min_clock() };
+    memcpy(br.data(), &h, sizeof(h));
+    memcpy(br.data() + sizeof(h), shard_.data(), shard_.size() * sizeof(V));
+    br.add(rpc_->send_data(workers_[w], workers_.tag(), br.data(), br.size()));
+    br.wait();
+  }
+
+  // Answer the pulls the slowest worker now allows.
+  void answer_pending() {
+    const int64_t slowest = min_clock();
+    for (auto it = pending_.begin(); it != pending_.end();) {
+      if (it->second - staleness_ <= slowest) {
+        reply(it->first);
+        it = pending_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // Send a control message to every server.
+  void broadcast(Type type) {
+    Header h = { type, worker_, clock_ };
+    RequestGroup rg;
+    for (auto s : servers_) {
+      rg.add(rpc_->send_data(s, servers_.tag(), &h, sizeof(h)));
+    }
+    rg.wait();
+  }
+
+public:
+  // Every rank of 'servers' and 'workers' constructs one with the same
+  // arguments.
+  ParamServer(RPC* rpc, const Endpoint& servers, const Endpoint& workers, size_t size,
+              int staleness) :
+      rpc_(rpc), servers_(servers), workers_(workers), size_(size), staleness_(staleness),
+      sc_(size, sizeof(V), servers.count()), server_(servers.index_of(rpc->id())),
+      worker_(workers.index_of(rpc->id())), clock_(0), stall_ns_(0) {
+    ASSERT_GE(staleness, 0);
+    ASSERT(server_ < 0 || worker_ < 0, "Rank %d can't be both server and worker.", rpc->id());
+    if (server_ >= 0) {
+      shard_.resize(sc_.num_elems(server_));
+      clocks_.assign(workers.count(), 0);
+    }
+    if (worker_ >= 0) {
+      view_.resize(size);
+      fresh_.assign(servers.count(), -1);
+    }
+  }
+
+  // Server: this rank's part of the state, elements [shard_start(),
+  // shard_start() + shard_size()).
+  V* shard() {
+    return shard_.data();
+  }
+
+  size_t shard_start() {
+    return sc_.start_elem(server_);
+  }
+
+  size_t shard_size() const {
+    return shard_.size();
+  }
+
+  // Server: handle pushes and pulls until every worker has finished.
+  void serve() {
+    ASSERT_GE(server_, 0);
+    int finished = 0;
+    while (finished < workers_.count()) {
+      Buffer::Ptr msg = rpc_->recv_buffer(RPC::kAnyWorker, servers_.tag());
+      Header h;
+      ASSERT_GE(msg->size(), sizeof(h));
+      memcpy(&h, msg->data(), sizeof(h));
+      const char* body = msg->data() + sizeof(h);
+      const size_t body_bytes = msg->size() - sizeof(h);
+
+      switch (h.type) {
+      case kPush: {
+        ASSERT_EQ(body_bytes, shard_.size() * sizeof(V));
+        const V* u = (const V*) body;
+        for (size_t i = 0; i < shard_.size(); ++i) {
+          shard_[i] += u[i];
+        }
+        break;
+      }
+      case kPushSparse: {
+        SparseShardedVector<V> u;
+        u.append_encoded(body, body_bytes);
+        ASSERT_EQ(u.size(), shard_.size());
+        for (size_t k = 0; k < u.nnz(); ++k) {
+          shard_[u.indices()[k]] += u.values()[k];
+        }
+        break;
+      }
+      case kPull:
+        if (h.clock - staleness_ <= min_clock()) {
+          reply(h.worker);
+        } else {
+          pending_.push_back(std::make_pair(h.worker, h.clock));
+        }
+        break;
+      case kClock:
+        clocks_[h.worker] = h.clock;
+        answer_pending();
+        break;
+      case kFinish:
+        clocks_[h.worker] = kFinished;
+        ++finished;
+        answer_pending();
+        break;
+      default:
+        PANIC("Unknown parameter server message %d.", h.type);
+      }
+    }
+    ASSERT(pending_.empty(), "Pulls left waiting after every worker finished.");
+  }
+
+  // Worker: add 'update' (size() values) to the state.  Also applied to
+  // this worker's view at once.
+  Request* push(const V* update) {
+    ASSERT_GE(worker_, 0);
+    RequestGroup* rg = new RequestGroup;
+    for (int s = 0; s < servers_.count(); ++s) {
+      const size_t count = sc_.num_elems(s);
+      BufferRequest* br = new BufferRequest(sizeof(Header) + count * sizeof(V));
+      Header h = { kPush, worker_, clock_ };
+      memcpy(br->data(), &h, sizeof(h));
+      memcpy(br->data() + sizeof(h), update + sc_.start_elem(s), count * sizeof(V));
+      br->add(rpc_->send_data(servers_[s], servers_.tag(), br->data(), br->size()));
+      rg->add(br);
+    }
+    for (size_t i = 0; i < size_; ++i) {
+      view_[i] += update[i];
+    }
+    return rg;
+  }
+
+  Request* push(const std::vector<V>& update) {
+    ASSERT_EQ(update.size(), size_);
+    return push(update.data());
+  }
+
+  // Only the stored entries are sent, each server's range encoded sparse
+  // or dense by its density.
+  Request* push(const SparseShardedVector<V>& update) {
+    ASSERT_GE(worker_, 0);
+    ASSERT_EQ(update.size(), size_);
+    RequestGroup* rg = new RequestGroup;
+    for (int s = 0; s < servers_.count(); ++s) {
+      const size_t first = sc_.start_elem(s);
+      const size_t count = sc_.num_elems(s);
+      BufferRequest* br = new BufferRequest(sizeof(Header) + update.encoded_bytes(first, count));
+      Header h = { kPushSparse, worker_, clock_ };
+      memcpy(br->data(), &h, sizeof(h));
+      update.encode(first, count, br->data() + sizeof(h));
+      br->add(rpc_->send_data(servers_[s], servers_.tag(), br->data(), br->size()));
+      rg->add(br);
+    }
+    for (size_t k = 0; k < update.nnz(); ++k) {
+      view_[update.indices()[k]] += update.values()[k];
+    }
+    return rg;
+  }
+
+  // Worker: the state, within the staleness bound.  Servers whose part of
+  // the view is still fresh enough are not asked again.
+  const std::vector<V>& pull() {
+    ASSERT_GE(worker_, 0);
+    const uint64_t start = now_ns();
+    std::vector<int> asked;
+    Header h = { kPull, worker_, clock_ };
+    RequestGroup rg;
+    for (int s = 0; s < servers_.count(); ++s) {
+      if (fresh_[s] < clock_ - staleness_) {
+        rg.add(rpc_->send_data(servers_[s], servers_.tag(), &h, sizeof(h)));
+        asked.push_back(s);
+      }
+    }
+    for (auto s : asked) {
+      Buffer::Ptr msg = rpc_->recv_buffer(servers_[s], workers_.tag());
+      ASSERT_EQ(msg->size(), sizeof(Header) + sc_.num_elems(s) * sizeof(V));
+      Header r;
+      memcpy(&r, msg->data(), sizeof(r));
+      fresh_[s] = r.clock;
+      memcpy(&view_[sc_.start_elem(s)], msg->data() + sizeof(r), sc_.num_elems(s) * sizeof(V));
+    }
+    rg.wait();
+    stall_ns_ += now_ns() - start;
+    return view_;
+  }
+
+  // Worker: end this epoch.  Updates pushed before are counted in it.
+  void clock() {
+    ASSERT_GE(worker_, 0);
+    ++clock_;
+    broadcast(kClock);
+  }
+
+  // Worker: stop; servers no longer wait for this worker.
+  void finish() {
+    ASSERT_GE(worker_, 0);
+    broadcast(kFinish);
+  }
+
+  int64_t epoch() const {
+    return clock_;
+  }
+
+  // Worker: time spent in pull(), mostly waiting for slower workers.
+  uint64_t stall_ns() const {
+    return stall_ns_;
+  }
+};
+
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_PARAMSERVER_H */
@@ -0,0 +1,309 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+
+#include "quantize.h"
+
+namespace synchromesh {
+
+namespace {
+
+// Leads every quantized message.
+struct QuantHeader {
+  uint64_t count;
+  // kFixed: the value of one step.
+  double scale;
+  uint8_t encoding;
+  uint8_t bits;
+  // The values are changes to add to what the receiver holds.
+  uint8_t delta;
+  uint8_t unused[5];
+};
+
+static_assert(sizeof(QuantHeader) == 24, "QuantHeader keeps the values 8 byte aligned.");
+
+struct Float32Codec {
+  typedef float Word;
+
+  Word encode(double x) const {
+    return (float) x;
+  }
+
+  double decode(Word w) const {
+    return w;
+  }
+};
+
+// The top half of a float, rounded to nearest even.
+struct BFloat16Codec {
+  typedef uint16_t Word;
+
+  Word encode(double x) const {
+    float f = (float) x;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+      return (bits >> 16) | 0x40;
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return bits >> 16;
+  }
+
+  double decode(Word w) const {
+    uint32_t bits = (uint32_t) w << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+  }
+};
+
+// IEEE half precision, rounded to nearest even; overflow goes to infinity.
+struct Float16Codec {
+  typedef uint16_t Word;
+
+  Word encode(double x) const {
+    float f = (float) x;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t mag = bits & 0x7fffffff;
+    if (mag > 0x7f800000) {
+      return sign | 0x7e00;
+    }
+    if (mag >= 0x477ff000) {
+      return sign | 0x7c00;
+    }
+    if (mag < 0x38800000) {
+      // Subnormal: steps of 2^-24.
+      float a;
+      memcpy(&a, &mag, sizeof(a));
+      return sign | (uint16_t) lrintf(a * 16777216.0f);
+    }
+    uint32_t h = (mag - 0x38000000) >> 13;
+    uint32_t rem = mag & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+      ++h;
+    }
+    return sign | h;
+  }
+
+  double decode(Word w) const {
+    uint32_t sign = (uint32_t) (w & 0x8000) << 16;
+    uint32_t exp = (w >> 10) & 0x1f;
+    uint32_t man = w & 0x3ff;
+    if (exp == 0) {
+      float f = man * (1.0f / 16777216.0f);
+      return sign ? -f : f;
+    }
+    uint32_t bits = sign | (exp == 31 ? 0x7f800000 : (exp + 112) << 23) | (man << 13);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+  }
+};
+
+template<class Int>
+struct FixedCodec {
+  typedef Int Word;
+  double scale;
+  double inv;
+  double limit;
+
+  FixedCodec(double s) :
+      scale(s), inv(1 / s), limit((double) std::numeric_limits<Int>::max()) {
+  }
+
+  Word encode(double x) const {
+    double q = rint(x * inv);
+    return (Word) (q > limit ? limit : (q < -limit ? -limit : q));
+  }
+
+  double decode(Word w) const {
+    return w * scale;
+  }
+};
+
+// With a mirror, encodes the change from it and updates it to what the
+// receiver will decode.
+template<class Codec, class T>
+static void encode_values(const Codec& c, const T* v, size_t n, double* mirror, bool delta,
+                          char* out) {
+  typename Codec::Word* w = (typename Codec::Word*) out;
+  if (mirror == NULL) {
+    for (size_t i = 0; i < n; ++i) {
+      w[i] = c.encode(v[i]);
+    }
+    return;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    double x = delta ? v[i] - mirror[i] : v[i];
+    w[i] = c.encode(x);
+    double d = c.decode(w[i]);
+    mirror[i] = delta ? mirror[i] + d : d;
+  }
+}
+
+template<class Codec, class T>
+static void decode_values(const Codec& c, const char* in, size_t n, bool delta, T* out) {
+  const typename Codec::Word* w = (const typename Codec::Word*) in;
+  if (delta) {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] += c.decode(w[i]);
+    }
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = c.decode(w[i]);
+    }
+  }
+}
+
+// The step that spans the largest magnitude to encode.
+template<class T>
+static double fixed_scale(const Quantization& q, const T* v, size_t n, const double* mirror,
+                          bool delta) {
+  if (q.scale > 0) {
+    return q.scale;
+  }
+  double max = 0;
+  for (size_t i = 0; i < n; ++i) {
+    max = std::max(max, fabs(delta ? v[i] - mirror[i] : (double) v[i]));
+  }
+  double steps = (double) ((1ull << (q.bits - 1)) - 1);
+  return max > 0 ? max / steps : 1;
+}
+
+template<class T>
+static void encode_typed(QuantHeader* h, const T* v, double* mirror, char* out) {
+  const size_t n = h->count;
+  const bool delta = h->delta;
+  switch (h->encoding) {
+  case Quantization::kFloat32:
+    encode_values(Float32Codec(), v, n, mirror, delta, out);
+    break;
+  case Quantization::kBFloat16:
+    encode_values(BFloat16Codec(), v, n, mirror, delta, out);
+    break;
+  case Quantization::kFloat16:
+    encode_values(Float16Codec(), v, n, mirror, delta, out);
+    break;
+  case Quantization::kFixed:
+    if (h->bits == 8) {
+      encode_values(FixedCodec<int8_t>(h->scale), v, n, mirror, delta, out);
+    } else if (h->bits == 16) {
+      encode_values(FixedCodec<int16_t>(h->scale), v, n, mirror, delta, out);
+    } else {
+      encode_values(FixedCodec<int32_t>(h->scale), v, n, mirror, delta, out);
+    }
+    break;
+  default:
+    PANIC("Unknown encoding %d.", h->encoding);
+  }
+}
+
+template<class T>
+static void decode_typed(const QuantHeader& h, const char* in, T* out) {
+  const size_t n = h.count;
+  switch (h.encoding) {
+  case Quantization::kFloat32:
+    decode_values(Float32Codec(), in, n, h.delta, out);
+    break;
+  case Quantization::kBFloat16:
+    decode_values(BFloat16Codec(), in, n, h.delta, out);
+    break;
+  case Quantization::kFloat16:
+    decode_values(Float16Codec(), in, n, h.delta, out);
+    break;
+  case Quantization::kFixed:
+    if (h.bits == 8) {
+      decode_values(FixedCodec<int8_t>(h.scale), in, n, h.delta, out);
+    } else if (h.bits == 16) {
+      decode_values(FixedCodec<int16_t>(h.scale), in, n, h.delta, out);
+    } else {
+      decode_values(FixedCodec<int32_t>(h.scale), in, n, h.delta, out);
+    }
+    break;
+  default:
+    PANIC("Unknown encoding %d.", h.encoding);
+  }
+}
+
+} // namespace
+
+size_t Quantization::value_bytes() const {
+  switch (encoding) {
+  case kFloat32:
+    return 4;
+  case kBFloat16:
+  case kFloat16:
+    return 2;
+  case kFixed:
+    return bits / 8;
+  default:
+    PANIC("No quantization.");
+    return 0;
+  }
+}
+
+size_t Quantization::message_bytes(size_t count) const {
+  return sizeof(QuantHeader) + count * value_bytes();
+}
+
+void Quantizer::encode(Quantizer* qz, const Quantization& q, const void* data, size_t elem_size,
+                       size_t first, size_t count, char* out) {
+  ASSERT(elem_size == sizeof(float) || elem_size == sizeof(double),
+         "Only float and double arrays can be quantized, not %zu byte elements.", elem_size);
+  double* mirror = NULL;
+  bool delta = false;
+  if (q.error_feedback) {
+    ASSERT(qz != NULL, "Error feedback needs the container's quantizer.");
+    if (qz->mirror_.size() < first + count) {
+      qz->mirror_.resize(first + count, 0);
+    }
+    mirror = qz->mirror_.data() + first;
+    delta = !qz->sent_.insert(std::make_pair(first, count)).second;
+  }
+
+  QuantHeader h;
+  memset(&h, 0, sizeof(h));
+  h.count = count;
+  h.encoding = q.encoding;
+  h.bits = q.bits;
+  h.delta = delta;
+  char* values = out + sizeof(h);
+  if (elem_size == sizeof(float)) {
+    const float* v = (const float*) data + first;
+    h.scale = q.encoding == Quantization::kFixed ? fixed_scale(q, v, count, mirror, delta) : 0;
+    encode_typed(&h, v, mirror, values);
+  } else {
+    const double* v = (const double*) data + first;
+    h.scale = q.encoding == Quantization::kFixed ? fixed_scale(q, v, count, mirror, delta) : 0;
+    encode_typed(&h, v, mirror, values);
+  }
+  memcpy(out, &h, sizeof(h));
+}
+
+size_t quantized_count(const char* msg, size_t len) {
+  ASSERT_GE(len, sizeof(QuantHeader));
+  QuantHeader h;
+  memcpy(&h, msg, sizeof(h));
+  return h.count;
+}
+
+void dequantize(const char* msg, size_t len, void* data, size_t elem_size) {
+  QuantHeader h;
+  ASSERT_GE(len, sizeof(h));
+  memcpy(&h, msg, sizeof(h));
+  Quantization q;
+  q.encoding = (Quantization::Encoding) h.encoding;
+  q.bits = h.bits;
+  ASSERT_EQ(len, q.message_bytes(h.count));
+  if (elem_size == sizeof(float)) {
+    decode_typed(h, msg + sizeof(h), (float*) data);
+  } else {
+    ASSERT_EQ(elem_size, sizeof(double));
+    decode_typed(h, msg + sizeof(h), (double*) data);
+  }
+}
+
+} // namespace synchromesh
@@ -0,0 +1,125 @@
+#ifndef SYNCHROMESH_QUANTIZE_H
+#define SYNCHROMESH_QUANTIZE_H
+
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "util.h"
+
+// Lossy encodings for float and double arrays on the sync path, for
+// consumers that only need an approximate view of remote shards.
+//
+//   ShardedVector<double> v;
+//   v.set_quantization(Quantization::bfloat16().with_error_feedback());
+//   send(comm, v);                                 // 2 bytes per value
+//
+// Receivers must be configured with the same mode (or pass it per call).
+// With error feedback each message carries the change from what receivers
+// last reconstructed, so the quantization error of one send is made up in
+// the next rather than accumulating; every receiver must then receive
+// every message.
+namespace synchromesh {
+
+struct Quantization {
+  enum Encoding {
+    kNone = 0,
+    kFloat32 = 1,
+    kBFloat16 = 2,
+    kFloat16 = 3,
+    // Integers of 'bits' bits times 'scale'.
+    kFixed = 4,
+  };
+
+  Encoding encoding = kNone;
+  // kFixed: 8, 16 or 32.
+  int bits = 16;
+  // kFixed: the value of one step; 0 scales each message to its largest
+  // magnitude.
+  double scale = 0;
+  bool error_feedback = false;
+
+  static Quantization float32() {
+    Quantization q;
+    q.encoding = kFloat32;
+    return q;
+  }
+
+  static Quantization bfloat16() {
+    Quantization q;
+    q.encoding = kBFloat16;
+    return q;
+  }
+
+  static Quantization float16() {
+    Quantization q;
+    q.encoding = kFloat16;
+    return q;
+  }
+
+  static Quantization fixed(int bits, double scale = 0) {
+    ASSERT(bits == 8 || bits == 16 || bits == 32, "Fixed point needs 8, 16 or 32 bits, not %d.", bits);
+    Quantization q;
+    q.encoding = kFixed;
+    q.bits = bits;
+    q.scale = scale;
+    return q;
+  }
+
+  Quantization with_error_feedback() const {
+    Quantization q = *this;
+    q.error_feedback = true;
+    return q;
+  }
+
+  bool enabled() const {
+    return encoding != kNone;
+  }
+
+  size_t value_bytes() const;
+
+  // Bytes of the message for 'count' values.
+  size_t message_bytes(size_t count) const;
+};
+
+// A container's quantization mode, and its error feedback state: the
+// values receivers hold for each range sent so far.
+class Quantizer {
+private:
+  Quantization q_;
+  std::vector<double> mirror_;
+  std::set<std::pair<size_t, size_t> > sent_;
+
+public:
+  const Quantization& quantization() const {
+    return q_;
+  }
+
+  void set_quantization(const Quantization& q) {
+    q_ = q;
+    reset();
+  }
+
+  // Forget what receivers hold; the next send of each range is whole.
+  void reset() {
+    mirror_.clear();
+    sent_.clear();
+  }
+
+  // Encode elements [first, first + count) of 'data', floats or doubles
+  // by 'elem_size', as a message of q.message_bytes(count) bytes at 'out'.
+  // A NULL quantizer can't give error feedback.
+  static void encode(Quantizer* qz, const Quantization& q, const void* data, size_t elem_size,
+                     size_t first, size_t count, char* out);
+};
+
+// The number of values in a message.
+size_t quantized_count(const char* msg, size_t len);
+
+// Decode a message into 'data' (floats or doubles by 'elem_size'): stored
+// whole, or for error feedback updates added to what is there.
+void dequantize(const char* msg, size_t len, void* data, size_t elem_size);
+
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_QUANTIZE_H */
@@ -1,14 +1,21 @@
+#include <algorithm>
+#include <climits>
+#include <random>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+
 #include "rpc.h"
+#include "datatype.h"
 
 namespace synchromesh {
 
 int DummyRPC::num_workers_;
 std::vector<DummyRPC*> DummyRPC::workers_;
-std::vector<boost::thread*> DummyRPC::threads_;
-
-static const int kMPIBufferBytes = 1 << 28;
+DummyRPC::Pool* DummyRPC::pool_ = NULL;
+DummyRPC::Network* DummyRPC::network_ = NULL;
 
-// DummyRPC requests always complete immediately.
+// Already complete when created: DummyRPC sends, and blocking receives.
 class DummyRequest: public Request {
 public:
   bool done() {
@@ -18,100 +25,671 @@ public:
   }
 };
 
-class MPIRequest: public Request {
+// Sleep for most of the wait, then spin for the last stretch.
+static void wait_until_ns(uint64_t t) {
+  for (uint64_t now = now_ns(); now < t; now = now_ns()) {
+    if (t - now > 200000) {
+      usleep((t - now - 100000) / 1000);
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+// A DummyRPC send under a NetworkModel: done once the message has been
+// serialized onto the emulated link.
+class DeadlineRequest: public Request {
 private:
-  MPI::Request req_;
+  uint64_t at_;
 public:
-  MPIRequest(MPI::Request r) :
-      req_(r) {
+  DeadlineRequest(uint64_t at) :
+      at_(at) {
   }
 
   bool done() {
-    return req_.Test();
+    return now_ns() >= at_;
   }
+
   void wait() {
-    return req_.Wait();
+    wait_until_ns(at_);
+  }
+};
+
+Layout Layout::iovec(const void* base, const struct iovec* iov, int n) {
+  std::vector<Block> blocks(n);
+  for (int i = 0; i < n; ++i) {
+    blocks[i].offset = (const char*) iov[i].iov_base - (const char*) base;
+    blocks[i].len = iov[i].iov_len;
+  }
+  return indexed(blocks);
+}
+
+size_t Layout::bytes() const {
+  if (blocks_.empty()) {
+    return count_ * block_bytes_;
+  }
+  size_t total = 0;
+  for (auto& b : blocks_) {
+    total += b.len;
+  }
+  return total;
+}
+
+void Layout::gather(const void* base, char* packed) const {
+  for (size_t i = 0; i < count_; ++i) {
+    Block b = block(i);
+    memcpy(packed, (const char*) base + b.offset, b.len);
+    packed += b.len;
+  }
+}
+
+void Layout::scatter(const char* packed, void* base) const {
+  for (size_t i = 0; i < count_; ++i) {
+    Block b = block(i);
+    memcpy((char*) base + b.offset, packed, b.len);
+    packed += b.len;
+  }
+}
+
+// 'make' runs outside the lock, so it may itself look up cached state; if
+// two threads race to build the same entry, the first one stored wins.
+boost::shared_ptr<void> RPC::cached(const GroupKey& key,
+                                    boost::function<boost::shared_ptr<void>()> make) {
+  {
+    boost::mutex::scoped_lock sl(cache_mu_);
+    auto it = cache_.find(key);
+    if (it != cache_.end()) {
+      return it->second;
+    }
+  }
+
+  boost::shared_ptr<void> state = make();
+  boost::mutex::scoped_lock sl(cache_mu_);
+  return cache_.insert(std::make_pair(key, state)).first->second;
+}
+
+void RPC::clear_cache() {
+  std::map<GroupKey, boost::shared_ptr<void> > cache;
+  {
+    boost::mutex::scoped_lock sl(cache_mu_);
+    cache.swap(cache_);
+  }
+}
+
+Request* RPC::irecv_data(int src, int tag, void* ptr, int len) {
+  recv_data(src, tag, ptr, len);
+  return new DummyRequest();
+}
+
+Request* RPC::send_layout(int dst, int tag, const void* base, const Layout& layout) {
+  BufferRequest* br = new BufferRequest(layout.bytes());
+  layout.gather(base, br->data());
+  br->add(send_data(dst, tag, br->data(), br->size()));
+  return br;
+}
+
+void RPC::recv_layout(int src, int tag, void* base, const Layout& layout) {
+  Buffer::Ptr buf = recv_buffer(src, tag);
+  ASSERT_EQ(buf->size(), layout.bytes());
+  layout.scatter(buf->data(), base);
+}
+
+// Each link and NIC is busy until the end of the last message serialized
+// onto it; times are now_ns().
+struct DummyRPC::Network {
+  NetworkModel model;
+  int n;
+  boost::mutex mu;
+  std::mt19937_64 rng;
+  // By src * n + dst.
+  std::vector<uint64_t> link_free;
+  std::vector<uint64_t> last_arrival;
+  // By node.
+  std::vector<uint64_t> egress_free;
+  std::vector<uint64_t> ingress_free;
+
+  Network(const NetworkModel& m, int num_workers) :
+      model(m), n(num_workers), rng(m.seed), link_free(n * n, 0), last_arrival(n * n, 0),
+      egress_free(n, 0), ingress_free(n, 0) {
+  }
+
+  int node(int w) const {
+    return model.ranks_per_node > 0 ? w / model.ranks_per_node : w;
+  }
+};
+
+static uint64_t transfer_ns(size_t bytes, double bytes_per_sec) {
+  return bytes_per_sec > 0 ? (uint64_t) (bytes * 1e9 / bytes_per_sec) : 0;
+}
+
+// The cores this process may run on, grouped by NUMA node, so
+// consecutive ranks share a node.
+static std::vector<int> placement_cpus() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return std::vector<int>();
+  }
+
+  std::vector<std::pair<int, int> > by_node;
+  std::vector<bool> placed(CPU_SETSIZE, false);
+  DIR* dir = opendir("/sys/devices/system/node");
+  while (dir != NULL) {
+    struct dirent* e = readdir(dir);
+    if (e == NULL) {
+      closedir(dir);
+      break;
+    }
+    int node;
+    if (sscanf(e->d_name, "node%d", &node) != 1) {
+      continue;
+    }
+    std::string path = std::string("/sys/devices/system/node/") + e->d_name + "/cpulist";
+    FILE* f = fopen(path.c_str(), "r");
+    if (f == NULL) {
+      continue;
+    }
+    // Ranges like "0-3,8-11".
+    int lo, hi;
+    while (fscanf(f, "%d", &lo) == 1) {
+      hi = lo;
+      if (fscanf(f, "-%d", &hi) != 1) {
+        hi = lo;
+      }
+      for (int c = lo; c <= hi && c < CPU_SETSIZE; ++c) {
+        if (CPU_ISSET(c, &allowed) && !placed[c]) {
+          placed[c] = true;
+          by_node.push_back(std::make_pair(node, c));
+        }
+      }
+      if (fgetc(f) != ',') {
+        break;
+      }
+    }
+    fclose(f);
+  }
+
+  for (int c = 0; c < CPU_SETSIZE; ++c) {
+    if (CPU_ISSET(c, &allowed) && !placed[c]) {
+      by_node.push_back(std::make_pair(INT_MAX, c));
+    }
+  }
+  std::sort(by_node.begin(), by_node.end());
+
+  std::vector<int> cpus;
+  for (auto& p : by_node) {
+    cpus.push_back(p.second);
+  }
+  return cpus;
+}
+
+// Pool threads sleep on 'cv' between runs.  run() bumps 'generation' to
+// start the first 'active' threads, and waits for 'running' to drop to
+// zero.
+struct DummyRPC::Pool {
+  boost::mutex mu;
+  boost::condition_variable cv;
+  std::vector<boost::thread*> threads;
+  // Set by each thread once it has built its worker.
+  std::vector<DummyRPC*> workers;
+  std::vector<int> cpus;
+  // All of 'cpus', for threads left unpinned.
+  cpu_set_t all_cpus;
+
+  uint64_t generation;
+  int active;
+  int running;
+  bool stop;
+  boost::function<void(DummyRPC*)> job;
+
+  Pool() :
+      cpus(placement_cpus()), generation(0), active(0), running(0), stop(false) {
+    CPU_ZERO(&all_cpus);
+    for (int c : cpus) {
+      CPU_SET(c, &all_cpus);
+    }
   }
 };
 
-void DummyRPC::run(int num_workers, boost::function<void(DummyRPC*)> run_f) {
+// Pinned first, so the worker's queues and locks are first touched on its
+// core's NUMA node.  Each run re-pins, or unpins when there are more ranks
+// than cores.
+void DummyRPC::serve(Pool* pool, int slot) {
+  int pinned = -1;
+  auto pin = [&](int num_workers) {
+    int cpu = num_workers <= (int) pool->cpus.size() ? pool->cpus[slot] : -1;
+    if (cpu == pinned) {
+      return;
+    }
+    cpu_set_t set = pool->all_cpus;
+    if (cpu >= 0) {
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+    }
+    if (!pool->cpus.empty() && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+      pinned = cpu;
+    }
+  };
+
+  boost::mutex::scoped_lock sl(pool->mu);
+  pin(pool->active);
+  pool->workers[slot] = new DummyRPC(slot);
+  pool->cv.notify_all();
+
+  uint64_t seen = pool->generation;
+  for (;;) {
+    while (!pool->stop && (pool->generation == seen || slot >= pool->active)) {
+      pool->cv.wait(sl);
+    }
+    if (pool->stop) {
+      break;
+    }
+    seen = pool->generation;
+    boost::function<void(DummyRPC*)> job = pool->job;
+    DummyRPC* rpc = pool->workers[slot];
+    pin(pool->active);
+
+    sl.unlock();
+    job(rpc);
+    sl.lock();
+    if (--pool->running == 0) {
+      pool->cv.notify_all();
+    }
+  }
+
+  delete pool->workers[slot];
+  pool->workers[slot] = NULL;
+}
+
+void DummyRPC::run(int num_workers, boost::function<void(DummyRPC*)> run_f,
+                   const NetworkModel& net) {
 //  pth_init();
+  if (pool_ == NULL) {
+    pool_ = new Pool;
+  }
+  Pool* pool = pool_;
+  boost::mutex::scoped_lock sl(pool->mu);
+  ASSERT_EQ(pool->running, 0);
+
+  pool->active = num_workers;
+  for (int i = pool->threads.size(); i < num_workers; ++i) {
+    pool->workers.push_back(NULL);
+    pool->threads.push_back(new boost::thread(boost::bind(&DummyRPC::serve, pool, i)));
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    while (pool->workers[i] == NULL) {
+      pool->cv.wait(sl);
+    }
+  }
+
   num_workers_ = num_workers;
-  workers_.resize(num_workers);
-  threads_.resize(num_workers_);
-  for (size_t i = 0; i < workers_.size(); ++i) {
-    workers_[i] = new DummyRPC(i);
+  workers_ = pool->workers;
+  if (net.enabled()) {
+    network_ = new Network(net, num_workers);
   }
 
-  for (size_t i = 0; i < workers_.size(); ++i) {
-    threads_[i] = new boost::thread(boost::bind(run_f, workers_[i]));
+  pool->job = run_f;
+  pool->running = num_workers;
+  ++pool->generation;
+  pool->cv.notify_all();
+  while (pool->running > 0) {
+    pool->cv.wait(sl);
   }
 
-  for (size_t i = 0; i < workers_.size(); ++i) {
-    threads_[i]->join();
+  pool->job.clear();
+  for (int i = 0; i < num_workers; ++i) {
+    workers_[i]->reset();
   }
+  delete network_;
+  network_ = NULL;
+}
+
+void DummyRPC::shutdown() {
+  Pool* pool = pool_;
+  if (pool == NULL) {
+    return;
+  }
+  {
+    boost::mutex::scoped_lock sl(pool->mu);
+    ASSERT_EQ(pool->running, 0);
+    pool->stop = true;
+    pool->cv.notify_all();
+  }
+  for (auto t : pool->threads) {
+    t->join();
+    delete t;
+  }
+  delete pool;
+  pool_ = NULL;
+  workers_.clear();
+  num_workers_ = 0;
+}
+
+// Receives still posted belong to requests leaked by the run; they are
+// forgotten, not freed.
+void DummyRPC::reset() {
+  if (root_ == this) {
+    for (int c = 1; c < kMaxChannels; ++c) {
+      DummyRPC* ch = channels_[c].load(std::memory_order_acquire);
+      if (ch != NULL) {
+        ch->reset();
+      }
+    }
+  }
+  boost::recursive_mutex::scoped_lock l(mut_);
+  size_t queued = 0;
+  for (auto& s : data_) {
+    for (auto& t : s.second) {
+      queued += t.second.size();
+    }
+  }
+  if (queued > 0 || !posted_.empty()) {
+    Log_Warn("Worker %d channel %d: dropping %zu unreceived messages and %zu posted receives.",
+             worker_id_, channel_, queued, posted_.size());
+  }
+  data_.clear();
+  posted_.clear();
+  clear_cache();
+}
+
+DummyRPC::DummyRPC(int worker_id, DummyRPC* root, int channel) :
+    worker_id_(worker_id), root_(root != NULL ? root : this), channel_(channel) {
+  for (int c = 0; c < kMaxChannels; ++c) {
+    channels_[c].store(NULL, std::memory_order_relaxed);
+  }
+  channels_[0].store(this, std::memory_order_relaxed);
 }
 
 DummyRPC::~DummyRPC() {
+  if (root_ == this) {
+    for (int c = 1; c < kMaxChannels; ++c) {
+      delete channels_[c].load(std::memory_order_acquire);
+    }
+  }
 }
 
-bool DummyRPC::has_data_internal(int& src, int& tag) const {
-  if (src == kAnyWorker) {
+// Senders look up the receiver's channel on every message, so a channel
+// that exists is found without taking a lock.
+DummyRPC* DummyRPC::channel_of(int c) {
+  ASSERT(c >= 0 && c < kMaxChannels, "Channel %d out of range.", c);
+  DummyRPC* root = root_;
+  DummyRPC* ch = root->channels_[c].load(std::memory_order_acquire);
+  if (ch != NULL) {
+    return ch;
+  }
+  boost::mutex::scoped_lock l(root->channels_mu_);
+  ch = root->channels_[c].load(std::memory_order_acquire);
+  if (ch == NULL) {
+    ch = new DummyRPC(worker_id_, root, c);
+    root->channels_[c].store(ch, std::memory_order_release);
+  }
+  return ch;
+}
+
+RPC* DummyRPC::channel(int c) {
+  return channel_of(c);
+}
+
+std::vector<int> DummyRPC::node_map() const {
+  std::vector<int> nodes(num_workers_, 0);
+  if (network_ != NULL && network_->model.ranks_per_node > 0) {
     for (int i = 0; i < num_workers_; ++i) {
-      if (has_data_internal(i, tag)) {
-        src = i;
-        return true;
-      }
+      nodes[i] = network_->node(i);
     }
-    return false;
   }
+  return nodes;
+}
+
+// A message starts once its link, and between nodes both NICs, are free,
+// and takes as long as the slowest of them.
+uint64_t DummyRPC::schedule(int dst, size_t bytes, uint64_t* sent_ns) {
+  Network* net = network_;
+  const NetworkModel& m = net->model;
+  const uint64_t now = now_ns();
+  const size_t link = (size_t) worker_id_ * net->n + dst;
+  const int src_node = net->node(worker_id_);
+  const int dst_node = net->node(dst);
+  const bool remote = src_node != dst_node;
 
+  boost::mutex::scoped_lock sl(net->mu);
+  uint64_t start = std::max(now, net->link_free[link]);
+  if (remote) {
+    start = std::max(start, std::max(net->egress_free[src_node], net->ingress_free[dst_node]));
+  }
+  const uint64_t link_ns = transfer_ns(bytes, m.link_bytes_per_sec);
+  const uint64_t node_ns = remote ? transfer_ns(bytes, m.node_bytes_per_sec) : 0;
+  net->link_free[link] = start + link_ns;
+  if (remote) {
+    net->egress_free[src_node] = start + node_ns;
+    net->ingress_free[dst_node] = start + node_ns;
+  }
+  *sent_ns = start + std::max(link_ns, node_ns);
+
+  uint64_t jitter = m.jitter_ns > 0 ? net->rng() % (m.jitter_ns + 1) : 0;
+  uint64_t arrival = std::max(*sent_ns + m.latency_ns + jitter, net->last_arrival[link]);
+  net->last_arrival[link] = arrival;
+  return arrival;
+}
+
+bool DummyRPC::find_queued(int& src, int& tag, uint64_t* arrival_ns) const {
   boost::recursive_mutex::scoped_lock l(mut_);
-  if (tag == kAnyTag) {
-    for (auto t : data_[src]) {
-      if (!t.second.empty()) {
-        tag = t.first;
-        return true;
+  auto begin = src == kAnyWorker ? data_.begin() : data_.lower_bound(src);
+  auto end = src == kAnyWorker ? data_.end() : data_.upper_bound(src);
+  bool found = false;
+  for (auto s = begin; s != end; ++s) {
+    auto t = tag == kAnyTag ? s->second.begin() : s->second.lower_bound(tag);
+    auto t_end = tag == kAnyTag ? s->second.end() : s->second.upper_bound(tag);
+    for (; t != t_end; ++t) {
+      if (!t->second.empty() && (!found || t->second.front().arrival_ns < *arrival_ns)) {
+        found = true;
+        src = s->first;
+        tag = t->first;
+        *arrival_ns = t->second.front().arrival_ns;
       }
     }
-    return false;
   }
-
-  return !data_[src][tag].empty();
+  return found;
 }
 
-void DummyRPC::recv_data(int src, int tag, void* ptr, int bytes) {
-  Log_Debug("Receiving... %d %d %d", src, tag, bytes);
-  ASSERT_GE(bytes, 0);
-  if (src == kAnyWorker || tag == kAnyTag) {
-    while (!has_data_internal(src, tag)) {
-//      fiber::yield();
-      sched_yield();
+void DummyRPC::PostedRecv::fill(const void* data, const Layout* from, size_t n) {
+  if (packet != NULL) {
+    packet->resize(n);
+    if (from != NULL) {
+      from->gather(data, &(*packet)[0]);
+    } else {
+      memcpy(&(*packet)[0], data, n);
     }
+  } else if (from == NULL && layout == NULL) {
+    ASSERT_EQ(n, (size_t) bytes);
+    memcpy(base, data, n);
+  } else if (from == NULL) {
+    ASSERT_EQ(n, layout->bytes());
+    layout->scatter((const char*) data, base);
+  } else if (layout == NULL) {
+    ASSERT_EQ(n, (size_t) bytes);
+    from->gather(data, (char*) base);
+  } else {
+    ASSERT_EQ(n, layout->bytes());
+    Packet p(n, '\0');
+    from->gather(data, &p[0]);
+    layout->scatter(p.data(), base);
   }
-  while (!has_data_internal(src, tag)) {
-    sched_yield();
-  }
+}
+
+// Receives match queued messages first; a receive posted with nothing
+// queued can only be matched by a later message, so per (src, tag) order
+// is kept.
+void DummyRPC::post(PostedRecv* r) {
+  int src = r->src;
+  int tag = r->tag;
+  uint64_t arrival = 0;
   Packet p;
   {
+    boost::recursive_mutex::scoped_lock l(mut_);
+    if (!find_queued(src, tag, &arrival)) {
+      posted_.push_back(r);
+      return;
+    }
     PacketList& pl = data_[src][tag];
-    p = pl.front();
+    p = std::move(pl.front().packet);
     pl.pop_front();
   }
-  ASSERT_EQ((int) p.size(), bytes);
-  memcpy(ptr, p.data(), p.size());
+
+  r->src = src;
+  r->tag = tag;
+  r->arrival_ns = arrival;
+  if (r->packet != NULL) {
+    *r->packet = std::move(p);
+  } else {
+    r->fill(p.data(), NULL, p.size());
+  }
+  r->done.store(true, std::memory_order_release);
 }
 
-Request* DummyRPC::send_data(int dst, int tag, const void* ptr, int bytes) {
-  Log_Debug("Sending... %d %d %d", dst, tag, bytes);
-  DummyRPC* dst_rpc = workers_[dst];
+void DummyRPC::wait(PostedRecv* r) {
+  while (!r->done.load(std::memory_order_acquire)) {
+    sched_yield();
+  }
+  wait_until_ns(r->arrival_ns);
+}
+
+// Once a sender has taken 'r' off the list it is copying into it, so wait
+// for that to finish.
+void DummyRPC::cancel(PostedRecv* r) {
+  {
+    boost::recursive_mutex::scoped_lock l(mut_);
+    auto it = std::find(posted_.begin(), posted_.end(), r);
+    if (it != posted_.end()) {
+      posted_.erase(it);
+      return;
+    }
+  }
+  wait(r);
+}
+
+// A matched receive is copied into outside the lock: it is already off the
+// list, and its owner is waiting on 'done'.  Under a network model the
+// data is copied at once but only visible from its arrival time.
+Request* DummyRPC::deliver(int dst, int tag, const void* base, const Layout* layout, int bytes) {
+  DummyRPC* dst_rpc = workers_[dst]->channel_of(channel_);
+  PostedRecv* r = NULL;
+  uint64_t sent = 0;
+  uint64_t arrival = 0;
+  if (network_ != NULL) {
+    arrival = schedule(dst, bytes, &sent);
+  }
+  Request* req = network_ != NULL ? (Request*) new DeadlineRequest(sent) : new DummyRequest();
   {
     boost::recursive_mutex::scoped_lock l(dst_rpc->mut_);
-    PacketList& pl = dst_rpc->data_[worker_id_][tag];
-    pl.push_back(Packet((char *) ptr, bytes));
+    for (auto it = dst_rpc->posted_.begin(); it != dst_rpc->posted_.end(); ++it) {
+      if ((*it)->matches(worker_id_, tag)) {
+        r = *it;
+        dst_rpc->posted_.erase(it);
+        break;
+      }
+    }
+
+    if (r == NULL) {
+      PacketList& pl = dst_rpc->data_[worker_id_][tag];
+      if (layout != NULL) {
+        pl.push_back(Queued { Packet(bytes, '\0'), arrival });
+        layout->gather(base, &pl.back().packet[0]);
+      } else {
+        pl.push_back(Queued { Packet((const char*) base, bytes), arrival });
+      }
+      return req;
+    }
   }
 
-  return new DummyRequest();
+  r->src = worker_id_;
+  r->tag = tag;
+  r->arrival_ns = arrival;
+  r->fill(base, layout, bytes);
+  r->done.store(true, std::memory_order_release);
+  return req;
+}
+
+// A receive posted by irecv_data().  Deleting it before it completes
+// withdraws the receive.
+class DummyRPC::RecvRequest: public Request {
+private:
+  DummyRPC* rpc_;
+  PostedRecv r_;
+public:
+  RecvRequest(DummyRPC* rpc, int src, int tag, void* ptr, int bytes) :
+      rpc_(rpc), r_(src, tag, ptr, bytes) {
+    rpc_->post(&r_);
+  }
+
+  ~RecvRequest() {
+    rpc_->cancel(&r_);
+  }
+
+  bool done() {
+    return r_.complete();
+  }
+
+  void wait() {
+    rpc_->wait(&r_);
+  }
+};
+
+void DummyRPC::recv_data(int src, int tag, void* ptr, int bytes) {
+  Log_Debug("Receiving... %d %d %d", src, tag, bytes);
+  ASSERT_GE(bytes, 0);
+  PostedRecv r(src, tag, ptr, bytes);
+  post(&r);
+  wait(&r);
+}
+
+Request* DummyRPC::irecv_data(int src, int tag, void* ptr, int bytes) {
+  Log_Debug("Posting receive... %d %d %d", src, tag, bytes);
+  ASSERT_GE(bytes, 0);
+  return new RecvRequest(this, src, tag, ptr, bytes);
+}
+
+// Hands the queued packet itself to the caller.
+class PacketBuffer: public Buffer {
+private:
+  std::string p_;
+public:
+  PacketBuffer(std::string&& p) :
+      p_(std::move(p)) {
+  }
+
+  const char* data() const {
+    return p_.data();
+  }
+
+  size_t size() const {
+    return p_.size();
+  }
+};
+
+Buffer::Ptr DummyRPC::recv_buffer(int src, int tag) {
+  Log_Debug("Receiving buffer... %d %d", src, tag);
+  Packet p;
+  PostedRecv r(src, tag, NULL, -1);
+  r.packet = &p;
+  post(&r);
+  wait(&r);
+  return Buffer::Ptr(new PacketBuffer(std::move(p)));
+}
+
+Request* DummyRPC::send_data(int dst, int tag, const void* ptr, int bytes) {
+  Log_Debug("Sending... %d %d %d", dst, tag, bytes);
+  return deliver(dst, tag, ptr, NULL, bytes);
+}
+
+Request* DummyRPC::send_layout(int dst, int tag, const void* base, const Layout& layout) {
+  return deliver(dst, tag, base, &layout, layout.bytes());
+}
+
+void DummyRPC::recv_layout(int src, int tag, void* base, const Layout& layout) {
+  PostedRecv r(src, tag, base, layout.bytes());
+  r.layout = &layout;
+  post(&r);
+  wait(&r);
 }
 
 int DummyRPC::first() const {
@@ -127,54 +705,559 @@ int DummyRPC::id() const {
 }
 
 bool DummyRPC::poll(int src, int tag) const {
-  return has_data_internal(src, tag);
+  uint64_t arrival;
+  return find_queued(src, tag, &arrival) && now_ns() >= arrival;
 }
 
-void MPIRPC::recv_data(int src, int tag, void* ptr, int bytes) {
+// Describe 'layout' as a committed MPI datatype; the caller frees it.
+static MPI_Datatype layout_type(const Layout& layout) {
+  MPI_Datatype t;
+  if (layout.is_strided()) {
+    ASSERT_LE(layout.block_bytes(), (size_t) INT_MAX);
+    MPI_Type_create_hvector(layout.num_blocks(), layout.block_bytes(), layout.stride_bytes(),
+                            MPI_CHAR, &t);
+  } else {
+    std::vector<int> lens(layout.num_blocks());
+    std::vector<MPI_Aint> displs(layout.num_blocks());
+    for (size_t i = 0; i < layout.num_blocks(); ++i) {
+      Layout::Block b = layout.block(i);
+      ASSERT_LE(b.len, (size_t) INT_MAX);
+      lens[i] = b.len;
+      displs[i] = b.offset;
+    }
+    MPI_Type_create_hindexed(layout.num_blocks(), lens.data(), displs.data(), MPI_CHAR, &t);
+  }
+  MPI_Type_commit(&t);
+  return t;
+}
 
-  ASSERT(src <= last(), "Target not a valid worker index");
-  if (src == kAnyWorker) {
-    src = MPI::ANY_SOURCE;
+namespace {
+
+// Leads every message on a user tag.  Eager messages carry their payload
+// right after it; a request-to-send carries nothing else, and its data
+// follows on 'ctrl_' under 'data_tag' once the receiver sends 'data_tag'
+// back under kCtsTag.
+struct MsgHeader {
+  enum Kind {
+    kEager = 0,
+    kRts = 1,
+  };
+
+  uint32_t kind;
+  int32_t data_tag;
+  uint64_t bytes;
+};
+
+// Tags on 'ctrl_'; rendezvous data uses the ones above.
+static const int kCreditTag = 0;
+static const int kCtsTag = 1;
+
+} // namespace
+
+// One message in flight: its header (and, for eager sends, the copied
+// payload), and the MPI requests for the header and any rendezvous data.
+struct MPIRPC::Pending {
+  std::vector<char> buf;
+  MPI_Request reqs[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+  // Bytes counted against max_buffered_bytes.
+  size_t buffered = 0;
+  // The data is read from the caller's buffer.
+  bool borrowed = false;
+  bool complete = false;
+
+  // A request-to-send: the data to send to 'dst' on clear-to-send.
+  bool awaiting_cts = false;
+  int dst = -1;
+  int data_tag = -1;
+  const void* data = NULL;
+  int count = 0;
+  // Freed once the data is sent, unless MPI_BYTE.
+  MPI_Datatype type = MPI_BYTE;
+};
+
+class MPIRPC::SendRequest: public Request {
+private:
+  MPIRPC* rpc_;
+  boost::shared_ptr<Pending> p_;
+public:
+  SendRequest(MPIRPC* rpc, const boost::shared_ptr<Pending>& p) :
+      rpc_(rpc), p_(p) {
   }
-  if (tag == kAnyTag) {
-    tag = MPI::ANY_TAG;
+
+  // MPI may still be reading the caller's buffer.
+  ~SendRequest() {
+    if (p_->borrowed) {
+      wait();
+    }
   }
-  Log_Debug("Receiving from: %d %d %p %d", src, tag, ptr, bytes);
 
-  world_.Recv(ptr, bytes, MPI::CHAR, src, tag);
-  Log_Debug("Recv DONE: %d %d %p %d", src, tag, ptr, bytes);
-}
+  bool done() {
+    return rpc_->test(p_.get());
+  }
 
-Request* MPIRPC::send_data(int dst, int tag, const void* ptr, int bytes) {
-//  boost::mutex::scoped_lock lock(mut_);
-  ASSERT(dst <= last(), "Target not a valid worker index");
-  if (dst == kAnyWorker) {
-    dst = MPI::ANY_SOURCE;
+  void wait() {
+    while (!done()) {
+      sched_yield();
+    }
   }
-  if (tag == kAnyTag) {
-    tag = MPI::ANY_TAG;
+};
+
+// Receives the header and an eager payload in one go, through a datatype
+// spanning both; on a request-to-send, follows up with a receive of the
+// data on 'ctrl_'.
+class MPIRPC::RecvRequest: public Request {
+private:
+  MPIRPC* rpc_;
+  MsgHeader hdr_;
+  void* base_;
+  MPI_Datatype type_;
+  int count_;
+  size_t bytes_;
+  MPI_Request req_;
+  bool rendezvous_;
+  bool complete_;
+
+  // The header (and any eager payload) is in: finish, or go and get the
+  // rendezvous data.  Called with the RPC's lock.
+  void finish_header(const MPI_Status& status) {
+    ASSERT_EQ(hdr_.bytes, bytes_);
+    if (hdr_.kind == MsgHeader::kEager) {
+      int n;
+      MPI_Get_count(&status, MPI_BYTE, &n);
+      ASSERT_EQ((size_t) n, sizeof(hdr_) + bytes_);
+      rpc_->take_eager(status.MPI_SOURCE);
+      complete_ = true;
+      return;
+    }
+    rendezvous_ = true;
+    MPI_Irecv(base_, count_, type_, status.MPI_SOURCE, hdr_.data_tag, rpc_->ctrl_, &req_);
+    rpc_->clear_to_send(status.MPI_SOURCE, hdr_.data_tag);
   }
 
-  MPI::Request req = world_.Ibsend(ptr, bytes, MPI::CHAR, dst, tag);
-  Log_Debug("Send done to: %d %d %p %d", dst, tag, ptr, bytes);
+public:
+  // Receive 'count' of 'type' (owned by the request) at 'base', 'bytes'
+  // in all.
+  RecvRequest(MPIRPC* rpc, int src, int tag, void* base, MPI_Datatype type, int count,
+              size_t bytes) :
+      rpc_(rpc), base_(base), type_(type), count_(count), bytes_(bytes), req_(MPI_REQUEST_NULL),
+      rendezvous_(false), complete_(false) {
+    ASSERT(src <= rpc->last(), "Target not a valid worker index");
+    if (src == kAnyWorker) {
+      src = MPI_ANY_SOURCE;
+    }
+    if (tag == kAnyTag) {
+      tag = MPI_ANY_TAG;
+    }
 
-  return new MPIRequest(req);
-}
+    MPI_Aint displs[2];
+    MPI_Get_address(&hdr_, &displs[0]);
+    MPI_Get_address(base_, &displs[1]);
+    int lens[2] = { (int) sizeof(hdr_), count_ };
+    MPI_Datatype types[2] = { MPI_BYTE, type_ };
+    MPI_Datatype msg;
+    MPI_Type_create_struct(2, lens, displs, types, &msg);
+    MPI_Type_commit(&msg);
+
+    boost::recursive_mutex::scoped_lock l(*rpc_->mut_);
+    MPI_Irecv(MPI_BOTTOM, 1, msg, src, tag, rpc_->world_, &req_);
+    MPI_Type_free(&msg);
+  }
+
+  // Withdraws the receive if nothing has matched it yet.
+  ~RecvRequest() {
+    if (!complete_ && !rendezvous_) {
+      boost::recursive_mutex::scoped_lock l(*rpc_->mut_);
+      MPI_Status status;
+      int cancelled = 0;
+      MPI_Cancel(&req_);
+      MPI_Wait(&req_, &status);
+      MPI_Test_cancelled(&status, &cancelled);
+      if (cancelled) {
+        complete_ = true;
+      } else {
+        finish_header(status);
+      }
+    }
+    if (!complete_) {
+      wait();
+    }
+    if (type_ != MPI_BYTE) {
+      MPI_Type_free(&type_);
+    }
+  }
+
+  bool done() {
+    if (complete_) {
+      return true;
+    }
+
+    boost::recursive_mutex::scoped_lock l(*rpc_->mut_);
+    rpc_->progress();
+    int flag = 0;
+    MPI_Status status;
+    MPI_Test(&req_, &flag, &status);
+    if (!flag) {
+      return false;
+    }
+    if (rendezvous_) {
+      complete_ = true;
+    } else {
+      finish_header(status);
+    }
+    return complete_;
+  }
 
-MPIRPC::MPIRPC() :
-    world_(MPI::COMM_WORLD) {
+  void wait() {
+    while (!done()) {
+      sched_yield();
+    }
+  }
+};
+
+// Without MPI_THREAD_MULTIPLE only one thread may be in MPI at a time, so
+// every channel takes channel 0's lock.
+MPIRPC::MPIRPC(const FlowControl& fc, int num_channels) :
+    world_(MPI::COMM_WORLD), fc_(fc), mut_(&own_mut_), root_(this), buffered_bytes_(0) {
   int is_initialized = 0;
   MPI_Initialized(&is_initialized);
+  int level = MPI_THREAD_MULTIPLE;
   if (!is_initialized) {
-    MPI::Init_thread(MPI::THREAD_SERIALIZED);
+    level = MPI::Init_thread(MPI::THREAD_MULTIPLE);
+  } else {
+    MPI_Query_thread(&level);
+  }
+  ASSERT_GT(fc_.credits_per_peer, 0);
+  ASSERT_GE(fc_.max_buffered_bytes, fc_.eager_bytes);
+  ASSERT_GT(num_channels, 0);
+  if (level < MPI_THREAD_MULTIPLE && num_channels > 1) {
+    Log_Warn("MPI only provides thread level %d; %d channels will share one lock.", level,
+             num_channels);
+  }
+  open();
 
-    void* mpi_buffer = malloc(kMPIBufferBytes);
-    MPI::Attach_buffer(mpi_buffer, kMPIBufferBytes);
+  // Name each node by the world rank of its first process.
+  MPI_Comm node;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, id(), MPI_INFO_NULL, &node);
+  int leader = id();
+  MPI_Bcast(&leader, 1, MPI_INT, 0, node);
+  MPI_Comm_free(&node);
+  node_map_.resize(world_.Get_size());
+  MPI_Allgather(&leader, 1, MPI_INT, node_map_.data(), 1, MPI_INT, MPI_COMM_WORLD);
+
+  channels_.push_back(this);
+  for (int c = 1; c < num_channels; ++c) {
+    channels_.push_back(new MPIRPC(this, c));
+  }
+  if (level < MPI_THREAD_MULTIPLE) {
+    for (auto ch : channels_) {
+      ch->mut_ = &own_mut_;
+    }
   }
 //  fiber::init();
 }
 
+MPIRPC::MPIRPC(MPIRPC* root, int c) :
+    world_(root->world_.Dup()), fc_(root->fc_), mut_(&own_mut_), node_map_(root->node_map_),
+    root_(root), buffered_bytes_(0) {
+  open();
+}
+
+void MPIRPC::open() {
+  MPI_Comm_dup(world_, &ctrl_);
+  int* max_tag;
+  int found = 0;
+  MPI_Comm_get_attr(world_, MPI_TAG_UB, &max_tag, &found);
+  max_tag_ = found ? *max_tag : 32767;
+
+  const int n = world_.Get_size();
+  credits_.assign(n, fc_.credits_per_peer);
+  consumed_.assign(n, 0);
+  data_tags_.assign(n, kCtsTag);
+}
+
+void MPIRPC::close() {
+  clear_cache();
+  {
+    boost::recursive_mutex::scoped_lock l(*mut_);
+    while (!inflight_.empty()) {
+      progress();
+    }
+  }
+  MPI_Comm_free(&ctrl_);
+}
+
+MPIRPC::~MPIRPC() {
+  if (root_ != this) {
+    close();
+    world_.Free();
+    return;
+  }
+  for (size_t c = 1; c < channels_.size(); ++c) {
+    delete channels_[c];
+  }
+  close();
+  MPI::Finalize();
+}
+
+RPC* MPIRPC::channel(int c) {
+  const std::vector<MPIRPC*>& chs = root_->channels_;
+  ASSERT(c >= 0 && c < (int) chs.size(), "Channel %d out of range; MPIRPC was built with %zu.", c,
+         chs.size());
+  return chs[c];
+}
+
+void MPIRPC::progress() const {
+  for (;;) {
+    int flag = 0;
+    MPI_Status status;
+    MPI_Iprobe(MPI_ANY_SOURCE, kCreditTag, ctrl_, &flag, &status);
+    if (!flag) {
+      break;
+    }
+    int n;
+    MPI_Recv(&n, 1, MPI_INT, status.MPI_SOURCE, kCreditTag, ctrl_, MPI_STATUS_IGNORE);
+    credits_[status.MPI_SOURCE] += n;
+  }
+
+  for (;;) {
+    int flag = 0;
+    MPI_Status status;
+    MPI_Iprobe(MPI_ANY_SOURCE, kCtsTag, ctrl_, &flag, &status);
+    if (!flag) {
+      break;
+    }
+    int data_tag;
+    MPI_Recv(&data_tag, 1, MPI_INT, status.MPI_SOURCE, kCtsTag, ctrl_, MPI_STATUS_IGNORE);
+    auto it = awaiting_cts_.find(std::make_pair(status.MPI_SOURCE, data_tag));
+    ASSERT(it != awaiting_cts_.end(), "Clear-to-send from %d for unknown data tag %d.",
+           status.MPI_SOURCE, data_tag);
+    Pending* p = it->second.get();
+    MPI_Isend(p->data, p->count, p->type, p->dst, data_tag, ctrl_, &p->reqs[1]);
+    if (p->type != MPI_BYTE) {
+      // Freeing only marks the type; the pending send keeps it alive.
+      MPI_Type_free(&p->type);
+    }
+    p->awaiting_cts = false;
+    awaiting_cts_.erase(it);
+  }
+
+  for (auto it = inflight_.begin(); it != inflight_.end();) {
+    Pending* p = it->get();
+    if (p->awaiting_cts) {
+      ++it;
+      continue;
+    }
+    int flag = 0;
+    MPI_Testall(2, p->reqs, &flag, MPI_STATUSES_IGNORE);
+    if (!flag) {
+      ++it;
+      continue;
+    }
+    buffered_bytes_ -= p->buffered;
+    std::vector<char>().swap(p->buf);
+    p->complete = true;
+    it = inflight_.erase(it);
+  }
+}
+
+bool MPIRPC::test(Pending* p) {
+  boost::recursive_mutex::scoped_lock l(*mut_);
+  if (!p->complete) {
+    progress();
+  }
+  return p->complete;
+}
+
+// Credit goes back in batches of half the window, so a sender streaming
+// eager messages never runs dry while the receiver keeps up.
+void MPIRPC::take_eager(int src) {
+  if (++consumed_[src] < std::max(1, fc_.credits_per_peer / 2)) {
+    return;
+  }
+  boost::shared_ptr<Pending> p(new Pending);
+  p->buf.resize(sizeof(int));
+  memcpy(p->buf.data(), &consumed_[src], sizeof(int));
+  consumed_[src] = 0;
+  MPI_Isend(p->buf.data(), 1, MPI_INT, src, kCreditTag, ctrl_, &p->reqs[0]);
+  inflight_.push_back(p);
+}
+
+int MPIRPC::next_data_tag(int dst) {
+  int& t = data_tags_[dst];
+  t = t == max_tag_ ? kCtsTag + 1 : t + 1;
+  return t;
+}
+
+void MPIRPC::clear_to_send(int src, int data_tag) {
+  boost::shared_ptr<Pending> p(new Pending);
+  p->buf.resize(sizeof(int));
+  memcpy(p->buf.data(), &data_tag, sizeof(int));
+  MPI_Isend(p->buf.data(), 1, MPI_INT, src, kCtsTag, ctrl_, &p->reqs[0]);
+  inflight_.push_back(p);
+}
+
+Request* MPIRPC::send_message(int dst, int tag, const void* base, const Layout* layout,
+                              size_t bytes) {
+  ASSERT(dst >= 0 && dst <= last(), "Target not a valid worker index");
+  ASSERT(tag >= 0, "Sends need a concrete tag");
+  ASSERT_LE(bytes, (size_t) INT_MAX);
+
+  boost::recursive_mutex::scoped_lock l(*mut_);
+  progress();
+  while (bytes <= fc_.eager_bytes && buffered_bytes_ + bytes > fc_.max_buffered_bytes) {
+    l.unlock();
+    sched_yield();
+    l.lock();
+    progress();
+  }
+
+  boost::shared_ptr<Pending> p(new Pending);
+  MsgHeader hdr;
+  hdr.bytes = bytes;
+  hdr.data_tag = -1;
+
+  if (bytes <= fc_.eager_bytes) {
+    p->buf.resize(sizeof(hdr) + bytes);
+    char* payload = p->buf.data() + sizeof(hdr);
+    if (layout != NULL) {
+      layout->gather(base, payload);
+    } else {
+      memcpy(payload, base, bytes);
+    }
+    p->buffered = bytes;
+    buffered_bytes_ += bytes;
+
+    if (credits_[dst] > 0) {
+      --credits_[dst];
+      hdr.kind = MsgHeader::kEager;
+      memcpy(p->buf.data(), &hdr, sizeof(hdr));
+      MPI_Isend(p->buf.data(), p->buf.size(), MPI_BYTE, dst, tag, world_, &p->reqs[0]);
+      inflight_.push_back(p);
+      return new SendRequest(this, p);
+    }
+    p->data = payload;
+    p->count = bytes;
+  } else {
+    p->buf.resize(sizeof(hdr));
+    p->borrowed = true;
+    p->data = base;
+    if (layout != NULL) {
+      p->type = layout_type(*layout);
+      p->count = 1;
+    } else {
+      p->count = bytes;
+    }
+  }
+
+  hdr.kind = MsgHeader::kRts;
+  hdr.data_tag = next_data_tag(dst);
+  memcpy(p->buf.data(), &hdr, sizeof(hdr));
+  MPI_Isend(p->buf.data(), sizeof(hdr), MPI_BYTE, dst, tag, world_, &p->reqs[0]);
+  p->awaiting_cts = true;
+  p->dst = dst;
+  p->data_tag = hdr.data_tag;
+  awaiting_cts_[std::make_pair(dst, hdr.data_tag)] = p;
+
+  inflight_.push_back(p);
+  return new SendRequest(this, p);
+}
+
+Request* MPIRPC::send_data(int dst, int tag, const void* ptr, int bytes) {
+  Log_Debug("Sending to: %d %d %p %d", dst, tag, ptr, bytes);
+  ASSERT_GE(bytes, 0);
+  return send_message(dst, tag, ptr, NULL, bytes);
+}
+
+Request* MPIRPC::send_layout(int dst, int tag, const void* base, const Layout& layout) {
+  return send_message(dst, tag, base, &layout, layout.bytes());
+}
+
+void MPIRPC::recv_data(int src, int tag, void* ptr, int bytes) {
+  Log_Debug("Receiving from: %d %d %p %d", src, tag, ptr, bytes);
+  RecvRequest r(this, src, tag, ptr, MPI_BYTE, bytes, bytes);
+  r.wait();
+  Log_Debug("Recv DONE: %d %d %p %d", src, tag, ptr, bytes);
+}
+
+Request* MPIRPC::irecv_data(int src, int tag, void* ptr, int bytes) {
+  return new RecvRequest(this, src, tag, ptr, MPI_BYTE, bytes, bytes);
+}
+
+void MPIRPC::recv_layout(int src, int tag, void* base, const Layout& layout) {
+  RecvRequest r(this, src, tag, base, layout_type(layout), 1, layout.bytes());
+  r.wait();
+}
+
+// The size is only known once a message is there, so probe for it first.
+Buffer::Ptr MPIRPC::recv_buffer(int src, int tag) {
+  ASSERT(src <= last(), "Target not a valid worker index");
+  if (src == kAnyWorker) {
+    src = MPI_ANY_SOURCE;
+  }
+  if (tag == kAnyTag) {
+    tag = MPI_ANY_TAG;
+  }
+
+  boost::recursive_mutex::scoped_lock l(*mut_);
+  MPI_Status status;
+  for (;;) {
+    progress();
+    int flag = 0;
+    MPI_Iprobe(src, tag, world_, &flag, &status);
+    if (flag) {
+      break;
+    }
+    l.unlock();
+    sched_yield();
+    l.lock();
+  }
+
+  int n;
+  MPI_Get_count(&status, MPI_BYTE, &n);
+  MsgHeader hdr;
+  ASSERT_GE((size_t) n, sizeof(hdr));
+  HeapBuffer* buf = new HeapBuffer(n - sizeof(hdr));
+  MPI_Aint displs[2];
+  MPI_Get_address(&hdr, &displs[0]);
+  MPI_Get_address(buf->data(), &displs[1]);
+  int lens[2] = { (int) sizeof(hdr), (int) buf->size() };
+  MPI_Datatype types[2] = { MPI_BYTE, MPI_BYTE };
+  MPI_Datatype msg;
+  MPI_Type_create_struct(2, lens, displs, types, &msg);
+  MPI_Type_commit(&msg);
+  MPI_Recv(MPI_BOTTOM, 1, msg, status.MPI_SOURCE, status.MPI_TAG, world_, MPI_STATUS_IGNORE);
+  MPI_Type_free(&msg);
+
+  if (hdr.kind == MsgHeader::kEager) {
+    take_eager(status.MPI_SOURCE);
+  } else {
+    // The sender may be this rank, so keep progressing while waiting.
+    delete buf;
+    buf = new HeapBuffer(hdr.bytes);
+    MPI_Request req;
+    MPI_Irecv(buf->data(), buf->size(), MPI_BYTE, status.MPI_SOURCE, hdr.data_tag, ctrl_, &req);
+    clear_to_send(status.MPI_SOURCE, hdr.data_tag);
+    for (;;) {
+      progress();
+      int flag = 0;
+      MPI_Test(&req, &flag, MPI_STATUS_IGNORE);
+      if (flag) {
+        break;
+      }
+      l.unlock();
+      sched_yield();
+      l.lock();
+    }
+  }
+  Log_Debug("Recv buffer DONE: %d %d %d", src, tag, buf->size());
+  return Buffer::Ptr(buf);
+}
+
+// Progresses too: a rank polling for a reply may owe a peer the payload
+// of a rendezvous send.
 bool MPIRPC::poll(int src, int tag) const {
+  boost::recursive_mutex::scoped_lock l(*mut_);
+  progress();
   return world_.Iprobe(src, tag);
 }
 
@@ -190,5 +1273,52 @@ int MPIRPC::id() const {
   return world_.Get_rank();
 }
 
+std::vector<int> MPIRPC::node_map() const {
+  return node_map_;
+}
+
+namespace {
+
+struct GroupComm {
+  MPI_Comm comm = MPI_COMM_NULL;
+
+  ~GroupComm() {
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if (comm != MPI_COMM_NULL && !finalized) {
+      MPI_Comm_free(&comm);
+    }
+  }
+};
+
+} // namespace
+
+// Ranges become a single (first, last, stride) triplet, so the group
+// description stays O(1) however many workers it spans.  Freed by
+// clear_cache(), at the latest when the channel closes.
+MPI_Comm MPIRPC::group_comm(const Endpoint& ep) {
+  boost::shared_ptr<GroupComm> gc = group_state<GroupComm>(this, ep, 0, [&]() {
+    GroupComm* gc = new GroupComm;
+    if (!ep.contains(id())) {
+      return gc;
+    }
+    boost::recursive_mutex::scoped_lock l(*mut_);
+    MPI_Group world, group;
+    MPI_Comm_group(world_, &world);
+    if (ep.stride() == 0) {
+      std::vector<int> ranks(ep.begin(), ep.end());
+      MPI_Group_incl(world, ranks.size(), ranks.data(), &group);
+    } else {
+      int range[1][3] = { { ep[0], ep[ep.count() - 1], ep.stride() } };
+      MPI_Group_range_incl(world, 1, range, &group);
+    }
+
+    MPI_Comm_create_group(world_, group, ep.tag(), &gc->comm);
+    MPI_Group_free(&group);
+    MPI_Group_free(&world);
+    return gc;
+  });
+  return gc->comm;
+}
 
 } // namespace synchromesh
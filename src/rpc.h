@@ -3,8 +3,15 @@
 
 #include <mpi.h>
 #include <vector>
+#include <atomic>
 #include <deque>
+#include <list>
 #include <map>
+#include <string>
+#include <tuple>
+#include <sys/uio.h>
+#include <boost/function.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/type_traits.hpp>
 #include <boost/thread.hpp>
 
@@ -13,6 +20,7 @@
 namespace synchromesh {
 
 class RPC;
+class Endpoint;
 
 class Request {
 public:
@@ -52,7 +60,163 @@ public:
   }
 };
 
+// A RequestGroup which owns the buffer its requests send from, keeping it
+// alive until the group is destroyed.
+class BufferRequest: public RequestGroup {
+  boost::scoped_array<char> buf_;
+  size_t size_;
+public:
+  BufferRequest(size_t size) :
+      buf_(new char[size]), size_(size) {
+  }
+
+  // 'buf_' goes before the base class's requests, which may still be
+  // sending from it.
+  ~BufferRequest() {
+    wait();
+  }
+
+  char* data() {
+    return buf_.get();
+  }
+
+  size_t size() const {
+    return size_;
+  }
+};
+
+// A received message, held in the memory the transport received it into.
+class Buffer {
+public:
+  typedef boost::shared_ptr<Buffer> Ptr;
+
+  virtual ~Buffer() {
+  }
+
+  virtual const char* data() const = 0;
+  virtual size_t size() const = 0;
+};
+
+class HeapBuffer: public Buffer {
+  boost::scoped_array<char> buf_;
+  size_t size_;
+public:
+  HeapBuffer(size_t size) :
+      buf_(new char[size]), size_(size) {
+  }
+
+  char* data() {
+    return buf_.get();
+  }
+
+  const char* data() const {
+    return buf_.get();
+  }
+
+  size_t size() const {
+    return size_;
+  }
+};
+
+// A non-contiguous region of memory, as blocks at byte offsets from a
+// base pointer: 'count' equal blocks a fixed stride apart (a matrix
+// column, one field across an array of structs), or an arbitrary list of
+// (offset, length) blocks.  Transports send and receive the blocks in
+// order as one message, without packing them into a temporary.
+class Layout {
+public:
+  struct Block {
+    ptrdiff_t offset;
+    size_t len;
+  };
+
+  static Layout contiguous(size_t bytes) {
+    return strided(1, bytes, bytes);
+  }
+
+  static Layout strided(size_t count, size_t block_bytes, ptrdiff_t stride_bytes) {
+    Layout l;
+    l.count_ = count;
+    l.block_bytes_ = block_bytes;
+    l.stride_bytes_ = stride_bytes;
+    return l;
+  }
+
+  static Layout indexed(const std::vector<Block>& blocks) {
+    Layout l;
+    l.blocks_ = blocks;
+    l.count_ = blocks.size();
+    return l;
+  }
+
+  // Offsets of 'iov's buffers relative to 'base'.
+  static Layout iovec(const void* base, const struct iovec* iov, int n);
+
+  bool is_strided() const {
+    return blocks_.empty() && count_ > 0;
+  }
+
+  size_t num_blocks() const {
+    return count_;
+  }
+
+  Block block(size_t i) const {
+    if (!blocks_.empty()) {
+      return blocks_[i];
+    }
+    Block b = { (ptrdiff_t) i * stride_bytes_, block_bytes_ };
+    return b;
+  }
+
+  size_t block_bytes() const {
+    return block_bytes_;
+  }
+
+  ptrdiff_t stride_bytes() const {
+    return stride_bytes_;
+  }
+
+  // Total bytes in all blocks.
+  size_t bytes() const;
+
+  // Copy the blocks at 'base' to (from) 'packed', back to back.
+  void gather(const void* base, char* packed) const;
+  void scatter(const char* packed, void* base) const;
+
+private:
+  size_t count_ = 0;
+  size_t block_bytes_ = 0;
+  ptrdiff_t stride_bytes_ = 0;
+  std::vector<Block> blocks_;
+};
+
+// Names a group of workers (see Endpoint::key()) and a kind of state
+// derived from it, for RPC::cached().  List groups compare by their ranks,
+// so lists built separately share state: by hash first, then element-wise.
+struct GroupKey {
+  int first = 0;
+  int count = 0;
+  int stride = 0;
+  boost::shared_ptr<const std::vector<int> > list;
+  uint64_t list_hash = 0;
+  uint64_t salt = 0;
+  std::string type;
+
+  bool operator<(const GroupKey& o) const {
+    auto a = std::tie(first, count, stride, list_hash, salt, type);
+    auto b = std::tie(o.first, o.count, o.stride, o.list_hash, o.salt, o.type);
+    if (a != b) {
+      return a < b;
+    }
+    return list && o.list && *list < *o.list;
+  }
+};
+
 class RPC {
+private:
+  boost::mutex cache_mu_;
+  std::map<GroupKey, boost::shared_ptr<void> > cache_;
+
 public:
   static const int kAnyWorker = -1;
   static const int kAnyTag = -1;
@@ -65,6 +229,20 @@ public:
   virtual void recv_data(int src, int tag, void* ptr, int len) = 0;
   virtual bool poll(int src, int tag) const = 0;
 
+  // Post a receive into 'ptr' and return at once; the data is there once
+  // the request completes.  The default blocks in recv_data().
+  virtual Request* irecv_data(int src, int tag, void* ptr, int len);
+
+  // Receive the next message from (src, tag), whatever its size, without
+  // copying it out of the transport's buffer.
+  virtual Buffer::Ptr recv_buffer(int src, int tag) = 0;
+
+  // Send or receive the blocks of 'layout' as one message.  The defaults
+  // pack into (unpack from) a temporary; transports override them to read
+  // and write the blocks in place.
+  virtual Request* send_layout(int dst, int tag, const void* base, const Layout& layout);
+  virtual void recv_layout(int src, int tag, void* base, const Layout& layout);
+
   // The first, last and current worker ids.
   virtual int first() const = 0;
   virtual int last() const = 0;
@@ -73,6 +251,35 @@ public:
   virtual int num_workers() const {
     return last() - first() + 1;
   }
+
+  // The node each worker runs on; workers on the same node can share
+  // memory.  By default every worker is assumed to be on its own node.
+  virtual std::vector<int> node_map() const {
+    std::vector<int> nodes(num_workers());
+    for (int i = 0; i < num_workers(); ++i) {
+      nodes[i] = i;
+    }
+    return nodes;
+  }
+
+  // State derived from a group of workers (schedules, node layouts,
+  // sub-communicators), built by 'make' the first time 'key' is seen and
+  // shared by every later lookup.  See group_state() in datatype.h.
+  boost::shared_ptr<void> cached(const GroupKey& key,
+                                 boost::function<boost::shared_ptr<void>()> make);
+
+  // Drop all cached group state.
+  void clear_cache();
+
+  // Channel 'c' of this worker, for one of its threads: an RPC with its
+  // own queues and locks whose messages only match channel 'c' of other
+  // workers, so each channel has a tag space of its own.  Threads on
+  // different channels never contend and may use the same tags.  Channel 0
+  // is this RPC.
+  virtual RPC* channel(int c) {
+    ASSERT_EQ(c, 0);
+    return this;
+  }
 };
 
 template<class T>
@@ -82,7 +289,7 @@ static Request* send_pod(RPC* rpc, int dst, int tag, T t) {
 
 template<class T>
 static void recv_pod(RPC* rpc, int src, int tag, T* t) {
-  rpc->recv_data(src, tag, t, sizeof(t));
+  rpc->recv_data(src, tag, t, sizeof(*t));
 }
 
 template<class T>
@@ -92,53 +299,266 @@ static T recv_pod(RPC* rpc, int src, int tag) {
   return v;
 }
 
+// Limits for MPIRPC's send protocol.
+//
+// Messages of up to 'eager_bytes' are copied, so the caller's buffer can
+// be reused as soon as send_data() returns, and go out in one piece while
+// the receiver has granted credit for them.  Larger messages, and small
+// ones past the credit, send only a request-to-send on the user's tag; the
+// data follows once the receiver has matched it and answered clear-to-send,
+// so a receiver never holds more than headers it has not asked for.  Large
+// data goes straight from the caller's buffer, which must stay valid until
+// the request completes; deleting the request first waits for it.  Either
+// way the request completes only once the receiver could take the data, so
+// a slow receiver shows up as sends that stay incomplete.
+struct FlowControl {
+  size_t eager_bytes = 64 << 10;
+
+  // Eager messages each receiver lets a sender have outstanding; past
+  // that, small messages wait for clear-to-send too.
+  int credits_per_peer = 32;
+
+  // Bytes of copies held at once, including those waiting for
+  // clear-to-send.  send_data() blocks while it would go over, as MPI_Send
+  // may.
+  size_t max_buffered_bytes = 64 << 20;
+};
+
 class MPIRPC: public RPC {
 private:
+  struct Pending;
+  class SendRequest;
+  class RecvRequest;
+
   MPI::Intracomm world_;
-  boost::mutex mut_;
+  // Rendezvous data and credit returns, kept apart from the user's tags.
+  MPI_Comm ctrl_;
+  int max_tag_;
+  FlowControl fc_;
+
+  // Guards this channel's state and MPI calls: the channel's own lock
+  // under MPI_THREAD_MULTIPLE, otherwise one lock for every channel.
+  boost::recursive_mutex own_mut_;
+  boost::recursive_mutex* mut_;
+  std::vector<int> node_map_;
+
+  // Channel 0 owns the others, and MPI.
+  MPIRPC* root_;
+  std::vector<MPIRPC*> channels_;
+
+  // Per peer: eager sends we may still make, eager messages taken that
+  // have not been credited back, and the next rendezvous data tag.
+  // Mutable, as is the rest of progress()'s state, so poll() can progress.
+  mutable std::vector<int> credits_;
+  std::vector<int> consumed_;
+  std::vector<int> data_tags_;
+
+  // Sends MPI has not finished with, and the bytes of eager copies they
+  // hold.
+  mutable std::list<boost::shared_ptr<Pending> > inflight_;
+  mutable size_t buffered_bytes_;
+  // Requests-to-send waiting for clear-to-send, by (dst, data tag).
+  mutable std::map<std::pair<int, int>, boost::shared_ptr<Pending> > awaiting_cts_;
+
+  // Channel 'c', over its own duplicates of the communicators.
+  MPIRPC(MPIRPC* root, int c);
+
+  // Set up flow control; collective.
+  void open();
+  // Finish sends in flight and free the communicators.
+  void close();
+
+  // Take returned credit, answer clear-to-sends and retire finished sends.
+  // Called with 'mut_'.
+  void progress() const;
+  bool test(Pending* p);
+  void take_eager(int src);
+  int next_data_tag(int dst);
+  // Answer a request-to-send once its data receive is posted.
+  void clear_to_send(int src, int data_tag);
+
+  // 'layout' is NULL for 'bytes' contiguous bytes at 'base'.
+  Request* send_message(int dst, int tag, const void* base, const Layout* layout, size_t bytes);
 
 public:
-  MPIRPC();
-  virtual ~MPIRPC() {
-    MPI::Finalize();
-  }
+  // Collective.  MPI is initialized for MPI_THREAD_MULTIPLE (unless the
+  // caller already initialized it), and 'num_channels' channels are set up
+  // for channel().
+  explicit MPIRPC(const FlowControl& fc = FlowControl(), int num_channels = 1);
+  virtual ~MPIRPC();
 
   Request* send_data(int dst, int tag, const void* ptr, int bytes);
   void recv_data(int src, int tag, void* ptr, int bytes);
+  Request* irecv_data(int src, int tag, void* ptr, int bytes);
   bool poll(int src, int tag) const;
+  Buffer::Ptr recv_buffer(int src, int tag);
+
+  // Sends and receives through an MPI derived datatype.
+  Request* send_layout(int dst, int tag, const void* base, const Layout& layout);
+  void recv_layout(int src, int tag, void* base, const Layout& layout);
 
   int first() const;
   int last() const;
   int id() const;
+  std::vector<int> node_map() const;
+
+  RPC* channel(int c);
+
+  // A communicator over the workers of 'ep', in endpoint order, cached on
+  // this channel; MPI_COMM_NULL outside the group.  The first call for a
+  // group is collective over its members.
+  MPI_Comm group_comm(const Endpoint& ep);
+};
+
+// The network DummyRPC::run() emulates.  Each message is serialized onto
+// its (src, dst) link and, between nodes, through both nodes' NICs, then
+// arrives 'latency_ns' plus up to 'jitter_ns' later.  Sends complete once
+// serialized; receives and polls only see a message once it has arrived.
+// Messages between a pair of workers still arrive in the order sent.
+// The default model delivers instantly.
+struct NetworkModel {
+  uint64_t latency_ns = 0;
+  // Uniformly random extra latency per message.
+  uint64_t jitter_ns = 0;
+  // Zero for unlimited.
+  double link_bytes_per_sec = 0;
+  // Shared by every message into or out of a node.
+  double node_bytes_per_sec = 0;
+  // Consecutive workers per node, also reported by node_map(); 0 puts
+  // every worker on its own node.
+  int ranks_per_node = 0;
+  uint64_t seed = 1;
+
+  bool enabled() const {
+    return latency_ns > 0 || jitter_ns > 0 || link_bytes_per_sec > 0 || node_bytes_per_sec > 0
+        || ranks_per_node > 0;
+  }
 };
 
 // Pretend to run MPI using a bunch of threads.
 // How slow can we make this go!?
+//
+// Runs every worker as a thread of this process.  Threads and their
+// DummyRPCs are kept in a pool across run() calls; each rank is pinned to
+// its own core (cores ordered by NUMA node) when the run fits on the
+// cores available to the process.  A worker may start threads of its own,
+// each talking through its own channel().
 class DummyRPC: public RPC {
 private:
   static int num_workers_;
+  // The pool's workers; only the first num_workers_ are in the run.
   static std::vector<DummyRPC*> workers_;
-  static std::vector<boost::thread*> threads_;
+
+  struct Pool;
+  static Pool* pool_;
+
+  // Link state for the NetworkModel; NULL when delivery is instant.
+  struct Network;
+  static Network* network_;
 
   typedef std::string Packet;
-  typedef std::deque<Packet> PacketList;
+  // A queued message, visible to poll() from 'arrival_ns' on.
+  struct Queued {
+    Packet packet;
+    uint64_t arrival_ns;
+  };
+  typedef std::deque<Queued> PacketList;
   typedef std::map<int, PacketList> TagMap;
   typedef std::map<int, TagMap> DataMap;
 
-  // So we can use operator[]
-  mutable DataMap data_;
+  // A receive waiting for its message.  Whoever matches it (a sender, or
+  // the receiver finding the message already queued) copies the data in
+  // and then sets 'done'.
+  struct PostedRecv {
+    int src;
+    int tag;
+    void* base;
+    // NULL for 'bytes' contiguous bytes at 'base'.
+    const Layout* layout;
+    int bytes;
+    // Set for recv_buffer(): the message is handed over whole.
+    Packet* packet;
+    // Modelled arrival; the receive completes at 'done' and this time.
+    uint64_t arrival_ns;
+    std::atomic<bool> done;
+
+    PostedRecv(int s, int t, void* b, int n) :
+        src(s), tag(t), base(b), layout(NULL), bytes(n), packet(NULL), arrival_ns(0),
+        done(false) {
+    }
+
+    bool complete() const {
+      return done.load(std::memory_order_acquire) && now_ns() >= arrival_ns;
+    }
+
+    bool matches(int s, int t) const {
+      return (src == kAnyWorker || src == s) && (tag == kAnyTag || tag == t);
+    }
+
+    // Copy in a message: 'n' contiguous bytes at 'data', or the blocks of
+    // 'from' relative to 'data'.
+    void fill(const void* data, const Layout* from, size_t n);
+  };
+
+  class RecvRequest;
+
+  // Messages that arrived before a matching receive was posted ("unexpected"
+  // in MPI terms), and receives posted before their message arrived, in
+  // post order.  Both are guarded by 'mut_'.
+  DataMap data_;
+  std::list<PostedRecv*> posted_;
   mutable boost::recursive_mutex mut_;
 
   int worker_id_;
 
-  DummyRPC(int worker_id) {
-    worker_id_ = worker_id;
-  }
+  // The worker's channels, made on first use; [0] is the worker itself,
+  // which owns the rest.
+  static const int kMaxChannels = 64;
+  std::atomic<DummyRPC*> channels_[kMaxChannels];
+  boost::mutex channels_mu_;
+  DummyRPC* root_;
+  int channel_;
+
+  DummyRPC(int worker_id, DummyRPC* root = NULL, int channel = 0);
+
+  DummyRPC* channel_of(int c);
+
+  // The body of pool thread 'slot'.
+  static void serve(Pool* pool, int slot);
+
+  // Drop anything left over from a run, on every channel.
+  void reset();
+
+  // The queued message a receive for (src, tag) would take: the first to
+  // arrive, then the lowest source and tag.  Fills in 'src', 'tag' and
+  // its arrival time.
+  bool find_queued(int& src, int& tag, uint64_t* arrival_ns) const;
 
-  bool has_data_internal(int& src, int& tag) const;
+  // Match 'r' against the queued messages, or queue it for a sender.
+  void post(PostedRecv* r);
+  void wait(PostedRecv* r);
+  // Remove 'r' if it is still unmatched.
+  void cancel(PostedRecv* r);
+
+  // Hand a message from this worker to 'dst': straight into a matching
+  // posted receive if there is one, otherwise onto its queue.  'layout'
+  // is NULL for 'bytes' contiguous bytes at 'base'.  Returns the send's
+  // request.
+  Request* deliver(int dst, int tag, const void* base, const Layout* layout, int bytes);
+
+  // Model sending 'bytes' to 'dst' now: returns the arrival time, and sets
+  // 'sent_ns' to when the message has left this worker.
+  uint64_t schedule(int dst, size_t bytes, uint64_t* sent_ns);
 
 public:
-  static void run(int num_workers, boost::function<void(DummyRPC*)> run_f);
+  // Run 'run_f' on 'num_workers' workers and wait for all of them.  Not
+  // reentrant: one run at a time.
+  static void run(int num_workers, boost::function<void(DummyRPC*)> run_f,
+                  const NetworkModel& net = NetworkModel());
+
+  // Stop and free the pool's threads and workers; a later run() starts a
+  // new pool.
+  static void shutdown();
 
   virtual ~DummyRPC();
 
@@ -148,8 +568,22 @@ public:
 
   Request* send_data(int dst, int tag, const void* ptr, int bytes);
   void recv_data(int src, int tag, void* ptr, int bytes);
+  Request* irecv_data(int src, int tag, void* ptr, int bytes);
+  Buffer::Ptr recv_buffer(int src, int tag);
+
+  // Gathers straight into (scatters straight from) the receiver's buffer or
+  // the queued packet.
+  Request* send_layout(int dst, int tag, const void* base, const Layout& layout);
+  void recv_layout(int src, int tag, void* base, const Layout& layout);
 
   bool poll(int src, int tag) const;
+
+  // Up to kMaxChannels.
+  RPC* channel(int c);
+
+  // All workers share one process, unless the network model splits them
+  // into nodes.
+  std::vector<int> node_map() const;
 };
 
 } // namespace synchromesh
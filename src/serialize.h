@@ -0,0 +1,339 @@
+#ifndef SYNCHROMESH_SERIALIZE_H
+#define SYNCHROMESH_SERIALIZE_H
+
+#include <stddef.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "util.h"
+
+// Flat serialization.
+//
+// Serializer<T> computes the packed size of a value in one pass, packs it
+// into a flat buffer and unpacks it again.  It handles trivially copyable
+// types (one memcpy), std::string, std::vector, std::map and any struct
+// whose fields are declared with SYNCHROMESH_FIELDS:
+//
+//   struct State {
+//     int step;
+//     double t;
+//     std::string name;
+//     std::vector<double> values;
+//   };
+//   SYNCHROMESH_FIELDS(State, step, t, name, values)
+//
+// The macro must be used at global scope, and fields must be listed in
+// declaration order.  Consecutive trivially copyable fields that are
+// adjacent in memory, apart from alignment padding, are fused at compile
+// time into a single memcpy; an unlisted field between two listed ones
+// ends the run.
+namespace synchromesh {
+
+template<class T, class Enable = void>
+struct Serializer;
+
+// Specialized by SYNCHROMESH_FIELDS.
+template<class T>
+struct Reflect {
+  static const bool defined = false;
+};
+
+template<class M, size_t Off>
+struct Field {
+  typedef M type;
+  static const size_t offset = Off;
+  static const bool trivial = std::is_trivially_copyable<M>::value;
+  static const size_t align = alignof(M);
+};
+
+template<class... Fs>
+struct FieldList {
+  static constexpr size_t kNumFields = sizeof...(Fs);
+  static constexpr bool trivial[] = { Fs::trivial... };
+  static constexpr size_t offset[] = { Fs::offset... };
+  static constexpr size_t bytes[] = { sizeof(typename Fs::type)... };
+  static constexpr size_t align[] = { Fs::align... };
+
+  template<size_t I>
+  using FieldAt = typename std::tuple_element<I, std::tuple<Fs...> >::type;
+
+  // Field 'i' is trivially copyable and directly follows the previous one
+  // in memory: nothing but padding lies between them.
+  static constexpr bool extends_run(size_t i) {
+    return i > 0 && trivial[i] && trivial[i - 1]
+        && offset[i] == (offset[i - 1] + bytes[i - 1] + align[i] - 1) / align[i] * align[i];
+  }
+
+  static constexpr bool in_declaration_order() {
+    for (size_t i = 1; i < kNumFields; ++i) {
+      if (offset[i] <= offset[i - 1]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static constexpr bool starts_run(size_t i) {
+    return trivial[i] && !extends_run(i);
+  }
+
+  // Byte length of the run of trivially copyable fields starting at 'i'.
+  static constexpr size_t run_bytes(size_t i) {
+    size_t j = i;
+    while (j + 1 < kNumFields && extends_run(j + 1)) {
+      ++j;
+    }
+    return offset[j] + bytes[j] - offset[i];
+  }
+
+  // Number of memcpy runs plus non-trivial fields packed per value.
+  static constexpr size_t num_segments() {
+    size_t n = 0;
+    for (size_t i = 0; i < kNumFields; ++i) {
+      n += trivial[i] ? starts_run(i) : 1;
+    }
+    return n;
+  }
+
+  template<size_t I, class T>
+  static const typename FieldAt<I>::type& member(const T& v) {
+    return *(const typename FieldAt<I>::type*) ((const char*) &v + FieldAt<I>::offset);
+  }
+
+  template<size_t I, class T>
+  static typename FieldAt<I>::type& member(T& v) {
+    return *(typename FieldAt<I>::type*) ((char*) &v + FieldAt<I>::offset);
+  }
+
+  template<size_t I, class T>
+  static size_t field_size(const T& v) {
+    if constexpr (!trivial[I]) {
+      return Serializer<typename FieldAt<I>::type>::size(member<I>(v));
+    } else if constexpr (starts_run(I)) {
+      return run_bytes(I);
+    } else {
+      return 0;
+    }
+  }
+
+  template<size_t I, class T>
+  static void pack_field(char*& p, const T& v) {
+    if constexpr (!trivial[I]) {
+      Serializer<typename FieldAt<I>::type>::pack(p, member<I>(v));
+    } else if constexpr (starts_run(I)) {
+      memcpy(p, &member<I>(v), run_bytes(I));
+      p += run_bytes(I);
+    }
+  }
+
+  template<size_t I, class T>
+  static void unpack_field(const char*& p, T& v) {
+    if constexpr (!trivial[I]) {
+      Serializer<typename FieldAt<I>::type>::unpack(p, member<I>(v));
+    } else if constexpr (starts_run(I)) {
+      memcpy(&member<I>(v), p, run_bytes(I));
+      p += run_bytes(I);
+    }
+  }
+
+  template<class T, size_t... I>
+  static size_t size(const T& v, std::index_sequence<I...>) {
+    return (field_size<I>(v) + ... + 0);
+  }
+
+  template<class T, size_t... I>
+  static void pack(char*& p, const T& v, std::index_sequence<I...>) {
+    (pack_field<I>(p, v), ...);
+  }
+
+  template<class T, size_t... I>
+  static void unpack(const char*& p, T& v, std::index_sequence<I...>) {
+    (unpack_field<I>(p, v), ...);
+  }
+};
+
+template<class T>
+struct Serializer<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+  static size_t size(const T&) {
+    return sizeof(T);
+  }
+
+  static void pack(char*& p, const T& v) {
+    memcpy(p, &v, sizeof(T));
+    p += sizeof(T);
+  }
+
+  static void unpack(const char*& p, T& v) {
+    memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+  }
+};
+
+template<>
+struct Serializer<std::string> {
+  static size_t size(const std::string& v) {
+    return sizeof(size_t) + v.size();
+  }
+
+  static void pack(char*& p, const std::string& v) {
+    size_t n = v.size();
+    memcpy(p, &n, sizeof(n));
+    memcpy(p + sizeof(n), v.data(), n);
+    p += sizeof(n) + n;
+  }
+
+  static void unpack(const char*& p, std::string& v) {
+    size_t n;
+    memcpy(&n, p, sizeof(n));
+    v.assign(p + sizeof(n), n);
+    p += sizeof(n) + n;
+  }
+};
+
+template<class V>
+struct Serializer<std::vector<V> > {
+  static size_t size(const std::vector<V>& v) {
+    if (std::is_trivially_copyable<V>::value) {
+      return sizeof(size_t) + v.size() * sizeof(V);
+    }
+    size_t sz = sizeof(size_t);
+    for (const auto& i : v) {
+      sz += Serializer<V>::size(i);
+    }
+    return sz;
+  }
+
+  static void pack(char*& p, const std::vector<V>& v) {
+    size_t n = v.size();
+    memcpy(p, &n, sizeof(n));
+    p += sizeof(n);
+    if constexpr (std::is_trivially_copyable<V>::value) {
+      memcpy(p, v.data(), n * sizeof(V));
+      p += n * sizeof(V);
+    } else {
+      for (const auto& i : v) {
+        Serializer<V>::pack(p, i);
+      }
+    }
+  }
+
+  static void unpack(const char*& p, std::vector<V>& v) {
+    size_t n;
+    memcpy(&n, p, sizeof(n));
+    p += sizeof(n);
+    v.resize(n);
+    if constexpr (std::is_trivially_copyable<V>::value) {
+      memcpy(v.data(), p, n * sizeof(V));
+      p += n * sizeof(V);
+    } else {
+      for (auto& i : v) {
+        Serializer<V>::unpack(p, i);
+      }
+    }
+  }
+};
+
+// Entries are packed in key order.  Unpacking assigns into the existing
+// map, as the per-entry recv did.
+template<class K, class V>
+struct Serializer<std::map<K, V> > {
+  static size_t size(const std::map<K, V>& m) {
+    if (std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value) {
+      return sizeof(size_t) + m.size() * (sizeof(K) + sizeof(V));
+    }
+    size_t sz = sizeof(size_t);
+    for (const auto& i : m) {
+      sz += Serializer<K>::size(i.first) + Serializer<V>::size(i.second);
+    }
+    return sz;
+  }
+
+  static void pack(char*& p, const std::map<K, V>& m) {
+    size_t n = m.size();
+    memcpy(p, &n, sizeof(n));
+    p += sizeof(n);
+    for (const auto& i : m) {
+      Serializer<K>::pack(p, i.first);
+      Serializer<V>::pack(p, i.second);
+    }
+  }
+
+  static void unpack(const char*& p, std::map<K, V>& m) {
+    size_t n;
+    memcpy(&n, p, sizeof(n));
+    p += sizeof(n);
+    for (size_t i = 0; i < n; ++i) {
+      K k;
+      Serializer<K>::unpack(p, k);
+      auto it = m.emplace_hint(m.end(), k, V());
+      Serializer<V>::unpack(p, it->second);
+    }
+  }
+};
+
+template<class T>
+struct Serializer<T, typename std::enable_if<Reflect<T>::defined && !std::is_trivially_copyable<T>::value>::type> {
+  typedef typename Reflect<T>::Fields Fields;
+  typedef std::make_index_sequence<Fields::kNumFields> Indices;
+
+  static size_t size(const T& v) {
+    return Fields::size(v, Indices());
+  }
+
+  static void pack(char*& p, const T& v) {
+    Fields::pack(p, v, Indices());
+  }
+
+  static void unpack(const char*& p, T& v) {
+    Fields::unpack(p, v, Indices());
+  }
+};
+
+} // namespace synchromesh
+
+#define SM_FIELD_OF(Type, f) synchromesh::Field<decltype(Type::f), offsetof(Type, f)>
+
+#define SM_MAP_1(m, t, x) m(t, x)
+#define SM_MAP_2(m, t, x, ...) m(t, x), SM_MAP_1(m, t, __VA_ARGS__)
+#define SM_MAP_3(m, t, x, ...) m(t, x), SM_MAP_2(m, t, __VA_ARGS__)
+#define SM_MAP_4(m, t, x, ...) m(t, x), SM_MAP_3(m, t, __VA_ARGS__)
+#define SM_MAP_5(m, t, x, ...) m(t, x), SM_MAP_4(m, t, __VA_ARGS__)
+#define SM_MAP_6(m, t, x, ...) m(t, x), SM_MAP_5(m, t, __VA_ARGS__)
+#define SM_MAP_7(m, t, x, ...) m(t, x), SM_MAP_6(m, t, __VA_ARGS__)
+#define SM_MAP_8(m, t, x, ...) m(t, x), SM_MAP_7(m, t, __VA_ARGS__)
+#define SM_MAP_9(m, t, x, ...) m(t, x), SM_MAP_8(m, t, __VA_ARGS__)
+#define SM_MAP_10(m, t, x, ...) m(t, x), SM_MAP_9(m, t, __VA_ARGS__)
+#define SM_MAP_11(m, t, x, ...) m(t, x), SM_MAP_10(m, t, __VA_ARGS__)
+#define SM_MAP_12(m, t, x, ...) m(t, x), SM_MAP_11(m, t, __VA_ARGS__)
+#define SM_MAP_13(m, t, x, ...) m(t, x), SM_MAP_12(m, t, __VA_ARGS__)
+#define SM_MAP_14(m, t, x, ...) m(t, x), SM_MAP_13(m, t, __VA_ARGS__)
+#define SM_MAP_15(m, t, x, ...) m(t, x), SM_MAP_14(m, t, __VA_ARGS__)
+#define SM_MAP_16(m, t, x, ...) m(t, x), SM_MAP_15(m, t, __VA_ARGS__)
+
+#define SM_PICK_MAP(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, NAME, ...) NAME
+
+#define SM_MAP(m, t, ...)\
+    SM_PICK_MAP(__VA_ARGS__, SM_MAP_16, SM_MAP_15, SM_MAP_14, SM_MAP_13, SM_MAP_12,\
+                SM_MAP_11, SM_MAP_10, SM_MAP_9, SM_MAP_8, SM_MAP_7, SM_MAP_6, SM_MAP_5,\
+                SM_MAP_4, SM_MAP_3, SM_MAP_2, SM_MAP_1)(m, t, __VA_ARGS__)
+
+// Declare the serialized fields of 'Type' (at most 16).  offsetof on types
+// that are not standard-layout (e.g. with std::map members) is supported by
+// GCC and Clang as long as there are no virtual bases.
+#define SYNCHROMESH_FIELDS(Type, ...)\
+    _Pragma("GCC diagnostic push")\
+    _Pragma("GCC diagnostic ignored \"-Winvalid-offsetof\"")\
+    template<> struct synchromesh::Reflect<Type> {\
+      static const bool defined = true;\
+      typedef synchromesh::FieldList<SM_MAP(SM_FIELD_OF, Type, __VA_ARGS__)> Fields;\
+    };\
+    static_assert(synchromesh::Reflect<Type>::Fields::in_declaration_order(),\
+                  "SYNCHROMESH_FIELDS(" #Type ") must list fields in declaration order.");\
+    _Pragma("GCC diagnostic pop")
+
+#endif /* SYNCHROMESH_SERIALIZE_H */
@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <climits>
+#include <deque>
+#include <string>
+
+#include "shuffle.h"
+
+namespace synchromesh {
+
+namespace {
+
+void send_recv_counts(RPC* rpc, const Endpoint& ep, int me, int tag,
+                      const std::vector<size_t>& send_bytes, std::vector<size_t>* recv_bytes) {
+  const int n = ep.count();
+  recv_bytes->assign(n, 0);
+  (*recv_bytes)[me] = send_bytes[me];
+
+  RequestGroup rg;
+  for (int k = 1; k < n; ++k) {
+    int to = (me + k) % n;
+    rg.add(rpc->send_data(ep[to], tag, &send_bytes[to], sizeof(size_t)));
+  }
+  for (int k = 1; k < n; ++k) {
+    int from = (me - k + n) % n;
+    rpc->recv_data(ep[from], tag, &(*recv_bytes)[from], sizeof(size_t));
+  }
+  rg.wait();
+}
+
+// Round k sends to the rank k ahead and receives from the rank k behind,
+// so every rank has one peer per round.
+void pairwise(RPC* rpc, const Endpoint& ep, int me, int tag, const char* send,
+              const std::vector<size_t>& send_bytes, boost::function<char*(size_t)> alloc,
+              std::vector<size_t>* recv_bytes, const AlltoallOptions& opts) {
+  const int n = ep.count();
+  send_recv_counts(rpc, ep, me, tag, send_bytes, recv_bytes);
+
+  std::vector<size_t> send_off(n, 0), recv_off(n, 0);
+  for (int i = 1; i < n; ++i) {
+    send_off[i] = send_off[i - 1] + send_bytes[i - 1];
+    recv_off[i] = recv_off[i - 1] + (*recv_bytes)[i - 1];
+  }
+  char* recv = alloc(recv_off[n - 1] + (*recv_bytes)[n - 1]);
+  memcpy(recv + recv_off[me], send + send_off[me], send_bytes[me]);
+
+  std::deque<Request*> inflight;
+  for (int k = 1; k < n; ++k) {
+    int to = (me + k) % n;
+    int from = (me - k + n) % n;
+    if (send_bytes[to] > 0) {
+      ASSERT_LE(send_bytes[to], (size_t) INT_MAX);
+      inflight.push_back(rpc->send_data(ep[to], tag, send + send_off[to], send_bytes[to]));
+      if ((int) inflight.size() > opts.max_inflight) {
+        inflight.front()->wait();
+        delete inflight.front();
+        inflight.pop_front();
+      }
+    }
+    if ((*recv_bytes)[from] > 0) {
+      rpc->recv_data(ep[from], tag, recv + recv_off[from], (*recv_bytes)[from]);
+    }
+  }
+  for (auto r : inflight) {
+    r->wait();
+    delete r;
+  }
+}
+
+// Bruck et al.: after rotating so block j is bound for the rank j ahead,
+// round k forwards every block whose index has bit k set to the rank 2^k
+// ahead.  Block j then holds what the rank j behind sent us.
+void bruck(RPC* rpc, const Endpoint& ep, int me, int tag, const char* send,
+           const std::vector<size_t>& send_bytes, boost::function<char*(size_t)> alloc,
+           std::vector<size_t>* recv_bytes) {
+  const int n = ep.count();
+  std::vector<size_t> send_off(n, 0);
+  for (int i = 1; i < n; ++i) {
+    send_off[i] = send_off[i - 1] + send_bytes[i - 1];
+  }
+
+  std::vector<std::string> blocks(n);
+  for (int j = 0; j < n; ++j) {
+    int dst = (me + j) % n;
+    blocks[j].assign(send + send_off[dst], send_bytes[dst]);
+  }
+
+  for (int step = 1; step < n; step <<= 1) {
+    // Sizes of the blocks forwarded, then their data.
+    std::vector<uint64_t> sizes;
+    size_t bytes = 0;
+    for (int j = step; j < n; ++j) {
+      if (j & step) {
+        sizes.push_back(blocks[j].size());
+        bytes += blocks[j].size();
+      }
+    }
+
+    size_t header = sizes.size() * sizeof(uint64_t);
+    BufferRequest* br = new BufferRequest(header + bytes);
+    memcpy(br->data(), sizes.data(), header);
+    char* p = br->data() + header;
+    for (int j = step; j < n; ++j) {
+      if (j & step) {
+        memcpy(p, blocks[j].data(), blocks[j].size());
+        p += blocks[j].size();
+      }
+    }
+    ASSERT_LE(br->size(), (size_t) INT_MAX);
+    br->add(rpc->send_data(ep[(me + step) % n], tag, br->data(), br->size()));
+
+    Buffer::Ptr in = rpc->recv_buffer(ep[(me - step + n) % n], tag);
+    const uint64_t* in_sizes = (const uint64_t*) in->data();
+    const char* q = in->data() + header;
+    int b = 0;
+    for (int j = step; j < n; ++j) {
+      if (j & step) {
+        blocks[j].assign(q, in_sizes[b]);
+        q += in_sizes[b++];
+      }
+    }
+    ASSERT_EQ((size_t) (q - in->data()), in->size());
+    br->wait();
+    delete br;
+  }
+
+  recv_bytes->resize(n);
+  size_t total = 0;
+  for (int s = 0; s < n; ++s) {
+    (*recv_bytes)[s] = blocks[(me - s + n) % n].size();
+    total += (*recv_bytes)[s];
+  }
+  char* out = alloc(total);
+  for (int s = 0; s < n; ++s) {
+    const std::string& b = blocks[(me - s + n) % n];
+    memcpy(out, b.data(), b.size());
+    out += b.size();
+  }
+}
+
+} // namespace
+
+void alltoallv_into(RPC* rpc, const Endpoint& ep, const char* send,
+               const std::vector<size_t>& send_bytes, boost::function<char*(size_t)> alloc,
+               std::vector<size_t>* recv_bytes, const AlltoallOptions& opts) {
+  ASSERT_EQ(send_bytes.size(), (size_t) ep.count());
+  int me = ep.index_of(rpc->id());
+  ASSERT_GE(me, 0);
+
+  if (opts.algorithm == AlltoallOptions::kBruck) {
+    bruck(rpc, ep, me, ep.tag(), send, send_bytes, alloc, recv_bytes);
+  } else {
+    pairwise(rpc, ep, me, ep.tag(), send, send_bytes, alloc, recv_bytes, opts);
+  }
+}
+
+void alltoallv(RPC* rpc, const Endpoint& ep, const char* send,
+               const std::vector<size_t>& send_bytes, std::vector<char>* recv,
+               std::vector<size_t>* recv_bytes, const AlltoallOptions& opts) {
+  alltoallv_into(rpc, ep, send, send_bytes, [recv](size_t bytes) {
+    recv->resize(bytes);
+    return recv->data();
+  }, recv_bytes, opts);
+}
+
+} // namespace synchromesh
@@ -0,0 +1,99 @@
+#ifndef SYNCHROMESH_SHUFFLE_H
+#define SYNCHROMESH_SHUFFLE_H
+
+#include <type_traits>
+#include <vector>
+#include <boost/function.hpp>
+
+#include "util.h"
+#include "rpc.h"
+#include "datatype.h"
+
+// All-to-all exchange of variable-sized buckets, and repartitioning of
+// records by key on top of it.
+//
+//   std::vector<Edge> mine = shuffle(rpc, ep, edges, [](const Edge& e) {
+//     return hash64(e.src);
+//   });
+//
+// Every rank of the endpoint must call alltoallv() or shuffle() together.
+namespace synchromesh {
+
+struct AlltoallOptions {
+  enum Algorithm {
+    // n - 1 rounds, one peer each; data moves straight from the send
+    // buffer into the output.
+    kPairwise = 0,
+    // log2(n) rounds forwarding packed blocks; fewer, larger messages,
+    // for small buckets on many ranks.
+    kBruck = 1,
+  };
+
+  Algorithm algorithm = kPairwise;
+
+  // Pairwise: sends allowed in flight before waiting on the oldest, which
+  // bounds transport buffer use.
+  int max_inflight = 4;
+};
+
+// Send 'send_bytes[i]' bytes to the i'th rank of 'ep', taken back to back
+// from 'send'.  On return 'recv' holds what every rank sent to us,
+// concatenated in endpoint order, and 'recv_bytes[i]' the size from the
+// i'th rank.
+void alltoallv(RPC* rpc, const Endpoint& ep, const char* send,
+               const std::vector<size_t>& send_bytes, std::vector<char>* recv,
+               std::vector<size_t>* recv_bytes, const AlltoallOptions& opts = AlltoallOptions());
+
+// As above, but writes into the buffer returned by 'alloc', called once
+// with the total bytes to be received.
+void alltoallv_into(RPC* rpc, const Endpoint& ep, const char* send,
+               const std::vector<size_t>& send_bytes, boost::function<char*(size_t)> alloc,
+               std::vector<size_t>* recv_bytes, const AlltoallOptions& opts = AlltoallOptions());
+
+// The partition 'key' falls in: the high bits of key * n, so spread keys
+// map evenly and key order is kept across partitions.
+static inline int key_partition(uint64_t key, int n) {
+  return (int) (((unsigned __int128) key * n) >> 64);
+}
+
+// Move every record to the rank key_partition(key_fn(record)) of 'ep'.
+// Records are partitioned with one counting pass and one scatter pass.
+// Returns the records this rank receives, grouped by source rank in
+// endpoint order and otherwise in their original order.
+template<class T, class KeyFn>
+std::vector<T> shuffle(RPC* rpc, const Endpoint& ep, const std::vector<T>& records,
+                       KeyFn key_fn, const AlltoallOptions& opts = AlltoallOptions()) {
+  static_assert(std::is_trivially_copyable<T>::value, "shuffle needs trivially copyable records.");
+  const int n = ep.count();
+
+  std::vector<uint32_t> dest(records.size());
+  std::vector<size_t> counts(n, 0);
+  for (size_t i = 0; i < records.size(); ++i) {
+    dest[i] = key_partition(key_fn(records[i]), n);
+    ++counts[dest[i]];
+  }
+
+  std::vector<size_t> pos(n, 0);
+  std::vector<size_t> send_bytes(n);
+  for (int i = 0; i < n; ++i) {
+    pos[i] = i == 0 ? 0 : pos[i - 1] + counts[i - 1];
+    send_bytes[i] = counts[i] * sizeof(T);
+  }
+
+  std::vector<T> partitioned(records.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    partitioned[pos[dest[i]]++] = records[i];
+  }
+
+  std::vector<T> out;
+  std::vector<size_t> recv_bytes;
+  alltoallv_into(rpc, ep, (const char*) partitioned.data(), send_bytes, [&out](size_t bytes) {
+    out.resize(bytes / sizeof(T));
+    return (char*) out.data();
+  }, &recv_bytes, opts);
+  return out;
+}
+
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_SHUFFLE_H */
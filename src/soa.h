@@ -0,0 +1,267 @@
+#ifndef SYNCHROMESH_SOA_H
+#define SYNCHROMESH_SOA_H
+
+#include <stdlib.h>
+#include <tuple>
+#include <vector>
+
+#include "util.h"
+#include "datatype.h"
+
+// A structure-of-arrays container: one contiguous, cache-line aligned
+// array per field, so kernels walk each field with unit stride.
+//
+//   ShardedSoA<double, double, double> pts(n);
+//   double* x = pts.field<0>();
+//
+// Fields are synchronized independently; pass a mask built with
+// soa_fields() to send or receive only the fields that changed.  Float
+// and double fields can be sent lossily with set_quantization(), or a
+// Quantization passed per call; see quantize.h.
+namespace synchromesh {
+
+static const size_t kSoAAlignment = 64;
+static const uint32_t kAllFields = ~0u;
+
+static inline uint32_t soa_fields(int f) {
+  return 1u << f;
+}
+
+template<class... Rest>
+static inline uint32_t soa_fields(int f, Rest... rest) {
+  return soa_fields(f) | soa_fields(rest...);
+}
+
+template<class T>
+class AlignedAllocator {
+public:
+  typedef T value_type;
+
+  AlignedAllocator() {
+  }
+
+  template<class U>
+  AlignedAllocator(const AlignedAllocator<U>&) {
+  }
+
+  T* allocate(size_t n) {
+    void* p = NULL;
+    if (posix_memalign(&p, kSoAAlignment, n * sizeof(T)) != 0) {
+      PANIC("Failed to allocate %zu aligned bytes.", n * sizeof(T));
+    }
+    return (T*) p;
+  }
+
+  void deallocate(T* p, size_t) {
+    free(p);
+  }
+
+  template<class U>
+  bool operator==(const AlignedAllocator<U>&) const {
+    return true;
+  }
+
+  template<class U>
+  bool operator!=(const AlignedAllocator<U>&) const {
+    return false;
+  }
+};
+
+// A single field of a ShardedSoA.
+template<class V>
+class SoAField: public ArrayLike {
+private:
+  std::vector<V, AlignedAllocator<V> > m_;
+  mutable Quantizer quant_;
+public:
+  void* data_ptr() {
+    return (void*) m_.data();
+  }
+
+  const void* data_ptr() const {
+    return (void*) m_.data();
+  }
+
+  V* data() {
+    return m_.data();
+  }
+
+  const V* data() const {
+    return m_.data();
+  }
+
+  void resize(size_t sz) {
+    m_.resize(sz);
+  }
+
+  size_t count() const {
+    return m_.size();
+  }
+
+  size_t element_size() const {
+    return sizeof(V);
+  }
+
+  Quantizer* quantizer() const {
+    return &quant_;
+  }
+};
+
+template<class... Fields>
+class ShardedSoA {
+public:
+  static const int kNumFields = sizeof...(Fields);
+
+  template<int I>
+  using FieldType = typename std::tuple_element<I, std::tuple<Fields...> >::type;
+
+private:
+  std::tuple<SoAField<Fields>...> fields_;
+  ArrayLike* arrays_[kNumFields];
+
+  template<size_t... I>
+  void init_arrays(std::index_sequence<I...>) {
+    ((arrays_[I] = &std::get<I>(fields_)), ...);
+  }
+
+public:
+  ShardedSoA() {
+    init_arrays(std::index_sequence_for<Fields...>());
+  }
+
+  explicit ShardedSoA(size_t n) {
+    init_arrays(std::index_sequence_for<Fields...>());
+    resize(n);
+  }
+
+  ShardedSoA(const ShardedSoA& other) :
+      fields_(other.fields_) {
+    init_arrays(std::index_sequence_for<Fields...>());
+  }
+
+  ShardedSoA& operator=(const ShardedSoA& other) {
+    fields_ = other.fields_;
+    return *this;
+  }
+
+  template<int I>
+  FieldType<I>* field() {
+    return std::get<I>(fields_).data();
+  }
+
+  template<int I>
+  const FieldType<I>* field() const {
+    return std::get<I>(fields_).data();
+  }
+
+  ArrayLike& array(int f) {
+    return *arrays_[f];
+  }
+
+  const ArrayLike& array(int f) const {
+    return *arrays_[f];
+  }
+
+  void resize(size_t sz) {
+    for (int f = 0; f < kNumFields; ++f) {
+      arrays_[f]->resize(sz);
+    }
+  }
+
+  // Quantize the selected fields, which must be float or double.
+  void set_quantization(const Quantization& q, uint32_t fields = kAllFields) {
+    for (int f = 0; f < kNumFields; ++f) {
+      if (fields & soa_fields(f)) {
+        ASSERT(arrays_[f]->element_size() == sizeof(float)
+               || arrays_[f]->element_size() == sizeof(double), "Field %d is not floating point.", f);
+        arrays_[f]->quantizer()->set_quantization(q);
+      }
+    }
+  }
+
+  size_t size() const {
+    size_t sz = 0;
+    for (int f = 0; f < kNumFields; ++f) {
+      if (arrays_[f]->count() > sz) {
+        sz = arrays_[f]->count();
+      }
+    }
+    return sz;
+  }
+
+  // Address of element 'idx' of field 'f'.
+  const void* element_ptr(int f, size_t idx) const {
+    const ArrayLike& a = *arrays_[f];
+    return (const char*) a.data_ptr() + idx * a.element_size();
+  }
+};
+
+// A field's quantization for one call: 'q' if given, else the field's.
+static inline const Quantization& field_quantization(const ArrayLike& a, const Quantization& q) {
+  return q.enabled() ? q : a.quantizer()->quantization();
+}
+
+// Send the selected fields in full.  With a ShardedComm each field is
+// split with the same ShardCalc boundaries.
+template<class... F>
+Request* send(Comm& comm, const ShardedSoA<F...>& v, uint32_t fields = kAllFields,
+              const Quantization& q = Quantization()) {
+  RequestGroup* rg = new RequestGroup;
+  for (int f = 0; f < ShardedSoA<F...>::kNumFields; ++f) {
+    if (!(fields & soa_fields(f))) {
+      continue;
+    }
+    const Quantization& fq = field_quantization(v.array(f), q);
+    rg->add(fq.enabled() ? comm.send_quantized(v.array(f), fq) : comm.send_array(v.array(f)));
+  }
+  return rg;
+}
+
+template<class... F>
+void recv(Comm& comm, ShardedSoA<F...>& v, uint32_t fields = kAllFields,
+          const Quantization& q = Quantization()) {
+  for (int f = 0; f < ShardedSoA<F...>::kNumFields; ++f) {
+    if (!(fields & soa_fields(f))) {
+      continue;
+    }
+    if (field_quantization(v.array(f), q).enabled()) {
+      comm.recv_quantized(v.array(f));
+    } else {
+      comm.recv_array(v.array(f));
+    }
+  }
+  v.resize(v.size());
+}
+
+// Send only 'worker's shard of the selected fields, as assigned by
+// ShardCalc over 'num_workers'.  A ShardedComm recv on the other side
+// assembles the full arrays; quantized fields must be quantized there too.
+template<class... F>
+Request* send_shard(Comm& comm, const ShardedSoA<F...>& v, int worker, int num_workers,
+                    uint32_t fields = kAllFields, const Quantization& q = Quantization()) {
+  ShardCalc sc(v.size(), 1, num_workers);
+  RequestGroup* rg = new RequestGroup;
+  for (int f = 0; f < ShardedSoA<F...>::kNumFields; ++f) {
+    if (!(fields & soa_fields(f))) {
+      continue;
+    }
+    const ArrayLike& a = v.array(f);
+    const Quantization& fq = field_quantization(a, q);
+    size_t count = sc.num_elems(worker);
+    if (fq.enabled()) {
+      BufferRequest* br = new BufferRequest(fq.message_bytes(count));
+      Quantizer::encode(a.quantizer(), fq, a.data_ptr(), a.element_size(), sc.start_elem(worker),
+                        count, br->data());
+      br->add(comm.send_pod(br->data(), br->size()));
+      rg->add(br);
+    } else {
+      rg->add(send(comm, count));
+      rg->add(comm.send_pod(v.element_ptr(f, sc.start_elem(worker)), count * a.element_size()));
+    }
+  }
+  return rg;
+}
+
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_SOA_H */
@@ -0,0 +1,115 @@
+#include <string.h>
+
+#include "sparse.h"
+
+namespace synchromesh {
+
+namespace {
+
+// Leads each encoded range.  Sparse ranges follow it with 'nnz' offsets
+// from the start of the range ('index_bytes' each) then 'nnz' values;
+// dense ranges with all 'count' values.
+struct SparseHeader {
+  uint64_t count;
+  uint64_t nnz;
+  uint16_t elem_size;
+  uint8_t dense;
+  uint8_t index_bytes;
+  uint32_t unused;
+};
+
+static size_t index_bytes(size_t count) {
+  return count > UINT32_MAX ? 8 : 4;
+}
+
+} // namespace
+
+char* SparseArray::slot(uint64_t i) {
+  size_t k = idx_.empty() || idx_.back() < i ? idx_.size() : lower(i);
+  if (k == idx_.size() || idx_[k] != i) {
+    idx_.insert(idx_.begin() + k, i);
+    val_.insert(val_.begin() + k * elem_size_, elem_size_, 0);
+  }
+  return &val_[k * elem_size_];
+}
+
+void SparseArray::resize(size_t size) {
+  size_t k = lower(size);
+  idx_.resize(k);
+  val_.resize(k * elem_size_);
+  size_ = size;
+}
+
+bool SparseArray::encodes_dense(size_t first, size_t count) const {
+  size_t nnz = lower(first + count) - lower(first);
+  return count * elem_size_ <= nnz * (index_bytes(count) + elem_size_);
+}
+
+size_t SparseArray::encoded_bytes(size_t first, size_t count) const {
+  if (encodes_dense(first, count)) {
+    return sizeof(SparseHeader) + count * elem_size_;
+  }
+  size_t nnz = lower(first + count) - lower(first);
+  return sizeof(SparseHeader) + nnz * (index_bytes(count) + elem_size_);
+}
+
+void SparseArray::encode(size_t first, size_t count, char* out) const {
+  const size_t lo = lower(first);
+  const size_t hi = lower(first + count);
+  SparseHeader h;
+  memset(&h, 0, sizeof(h));
+  h.count = count;
+  h.nnz = hi - lo;
+  h.elem_size = elem_size_;
+  h.dense = encodes_dense(first, count);
+  h.index_bytes = index_bytes(count);
+  memcpy(out, &h, sizeof(h));
+  out += sizeof(h);
+
+  if (h.dense) {
+    memset(out, 0, count * elem_size_);
+    for (size_t k = lo; k < hi; ++k) {
+      memcpy(out + (idx_[k] - first) * elem_size_, &val_[k * elem_size_], elem_size_);
+    }
+    return;
+  }
+
+  for (size_t k = lo; k < hi; ++k) {
+    uint64_t off = idx_[k] - first;
+    memcpy(out, &off, h.index_bytes);
+    out += h.index_bytes;
+  }
+  memcpy(out, val_.data() + lo * elem_size_, h.nnz * elem_size_);
+}
+
+void SparseArray::append_encoded(const char* msg, size_t len) {
+  SparseHeader h;
+  ASSERT_GE(len, sizeof(h));
+  memcpy(&h, msg, sizeof(h));
+  ASSERT_EQ(h.elem_size, elem_size_);
+  const char* p = msg + sizeof(h);
+  const uint64_t base = size_;
+  size_ += h.count;
+
+  if (h.dense) {
+    ASSERT_EQ(len, sizeof(h) + h.count * elem_size_);
+    std::vector<char> zero(elem_size_, 0);
+    for (uint64_t i = 0; i < h.count; ++i, p += elem_size_) {
+      if (memcmp(p, zero.data(), elem_size_) != 0) {
+        idx_.push_back(base + i);
+        val_.insert(val_.end(), p, p + elem_size_);
+      }
+    }
+    return;
+  }
+
+  ASSERT_EQ(len, sizeof(h) + h.nnz * (h.index_bytes + elem_size_));
+  for (uint64_t k = 0; k < h.nnz; ++k, p += h.index_bytes) {
+    uint64_t off = 0;
+    memcpy(&off, p, h.index_bytes);
+    idx_.push_back(base + off);
+  }
+  val_.insert(val_.end(), p, p + h.nnz * elem_size_);
+}
+
+} // namespace synchromesh
@@ -0,0 +1,277 @@
+#ifndef SYNCHROMESH_SPARSE_H
+#define SYNCHROMESH_SPARSE_H
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <type_traits>
+#include <vector>
+
+#include "util.h"
+#include "rpc.h"
+#include "datatype.h"
+#include "shuffle.h"
+
+// Sparse vectors, for updates that are mostly zeros.
+//
+//   SparseShardedVector<float> grad(1 << 24);
+//   grad.add(i, g);
+//   send(sharded, grad);                 // each shard sparse or dense
+//   allreduce(rpc, ep, &grad);           // sums, keeping it sparse
+//
+// Only the stored entries are sent: each shard goes as (offset, value)
+// pairs, or as plain values when that is smaller.
+namespace synchromesh {
+
+// The untyped core of SparseShardedVector: a logical length and the
+// stored entries, sorted by index.
+class SparseArray {
+protected:
+  size_t size_;
+  size_t elem_size_;
+  std::vector<uint64_t> idx_;
+  // elem_size_ bytes per entry.
+  std::vector<char> val_;
+
+  // The first entry with index >= i.
+  size_t lower(uint64_t i) const {
+    return std::lower_bound(idx_.begin(), idx_.end(), i) - idx_.begin();
+  }
+
+  // The entry for index i, inserted zeroed if missing.
+  char* slot(uint64_t i);
+
+public:
+  SparseArray(size_t size, size_t elem_size) :
+      size_(size), elem_size_(elem_size) {
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  // Drops entries past the new end.
+  void resize(size_t size);
+
+  size_t nnz() const {
+    return idx_.size();
+  }
+
+  size_t element_size() const {
+    return elem_size_;
+  }
+
+  const std::vector<uint64_t>& indices() const {
+    return idx_;
+  }
+
+  // Remove every entry, keeping the length.
+  void clear() {
+    idx_.clear();
+    val_.clear();
+  }
+
+  // Wire encoding of elements [first, first + count): sparse or dense,
+  // whichever is smaller.
+  size_t encoded_bytes(size_t first, size_t count) const;
+  bool encodes_dense(size_t first, size_t count) const;
+  void encode(size_t first, size_t count, char* out) const;
+
+  // Append an encoded range after the current end; dense ranges keep only
+  // their non-zero elements.
+  void append_encoded(const char* msg, size_t len);
+};
+
+template<class V>
+class SparseShardedVector: public SparseArray {
+public:
+  static_assert(std::is_trivially_copyable<V>::value, "Sparse vectors need trivially copyable values.");
+
+  explicit SparseShardedVector(size_t size = 0) :
+      SparseArray(size, sizeof(V)) {
+  }
+
+  const V* values() const {
+    return (const V*) val_.data();
+  }
+
+  V* values() {
+    return (V*) val_.data();
+  }
+
+  // Zero if not stored.
+  V get(size_t i) const {
+    size_t k = lower(i);
+    return k < idx_.size() && idx_[k] == i ? values()[k] : V();
+  }
+
+  V operator[](size_t i) const {
+    return get(i);
+  }
+
+  // O(1) when indices are set in increasing order.
+  void set(size_t i, const V& v) {
+    ASSERT_LT(i, size_);
+    *(V*) slot(i) = v;
+  }
+
+  void add(size_t i, const V& v) {
+    ASSERT_LT(i, size_);
+    *(V*) slot(i) += v;
+  }
+
+  // The non-zero elements of 'n' values.
+  static SparseShardedVector from_dense(const V* v, size_t n) {
+    SparseShardedVector s(n);
+    for (size_t i = 0; i < n; ++i) {
+      if (v[i] != V()) {
+        s.set(i, v[i]);
+      }
+    }
+    return s;
+  }
+
+  // Write all size() elements to 'out'.
+  void to_dense(V* out) const {
+    std::fill(out, out + size_, V());
+    for (size_t k = 0; k < idx_.size(); ++k) {
+      out[idx_[k]] = values()[k];
+    }
+  }
+};
+
+// Like a ShardedVector: a ShardedComm sends each worker its shard and
+// receives the shards of every worker in order; other comms move the
+// whole vector.
+template<class V>
+Request* send(Comm& comm, const SparseShardedVector<V>& v) {
+  return comm.send_sparse(v);
+}
+
+template<class V>
+void recv(Comm& comm, SparseShardedVector<V>& v) {
+  comm.recv_sparse(v);
+}
+
+namespace detail {
+
+template<class V>
+struct SparseEntry {
+  uint64_t idx;
+  V val;
+};
+
+// Merge sorted runs of entries, combining equal indices with 'op'.
+template<class V, class Op>
+void merge_runs(const std::vector<std::pair<const SparseEntry<V>*, size_t> >& runs, Op op,
+                std::vector<SparseEntry<V> >* out) {
+  typedef std::pair<uint64_t, size_t> Head;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heads;
+  std::vector<size_t> pos(runs.size(), 0);
+  for (size_t r = 0; r < runs.size(); ++r) {
+    if (runs[r].second > 0) {
+      heads.push(Head(runs[r].first[0].idx, r));
+    }
+  }
+  while (!heads.empty()) {
+    size_t r = heads.top().second;
+    heads.pop();
+    const SparseEntry<V>& e = runs[r].first[pos[r]];
+    if (!out->empty() && out->back().idx == e.idx) {
+      out->back().val = op(out->back().val, e.val);
+    } else {
+      out->push_back(e);
+    }
+    if (++pos[r] < runs[r].second) {
+      heads.push(Head(runs[r].first[pos[r]].idx, r));
+    }
+  }
+}
+
+} // namespace detail
+
+// Reduce 'v' element-wise with 'op' across every rank of 'ep', leaving the
+// result on all of them; every rank's 'v' must have the same size().
+// Each rank owns a ShardCalc range of indices: entries are sent to their
+// owner (alltoallv), owners merge the sorted lists, and the merged ranges
+// are exchanged.  Ranges travel in the wire encoding of send(), so traffic
+// is proportional to the entries, never to size(); nothing is densified.
+template<class V, class Op = std::plus<V> >
+void allreduce(RPC* rpc, const Endpoint& ep, SparseShardedVector<V>* v, Op op = Op()) {
+  typedef detail::SparseEntry<V> Entry;
+  const int n = ep.count();
+  const int me = ep.index_of(rpc->id());
+  ASSERT_GE(me, 0);
+  ShardCalc sc(v->size(), sizeof(V), n);
+
+  std::vector<size_t> send_bytes(n);
+  size_t total = 0;
+  for (int r = 0; r < n; ++r) {
+    send_bytes[r] = v->encoded_bytes(sc.start_elem(r), sc.num_elems(r));
+    total += send_bytes[r];
+  }
+  std::vector<char> out(total);
+  char* o = out.data();
+  for (int r = 0; r < n; ++r) {
+    v->encode(sc.start_elem(r), sc.num_elems(r), o);
+    o += send_bytes[r];
+  }
+
+  std::vector<char> owned;
+  std::vector<size_t> recv_bytes;
+  alltoallv_into(rpc, ep, out.data(), send_bytes, [&owned](size_t bytes) {
+    owned.resize(bytes);
+    return owned.data();
+  }, &recv_bytes);
+
+  // Indices are relative to the start of this rank's range from here on.
+  std::vector<std::vector<Entry> > parts(n);
+  std::vector<std::pair<const Entry*, size_t> > runs;
+  const char* p = owned.data();
+  for (int r = 0; r < n; ++r) {
+    SparseShardedVector<V> part;
+    part.append_encoded(p, recv_bytes[r]);
+    p += recv_bytes[r];
+    for (size_t k = 0; k < part.nnz(); ++k) {
+      parts[r].push_back(Entry { part.indices()[k], part.values()[k] });
+    }
+    runs.push_back(std::make_pair(parts[r].data(), parts[r].size()));
+  }
+  std::vector<Entry> merged;
+  detail::merge_runs(runs, op, &merged);
+
+  SparseShardedVector<V> reduced(sc.num_elems(me));
+  for (auto& e : merged) {
+    reduced.set(e.idx, e.val);
+  }
+  std::vector<char> mine(reduced.encoded_bytes(0, reduced.size()));
+  reduced.encode(0, reduced.size(), mine.data());
+
+  // Every rank sends its reduced range to every other.
+  RequestGroup rg;
+  for (int k = 1; k < n; ++k) {
+    rg.add(rpc->send_data(ep[(me + k) % n], ep.tag(), mine.data(), mine.size()));
+  }
+  std::vector<Buffer::Ptr> ranges(n);
+  for (int k = 1; k < n; ++k) {
+    int from = (me - k + n) % n;
+    ranges[from] = rpc->recv_buffer(ep[from], ep.tag());
+  }
+
+  // The ranges are in index order, so appending them rebuilds 'v'.
+  const size_t size = v->size();
+  v->resize(0);
+  for (int r = 0; r < n; ++r) {
+    if (r == me) {
+      v->append_encoded(mine.data(), mine.size());
+    } else {
+      v->append_encoded(ranges[r]->data(), ranges[r]->size());
+    }
+  }
+  ASSERT_EQ(v->size(), size);
+  rg.wait();
+}
+
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_SPARSE_H */
@@ -3,6 +3,19 @@
 
 #include "rpc.h"
 #include "datatype.h"
+#include "metrics.h"
+#include "quantize.h"
+#include "soa.h"
+#include "view.h"
+#include "checkpoint.h"
+#include "topology.h"
+#include "ndarray.h"
+#include "shuffle.h"
+#include "sparse.h"
+#include "paramserver.h"
+#include "bsp.h"
+#include "trace.h"
 #include "fiber.h"
+#include "coro.h"
 
 #endif /* SYNCHROMESH_H */
@@ -0,0 +1,379 @@
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "topology.h"
+
+namespace synchromesh {
+
+static const uint64_t kFnvOffset = 14695981039346656037ULL;
+static const uint64_t kFnvPrime = 1099511628211ULL;
+
+Topology::Topology(const std::vector<int>& node_of) :
+    node_(node_of), hash_(kFnvOffset) {
+  for (int n : node_) {
+    hash_ = (hash_ ^ (uint32_t) n) * kFnvPrime;
+  }
+}
+
+Topology Topology::blocked(int num_workers, int ranks_per_node) {
+  ASSERT_GT(ranks_per_node, 0);
+  std::vector<int> node_of(num_workers);
+  for (int i = 0; i < num_workers; ++i) {
+    node_of[i] = i / ranks_per_node;
+  }
+  return Topology(node_of);
+}
+
+SharedSegment::SharedSegment(const std::string& name, size_t size, bool create) :
+    name_(name), size_(size), owner_(create) {
+  int flags = create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR;
+  int fd = shm_open(name_.c_str(), flags, 0600);
+  ASSERT(fd >= 0, "Failed to open shared segment %s: %s", name_.c_str(), strerror(errno));
+  if (create) {
+    ASSERT(ftruncate(fd, size_) == 0, "Failed to size %s: %s", name_.c_str(), strerror(errno));
+  }
+  base_ = (char*) mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  ASSERT(base_ != MAP_FAILED, "Failed to map %s: %s", name_.c_str(), strerror(errno));
+}
+
+SharedSegment::~SharedSegment() {
+  munmap(base_, size_);
+  if (owner_) {
+    shm_unlink(name_.c_str());
+  }
+}
+
+SharedSegment* SharedSegment::create(size_t size) {
+  static std::atomic<int> seq(0);
+  char name[64];
+  snprintf(name, sizeof(name), "/synchromesh.%d.%d", getpid(), seq++);
+  return new SharedSegment(name, size, true);
+}
+
+SharedSegment* SharedSegment::attach(const std::string& name, size_t size) {
+  return new SharedSegment(name, size, false);
+}
+
+namespace {
+
+// Sent by a leader to tell members the segment is ready to write or read.
+struct SegmentMsg {
+  uint64_t gen;
+  uint64_t size;
+  // Broadcasts: the bytes of the message in the segment.
+  uint64_t bytes;
+  char name[48];
+};
+
+static const size_t kMinSegmentBytes = 1 << 16;
+
+} // namespace
+
+struct HierComm::NodeLayout {
+  // Endpoint positions by node; the first on each node is its leader.
+  std::vector<std::vector<int> > nodes;
+
+  // For each endpoint position, its node and its slot within the node.
+  std::vector<int> node_of;
+  std::vector<int> slot_of;
+
+  // Nodes are numbered in order of their first rank in the endpoint.
+  NodeLayout(const Endpoint& ep, const Topology& topo) :
+      node_of(ep.count()), slot_of(ep.count()) {
+    std::map<int, int> numbering;
+    for (int i = 0; i < ep.count(); ++i) {
+      auto it = numbering.insert(std::make_pair(topo.node(ep[i]), (int) nodes.size())).first;
+      if (it->second == (int) nodes.size()) {
+        nodes.push_back(std::vector<int>());
+      }
+      node_of[i] = it->second;
+      slot_of[i] = nodes[it->second].size();
+      nodes[it->second].push_back(i);
+    }
+  }
+};
+
+HierComm::HierComm(RPC* rpc, const Endpoint& ep, const Topology& topo, int root) :
+    Comm(rpc, ep), topo_(topo), root_(root), me_(rpc->id()), my_index_(ep.index_of(me_)),
+    my_node_(-1), my_slot_(-1), leader_(-1), seg_(NULL), gen_(0) {
+  layout_ = group_state<NodeLayout>(rpc, ep, topo.hash(), [&]() {
+    return new NodeLayout(ep, topo);
+  });
+
+  if (my_index_ >= 0) {
+    my_node_ = layout_->node_of[my_index_];
+    my_slot_ = layout_->slot_of[my_index_];
+    leader_ = leader_of(my_node_);
+  }
+}
+
+HierComm::~HierComm() {
+  if (is_leader()) {
+    wait_for_acks();
+  }
+  delete seg_;
+}
+
+int HierComm::leader_of(int node) const {
+  return ep_[layout_->nodes[node][0]];
+}
+
+int HierComm::num_members(int skip) const {
+  int count = 0;
+  for (auto i : layout_->nodes[my_node_]) {
+    if (ep_[i] != me_ && ep_[i] != skip) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+// Members ack each segment message once they are done with the segment;
+// the leader collects the acks before it next writes to it.
+void HierComm::wait_for_acks() {
+  int ack;
+  for (auto m : acks_) {
+    rpc_->recv_data(m, ep_.tag(), &ack, sizeof(ack));
+  }
+  acks_.clear();
+}
+
+void HierComm::reserve(size_t bytes) {
+  if (seg_ != NULL && seg_->size() >= bytes) {
+    return;
+  }
+  size_t size = std::max(bytes, kMinSegmentBytes);
+  if (seg_ != NULL) {
+    size = std::max(size, 2 * seg_->size());
+  }
+  delete seg_;
+  seg_ = SharedSegment::create(size);
+  ++gen_;
+}
+
+void HierComm::notify_members(int skip, size_t bytes) {
+  SegmentMsg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.gen = gen_;
+  msg.size = seg_->size();
+  msg.bytes = bytes;
+  strncpy(msg.name, seg_->name().c_str(), sizeof(msg.name) - 1);
+
+  RequestGroup rg;
+  for (auto i : layout_->nodes[my_node_]) {
+    int m = ep_[i];
+    if (m != me_ && m != skip) {
+      rg.add(rpc_->send_data(m, ep_.tag(), &msg, sizeof(msg)));
+      acks_.push_back(m);
+    }
+  }
+  rg.wait();
+}
+
+size_t HierComm::attach_segment() {
+  SegmentMsg msg;
+  rpc_->recv_data(leader_, ep_.tag(), &msg, sizeof(msg));
+  if (seg_ == NULL || msg.gen != gen_) {
+    delete seg_;
+    seg_ = SharedSegment::attach(msg.name, msg.size);
+    gen_ = msg.gen;
+  }
+  return msg.bytes;
+}
+
+void HierComm::send_ack() {
+  int ack = 0;
+  Request* r = rpc_->send_data(leader_, ep_.tag(), &ack, sizeof(ack));
+  r->wait();
+  delete r;
+}
+
+void HierComm::unpack_node(int node, const char* in, size_t len, char* out) const {
+  for (size_t j = 0; j < layout_->nodes[node].size(); ++j) {
+    memcpy(out + layout_->nodes[node][j] * len, in + j * len, len);
+  }
+}
+
+// The root sends once to each node's leader (or its own node's, if the
+// root isn't a leader), which republishes through the segment.
+Request* HierComm::send_pod(const void* v, size_t len) {
+  METRICS_COMM_SCOPE(kHierComm);
+  ASSERT_EQ(me_, root_);
+  RequestGroup* rg = new RequestGroup;
+  for (size_t k = 0; k < layout_->nodes.size(); ++k) {
+    if (leader_of(k) != me_) {
+      rg->add(rpc_->send_data(leader_of(k), ep_.tag(), v, len));
+    }
+  }
+
+  if (is_leader() && num_members(-1) > 0) {
+    wait_for_acks();
+    reserve(len);
+    memcpy(seg_->data(), v, len);
+    notify_members(-1, len);
+  }
+  return rg;
+}
+
+void HierComm::recv_pod(void* v, size_t len) {
+  METRICS_COMM_SCOPE(kHierComm);
+  ASSERT_GE(my_index_, 0);
+  if (!is_leader()) {
+    attach_segment();
+    memcpy(v, seg_->data(), len);
+    send_ack();
+    return;
+  }
+
+  wait_for_acks();
+  if (num_members(root_) == 0) {
+    rpc_->recv_data(root_, ep_.tag(), v, len);
+    return;
+  }
+  reserve(len);
+  rpc_->recv_data(root_, ep_.tag(), seg_->data(), len);
+  notify_members(root_, len);
+  memcpy(v, seg_->data(), len);
+}
+
+// As recv_pod(), for a message of any size: members learn it from the
+// segment notification.
+Buffer::Ptr HierComm::recv_buffer() {
+  METRICS_COMM_SCOPE(kHierComm);
+  ASSERT_GE(my_index_, 0);
+  if (!is_leader()) {
+    size_t len = attach_segment();
+    HeapBuffer* buf = new HeapBuffer(len);
+    memcpy(buf->data(), seg_->data(), len);
+    send_ack();
+    return Buffer::Ptr(buf);
+  }
+
+  wait_for_acks();
+  Buffer::Ptr buf = rpc_->recv_buffer(root_, ep_.tag());
+  if (num_members(root_) > 0) {
+    reserve(buf->size());
+    memcpy(seg_->data(), buf->data(), buf->size());
+    notify_members(root_, buf->size());
+  }
+  return buf;
+}
+
+bool HierComm::poll() const {
+  if (me_ == root_) {
+    return true;
+  }
+  return rpc_->poll(is_leader() ? root_ : leader_, ep_.tag());
+}
+
+// Members write their slot of the leader's segment, in node order; each
+// leader forwards its node's block to the root.
+void HierComm::gather(const void* local, size_t len, void* out) {
+  METRICS_COMM_SCOPE(kHierComm);
+  ASSERT_GE(my_index_, 0);
+  const size_t node_bytes = layout_->nodes[my_node_].size() * len;
+
+  if (!is_leader()) {
+    attach_segment();
+    memcpy(seg_->data() + my_slot_ * len, local, len);
+    send_ack();
+  } else {
+    const char* block = (const char*) local;
+    if (num_members(-1) > 0) {
+      wait_for_acks();
+      reserve(node_bytes);
+      notify_members(-1);
+      memcpy(seg_->data() + my_slot_ * len, local, len);
+      wait_for_acks();
+      block = seg_->data();
+    }
+
+    if (me_ == root_) {
+      unpack_node(my_node_, block, len, (char*) out);
+    } else {
+      Request* r = rpc_->send_data(root_, ep_.tag(), block, node_bytes);
+      r->wait();
+      delete r;
+    }
+  }
+
+  if (me_ != root_) {
+    return;
+  }
+  for (size_t k = 0; k < layout_->nodes.size(); ++k) {
+    if (leader_of(k) == me_) {
+      continue;
+    }
+    Buffer::Ptr buf = rpc_->recv_buffer(leader_of(k), ep_.tag());
+    ASSERT_EQ(buf->size(), layout_->nodes[k].size() * len);
+    unpack_node(k, buf->data(), len, (char*) out);
+  }
+}
+
+// Members write their slot of the leader's segment, in endpoint order;
+// leaders swap node blocks and fill in the rest, then members copy the
+// whole result out.
+void HierComm::allgather(const void* local, size_t len, void* out) {
+  METRICS_COMM_SCOPE(kHierComm);
+  ASSERT_GE(my_index_, 0);
+  const size_t total = ep_.count() * len;
+
+  if (!is_leader()) {
+    attach_segment();
+    memcpy(seg_->data() + my_index_ * len, local, len);
+    send_ack();
+    attach_segment();
+    memcpy(out, seg_->data(), total);
+    send_ack();
+    return;
+  }
+
+  const bool shared = num_members(-1) > 0;
+  char* result = (char*) out;
+  if (shared) {
+    wait_for_acks();
+    reserve(total);
+    notify_members(-1);
+    result = seg_->data();
+  }
+  memcpy(result + my_index_ * len, local, len);
+  if (shared) {
+    wait_for_acks();
+  }
+
+  if (layout_->nodes.size() > 1) {
+    const std::vector<int>& mine = layout_->nodes[my_node_];
+    BufferRequest block(mine.size() * len);
+    for (size_t j = 0; j < mine.size(); ++j) {
+      memcpy(block.data() + j * len, result + mine[j] * len, len);
+    }
+    for (size_t k = 0; k < layout_->nodes.size(); ++k) {
+      if (k != (size_t) my_node_) {
+        block.add(rpc_->send_data(leader_of(k), ep_.tag(), block.data(), block.size()));
+      }
+    }
+    for (size_t k = 0; k < layout_->nodes.size(); ++k) {
+      if (k == (size_t) my_node_) {
+        continue;
+      }
+      Buffer::Ptr buf = rpc_->recv_buffer(leader_of(k), ep_.tag());
+      ASSERT_EQ(buf->size(), layout_->nodes[k].size() * len);
+      unpack_node(k, buf->data(), len, result);
+    }
+    block.wait();
+  }
+
+  if (shared) {
+    notify_members(-1);
+    memcpy(out, result, total);
+  }
+}
+
+} // namespace synchromesh
@@ -0,0 +1,165 @@
+#ifndef SYNCHROMESH_TOPOLOGY_H
+#define SYNCHROMESH_TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "rpc.h"
+#include "datatype.h"
+
+// Node-aware (two-level) collectives.
+//
+// A Topology records which node each rank runs on.  HierComm runs
+// broadcast, gather and allgather over an Endpoint in two levels: the
+// lowest rank of each node acts as its leader and is the only rank that
+// exchanges data across the network; the other ranks on the node read and
+// write a shared-memory segment the leader owns.
+//
+//   Topology topo = Topology::detect(rpc);
+//   HierComm hier(rpc, Endpoint(0, rpc->last(), kTag), topo, 0);
+//   if (rpc->id() == 0) {
+//     send(hier, params)->wait();
+//   } else {
+//     recv(hier, params);
+//   }
+//   hier.allgather(&local, sizeof(local), all);
+//
+// As a Comm, HierComm broadcasts from 'root' to the rest of the endpoint,
+// so any send()/recv() overload works over it.  Control and data messages
+// share the endpoint's tag, and rely on messages between a pair of ranks
+// arriving in order.
+namespace synchromesh {
+
+class Topology {
+private:
+  std::vector<int> node_;
+  uint64_t hash_;
+public:
+  Topology() :
+      hash_(0) {
+  }
+
+  // 'node_of[r]' is the node rank 'r' runs on.
+  explicit Topology(const std::vector<int>& node_of);
+
+  // Ask the transport which ranks share a node.
+  static Topology detect(RPC* rpc) {
+    return Topology(rpc->node_map());
+  }
+
+  // 'ranks_per_node' consecutive ranks on each node.
+  static Topology blocked(int num_workers, int ranks_per_node);
+
+  int node(int rank) const {
+    ASSERT_LT(rank, (int) node_.size());
+    return node_[rank];
+  }
+
+  int num_workers() const {
+    return node_.size();
+  }
+
+  bool same_node(int a, int b) const {
+    return node(a) == node(b);
+  }
+
+  // A fingerprint of the node map, for caching state derived from it.
+  uint64_t hash() const {
+    return hash_;
+  }
+};
+
+// A POSIX shared memory segment, created by one rank and attached to by
+// the others on its node.  The creator unlinks it on destruction.
+class SharedSegment {
+private:
+  std::string name_;
+  char* base_;
+  size_t size_;
+  bool owner_;
+
+  SharedSegment(const std::string& name, size_t size, bool create);
+public:
+  ~SharedSegment();
+
+  static SharedSegment* create(size_t size);
+  static SharedSegment* attach(const std::string& name, size_t size);
+
+  const std::string& name() const {
+    return name_;
+  }
+
+  char* data() {
+    return base_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+};
+
+class HierComm: public Comm {
+private:
+  Topology topo_;
+  int root_;
+  int me_;
+
+  // Our position in 'ep_'; gather output is laid out in endpoint order.
+  int my_index_;
+
+  // Endpoint positions by node, shared by every HierComm over the same
+  // group and topology on this RPC.
+  struct NodeLayout;
+  boost::shared_ptr<const NodeLayout> layout_;
+  int my_node_;
+  int my_slot_;
+  int leader_;
+
+  // Leader: the segment it owns, and members yet to finish reading it.
+  // Member: the leader's segment as last attached.
+  SharedSegment* seg_;
+  uint64_t gen_;
+  std::vector<int> acks_;
+
+  int leader_of(int node) const;
+
+  // Leader side.
+  int num_members(int skip) const;
+  void wait_for_acks();
+  void reserve(size_t bytes);
+  // 'bytes': the size of a broadcast message in the segment.
+  void notify_members(int skip, size_t bytes = 0);
+
+  // Member side.  Returns the notification's message size.
+  size_t attach_segment();
+  void send_ack();
+
+  // Scatter 'node's slots, packed in node order, into endpoint order.
+  void unpack_node(int node, const char* in, size_t len, char* out) const;
+
+public:
+  HierComm(RPC* rpc, const Endpoint& ep, const Topology& topo, int root);
+  ~HierComm();
+
+  // Broadcast from 'root' to every other rank of the endpoint.
+  virtual Request* send_pod(const void* v, size_t len);
+  virtual void recv_pod(void* v, size_t len);
+  virtual Buffer::Ptr recv_buffer();
+  virtual bool poll() const;
+
+  // Every rank of the endpoint contributes 'len' bytes; 'out' receives
+  // them all, in endpoint order, on the root (gather) or everywhere
+  // (allgather).
+  void gather(const void* local, size_t len, void* out);
+  void allgather(const void* local, size_t len, void* out);
+
+  // True if this rank exchanges data across nodes for its node.
+  bool is_leader() const {
+    return me_ == leader_;
+  }
+};
+
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_TOPOLOGY_H */
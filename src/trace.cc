@@ -0,0 +1,461 @@
+#include <algorithm>
+#include <deque>
+#include <errno.h>
+#include <queue>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+namespace synchromesh {
+
+namespace {
+
+struct TraceHeader {
+  char magic[8];
+  int32_t rank;
+  int32_t num_workers;
+  uint64_t num_events;
+};
+
+static const char kTraceMagic[8] = { 'S', 'Y', 'N', 'C', 'T', 'R', 'C', '1' };
+
+static std::string trace_path(const std::string& prefix, int rank) {
+  char suffix[16];
+  snprintf(suffix, sizeof(suffix), ".%d", rank);
+  return prefix + suffix;
+}
+
+static void read_header(FILE* f, const std::string& path, TraceHeader* h) {
+  ASSERT(fread(h, sizeof(*h), 1, f) == 1, "Short trace file %s", path.c_str());
+  ASSERT(memcmp(h->magic, kTraceMagic, sizeof(kTraceMagic)) == 0, "Not a trace: %s", path.c_str());
+}
+
+} // namespace
+
+void write_trace(const std::string& prefix, int rank, int num_workers,
+                 const std::vector<TraceEvent>& events) {
+  std::string path = trace_path(prefix, rank);
+  FILE* f = fopen(path.c_str(), "wb");
+  ASSERT(f != NULL, "Failed to open %s: %s", path.c_str(), strerror(errno));
+
+  TraceHeader h;
+  memcpy(h.magic, kTraceMagic, sizeof(kTraceMagic));
+  h.rank = rank;
+  h.num_workers = num_workers;
+  h.num_events = events.size();
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+      && fwrite(events.data(), sizeof(TraceEvent), events.size(), f) == events.size();
+  ok = fclose(f) == 0 && ok;
+  ASSERT(ok, "Failed to write %s: %s", path.c_str(), strerror(errno));
+}
+
+Trace Trace::load(const std::string& prefix) {
+  Trace trace;
+  for (int r = 0; r == 0 || r < trace.num_workers(); ++r) {
+    std::string path = trace_path(prefix, r);
+    FILE* f = fopen(path.c_str(), "rb");
+    ASSERT(f != NULL, "Failed to open %s: %s", path.c_str(), strerror(errno));
+    TraceHeader h;
+    read_header(f, path, &h);
+    if (r == 0) {
+      trace.ranks_.resize(h.num_workers);
+    }
+    ASSERT_EQ(h.rank, r);
+    ASSERT_EQ(h.num_workers, trace.num_workers());
+
+    std::vector<TraceEvent>& events = trace.ranks_[r];
+    events.resize(h.num_events);
+    ASSERT(fread(events.data(), sizeof(TraceEvent), events.size(), f) == events.size(),
+           "Short trace file %s", path.c_str());
+    fclose(f);
+  }
+  return trace;
+}
+
+TracingRPC::TracingRPC(RPC* rpc) :
+    rpc_(rpc), root_(this), start_ns_(now_ns()) {
+}
+
+TracingRPC::TracingRPC(RPC* rpc, TracingRPC* root) :
+    rpc_(rpc), root_(root), start_ns_(root->start_ns_) {
+}
+
+TracingRPC::~TracingRPC() {
+  for (auto& kv : channels_) {
+    delete kv.second;
+  }
+}
+
+RPC* TracingRPC::channel(int c) {
+  if (c == 0) {
+    return root_;
+  }
+  boost::mutex::scoped_lock l(root_->channels_mu_);
+  TracingRPC*& ch = root_->channels_[c];
+  if (ch == NULL) {
+    ch = new TracingRPC(root_->rpc_->channel(c), root_);
+  }
+  return ch;
+}
+
+// A run of missed polls on the same (peer, tag) is one event, so spinning
+// on a message doesn't flood the trace.
+void TracingRPC::record(TraceEvent::Op op, int peer, int tag, size_t bytes, uint64_t start,
+                        bool hit) const {
+  if (op == TraceEvent::kPoll && !hit) {
+    boost::mutex::scoped_lock l(root_->mut_);
+    if (!root_->events_.empty()) {
+      TraceEvent& last = root_->events_.back();
+      if (last.op == TraceEvent::kPoll && !last.hit && last.peer == peer && last.tag == tag) {
+        last.end_ns = now_ns() - start_ns_;
+        ++last.bytes;
+        return;
+      }
+    }
+  }
+
+  TraceEvent e;
+  memset(&e, 0, sizeof(e));
+  e.start_ns = start - start_ns_;
+  e.end_ns = now_ns() - start_ns_;
+  e.peer = peer;
+  e.tag = tag;
+  e.bytes = bytes;
+  e.op = op;
+  e.hit = hit;
+  boost::mutex::scoped_lock l(root_->mut_);
+  root_->events_.push_back(e);
+}
+
+Request* TracingRPC::send_data(int dst, int tag, const void* ptr, int bytes) {
+  uint64_t start = now_ns();
+  Request* r = rpc_->send_data(dst, tag, ptr, bytes);
+  record(TraceEvent::kSend, dst, tag, bytes, start, false);
+  return r;
+}
+
+void TracingRPC::recv_data(int src, int tag, void* ptr, int bytes) {
+  uint64_t start = now_ns();
+  rpc_->recv_data(src, tag, ptr, bytes);
+  record(TraceEvent::kRecv, src, tag, bytes, start, false);
+}
+
+Request* TracingRPC::irecv_data(int src, int tag, void* ptr, int bytes) {
+  uint64_t start = now_ns();
+  Request* r = rpc_->irecv_data(src, tag, ptr, bytes);
+  record(TraceEvent::kIrecv, src, tag, bytes, start, false);
+  return r;
+}
+
+Buffer::Ptr TracingRPC::recv_buffer(int src, int tag) {
+  uint64_t start = now_ns();
+  Buffer::Ptr buf = rpc_->recv_buffer(src, tag);
+  record(TraceEvent::kRecv, src, tag, buf->size(), start, false);
+  return buf;
+}
+
+Request* TracingRPC::send_layout(int dst, int tag, const void* base, const Layout& layout) {
+  uint64_t start = now_ns();
+  Request* r = rpc_->send_layout(dst, tag, base, layout);
+  record(TraceEvent::kSend, dst, tag, layout.bytes(), start, false);
+  return r;
+}
+
+void TracingRPC::recv_layout(int src, int tag, void* base, const Layout& layout) {
+  uint64_t start = now_ns();
+  rpc_->recv_layout(src, tag, base, layout);
+  record(TraceEvent::kRecv, src, tag, layout.bytes(), start, false);
+}
+
+bool TracingRPC::poll(int src, int tag) const {
+  uint64_t start = now_ns();
+  bool hit = rpc_->poll(src, tag);
+  record(TraceEvent::kPoll, src, tag, 1, start, hit);
+  return hit;
+}
+
+std::vector<TraceEvent> TracingRPC::events() {
+  boost::mutex::scoped_lock l(mut_);
+  return events_;
+}
+
+void TracingRPC::write(const std::string& prefix) {
+  write_trace(prefix, id(), num_workers(), events());
+}
+
+// Sleep through most of a long pause and spin the rest, so short gaps stay
+// accurate.
+static void pause_ns(uint64_t ns) {
+  uint64_t start = now_ns();
+  if (ns > 200000) {
+    usleep((ns - 100000) / 1000);
+  }
+  while (now_ns() - start < ns) {
+  }
+}
+
+// Sends are left in flight and receives posted with irecv_data() are
+// waited for at the end, since the trace doesn't say when they were
+// waited on.  Receives with wildcards take whatever arrives, whatever its
+// size.  A run of missed polls is polled once.
+uint64_t replay(RPC* rpc, const Trace& trace, const ReplayOptions& opts) {
+  uint64_t start = now_ns();
+  if (rpc->id() >= trace.num_workers()) {
+    return 0;
+  }
+
+  const std::vector<TraceEvent>& events = trace.events(rpc->id());
+  size_t max_bytes = 1;
+  for (auto& e : events) {
+    if (e.op != TraceEvent::kPoll) {
+      max_bytes = std::max<size_t>(max_bytes, e.bytes);
+    }
+  }
+  std::vector<char> scratch(max_bytes);
+  std::deque<std::vector<char> > irecv_bufs;
+  RequestGroup sends;
+  RequestGroup recvs;
+
+  uint64_t prev_end = 0;
+  for (auto& e : events) {
+    pause_ns((e.start_ns - std::min(prev_end, e.start_ns)) * opts.compute_scale);
+    prev_end = e.end_ns;
+
+    switch (e.op) {
+    case TraceEvent::kSend:
+      sends.add(rpc->send_data(e.peer, e.tag, scratch.data(), e.bytes));
+      break;
+    case TraceEvent::kRecv:
+      if (e.peer == RPC::kAnyWorker || e.tag == RPC::kAnyTag) {
+        rpc->recv_buffer(e.peer, e.tag);
+      } else {
+        rpc->recv_data(e.peer, e.tag, scratch.data(), e.bytes);
+      }
+      break;
+    case TraceEvent::kIrecv:
+      irecv_bufs.push_back(std::vector<char>(e.bytes));
+      recvs.add(rpc->irecv_data(e.peer, e.tag, irecv_bufs.back().data(), e.bytes));
+      break;
+    case TraceEvent::kPoll:
+      rpc->poll(e.peer, e.tag);
+      break;
+    default:
+      PANIC("Unknown trace op %d", e.op);
+    }
+  }
+
+  recvs.wait();
+  sends.wait();
+  return now_ns() - start;
+}
+
+namespace {
+
+struct SimMessage {
+  int src;
+  int tag;
+  uint32_t bytes;
+  double arrival;
+};
+
+struct SimRank {
+  size_t next = 0;
+  double clock = 0;
+  double nic_free = 0;
+  uint64_t prev_end = 0;
+  bool blocked = false;
+  // Messages sent here and not yet received, in the order they were sent,
+  // and irecv_data() receives still to be matched, in post order.
+  std::deque<SimMessage> unexpected;
+  std::deque<std::pair<int, int> > posted;
+  // When the last message matched to an irecv_data() receive is taken;
+  // the rank waits for it after its last event, as replay() does.
+  double irecv_done = 0;
+};
+
+static bool matches(int src, int tag, const SimMessage& m) {
+  return (src == RPC::kAnyWorker || src == m.src) && (tag == RPC::kAnyTag || tag == m.tag);
+}
+
+class Simulator {
+private:
+  const Trace& trace_;
+  const SimOptions& opts_;
+  std::vector<SimRank> ranks_;
+  SimResult result_;
+
+  // Runnable ranks, earliest first.
+  typedef std::pair<double, int> Entry;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > ready_;
+
+  const LogGP& link(int a, int b) const {
+    if (opts_.topo.num_workers() > 0 && a >= 0 && b >= 0 && opts_.topo.same_node(a, b)) {
+      return opts_.intra;
+    }
+    return opts_.inter;
+  }
+
+  void send(int me, const TraceEvent& e) {
+    SimRank& r = ranks_[me];
+    const LogGP& p = link(me, e.peer);
+    double start = std::max(r.clock, r.nic_free);
+    r.clock = start + p.o_ns;
+    r.nic_free = start + p.g_ns + e.bytes * p.G_ns_per_byte;
+    ++result_.messages;
+    result_.bytes += e.bytes;
+
+    SimMessage m = { me, e.tag, e.bytes, start + p.o_ns + p.L_ns + e.bytes * p.G_ns_per_byte };
+    SimRank& dst = ranks_[e.peer];
+    for (auto it = dst.posted.begin(); it != dst.posted.end(); ++it) {
+      if (matches(it->first, it->second, m)) {
+        dst.irecv_done = std::max(dst.irecv_done, m.arrival + p.o_ns);
+        dst.posted.erase(it);
+        return;
+      }
+    }
+    dst.unexpected.push_back(m);
+    if (dst.blocked) {
+      dst.blocked = false;
+      ready_.push(Entry(dst.clock, e.peer));
+    }
+  }
+
+  // Returns false if 'me' has to wait for more messages.  A wildcard only
+  // takes a message once no runnable rank could still send one that
+  // arrives earlier.
+  bool recv(int me, const TraceEvent& e) {
+    SimRank& r = ranks_[me];
+    auto best = r.unexpected.end();
+    for (auto it = r.unexpected.begin(); it != r.unexpected.end(); ++it) {
+      if (!matches(e.peer, e.tag, *it)) {
+        continue;
+      }
+      if (e.peer != RPC::kAnyWorker && e.tag != RPC::kAnyTag) {
+        best = it;
+        break;
+      }
+      if (best == r.unexpected.end() || it->arrival < best->arrival) {
+        best = it;
+      }
+    }
+
+    if (best == r.unexpected.end()) {
+      r.blocked = true;
+      return false;
+    }
+    bool wildcard = e.peer == RPC::kAnyWorker || e.tag == RPC::kAnyTag;
+    if (wildcard && !ready_.empty() && ready_.top().first < best->arrival) {
+      ready_.push(Entry(best->arrival, me));
+      return false;
+    }
+
+    const LogGP& p = link(best->src, me);
+    result_.wait_ns[me] += std::max(0.0, best->arrival - r.clock);
+    r.clock = std::max(r.clock, best->arrival) + p.o_ns;
+    r.unexpected.erase(best);
+    return true;
+  }
+
+  void irecv(int me, const TraceEvent& e) {
+    SimRank& r = ranks_[me];
+    r.clock += link(e.peer, me).o_ns;
+    for (auto it = r.unexpected.begin(); it != r.unexpected.end(); ++it) {
+      if (matches(e.peer, e.tag, *it)) {
+        r.irecv_done = std::max(r.irecv_done, it->arrival + link(it->src, me).o_ns);
+        r.unexpected.erase(it);
+        return;
+      }
+    }
+    r.posted.push_back(std::make_pair((int) e.peer, (int) e.tag));
+  }
+
+  // Run 'me' until it blocks or finishes.
+  void run(int me) {
+    SimRank& r = ranks_[me];
+    const std::vector<TraceEvent>& events = trace_.events(me);
+    while (r.next < events.size()) {
+      const TraceEvent& e = events[r.next];
+      if (r.next > 0 && r.prev_end != UINT64_MAX) {
+        r.clock += (e.start_ns - std::min(r.prev_end, e.start_ns)) * opts_.compute_scale;
+        // Counted once, even if the event has to be retried.
+        r.prev_end = UINT64_MAX;
+      }
+
+      switch (e.op) {
+      case TraceEvent::kSend:
+        send(me, e);
+        break;
+      case TraceEvent::kRecv:
+        if (!recv(me, e)) {
+          return;
+        }
+        break;
+      case TraceEvent::kIrecv:
+        irecv(me, e);
+        break;
+      case TraceEvent::kPoll:
+        // Time spent spinning is waiting, which the model gives to the
+        // receive that follows.
+        r.clock += link(e.peer, me).o_ns * e.bytes;
+        break;
+      }
+      r.prev_end = e.end_ns;
+      ++r.next;
+
+      // Let anyone now earlier catch up.
+      if (!ready_.empty() && ready_.top().first < r.clock) {
+        ready_.push(Entry(r.clock, me));
+        return;
+      }
+    }
+  }
+
+public:
+  Simulator(const Trace& trace, const SimOptions& opts) :
+      trace_(trace), opts_(opts), ranks_(trace.num_workers()) {
+    result_.finish_ns.resize(trace.num_workers());
+    result_.wait_ns.resize(trace.num_workers());
+    for (int i = 0; i < trace.num_workers(); ++i) {
+      ranks_[i].clock = trace.events(i).empty() ? 0 : trace.events(i)[0].start_ns * opts.compute_scale;
+      ready_.push(Entry(ranks_[i].clock, i));
+    }
+  }
+
+  SimResult run() {
+    while (!ready_.empty()) {
+      int me = ready_.top().second;
+      ready_.pop();
+      run(me);
+    }
+
+    for (int i = 0; i < trace_.num_workers(); ++i) {
+      SimRank& r = ranks_[i];
+      if (r.next < trace_.events(i).size()) {
+        Log_Warn("Rank %d stuck at event %zu of %zu.", i, r.next, trace_.events(i).size());
+        result_.deadlocked = true;
+      } else if (!r.posted.empty()) {
+        Log_Warn("Rank %d left %zu posted receives unmatched.", i, r.posted.size());
+        result_.deadlocked = true;
+      }
+      if (r.irecv_done > r.clock) {
+        result_.wait_ns[i] += r.irecv_done - r.clock;
+        r.clock = r.irecv_done;
+      }
+      result_.finish_ns[i] = r.clock;
+      result_.makespan_ns = std::max(result_.makespan_ns, r.clock);
+    }
+    return result_;
+  }
+};
+
+} // namespace
+
+// Ranks advance in order of their simulated clocks; a rank blocked on a
+// receive sleeps until something is sent to it.
+SimResult simulate(const Trace& trace, const SimOptions& opts) {
+  return Simulator(trace, opts).run();
+}
+
+} // namespace synchromesh
@@ -0,0 +1,216 @@
+#ifndef SYNCHROMESH_TRACE_H
+#define SYNCHROMESH_TRACE_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+
+#include "util.h"
+#include "rpc.h"
+#include "topology.h"
+
+// Communication traces.
+//
+// Wrap any RPC in a TracingRPC to record every send, receive and poll with
+// its timestamps, peer, tag and size, then write one file per rank:
+//
+//   TracingRPC t(rpc);
+//   run_app(&t);
+//   t.write("/tmp/app.trace");                  // /tmp/app.trace.<rank>
+//
+// A trace can later be replayed against any transport, keeping the
+// recorded compute time between operations, or run through a LogGP model
+// of the network to predict its run time on other links:
+//
+//   Trace trace = Trace::load("/tmp/app.trace");
+//   replay(rpc, trace);
+//   SimOptions opts;
+//   opts.inter = LogGP::ethernet();
+//   SimResult r = simulate(trace, opts);
+//
+// Traces taken with DummyRPC at large worker counts on one machine can be
+// simulated with cluster parameters, without the cluster.  See
+// bench/trace_replay.cc.
+namespace synchromesh {
+
+struct TraceEvent {
+  enum Op {
+    kSend = 0,
+    kRecv = 1,
+    kIrecv = 2,
+    kPoll = 3,
+  };
+
+  // Since the tracer was created.
+  uint64_t start_ns;
+  uint64_t end_ns;
+  // As passed in; receives may use RPC::kAnyWorker and RPC::kAnyTag.
+  int32_t peer;
+  int32_t tag;
+  // Polls: how many polls in a row, all missing, this event stands for.
+  uint32_t bytes;
+  uint8_t op;
+  // Polls: whether a message was waiting.
+  uint8_t hit;
+  uint16_t unused;
+};
+
+static_assert(sizeof(TraceEvent) == 32, "TraceEvent is written to disk as is.");
+
+// The events of every rank of a run.
+class Trace {
+private:
+  std::vector<std::vector<TraceEvent> > ranks_;
+public:
+  Trace() {
+  }
+
+  explicit Trace(int num_workers) :
+      ranks_(num_workers) {
+  }
+
+  // Read '<prefix>.0' through '<prefix>.<n - 1>', where n is the worker
+  // count recorded in the first.
+  static Trace load(const std::string& prefix);
+
+  int num_workers() const {
+    return ranks_.size();
+  }
+
+  const std::vector<TraceEvent>& events(int rank) const {
+    return ranks_[rank];
+  }
+
+  std::vector<TraceEvent>& events(int rank) {
+    return ranks_[rank];
+  }
+};
+
+// Write 'events' of 'rank' as '<prefix>.<rank>'.
+void write_trace(const std::string& prefix, int rank, int num_workers,
+                 const std::vector<TraceEvent>& events);
+
+// An RPC decorator which records every operation before forwarding it.
+class TracingRPC: public RPC {
+private:
+  RPC* rpc_;
+  // The tracer of channel 0, which holds the events of every channel.
+  TracingRPC* root_;
+  uint64_t start_ns_;
+  // Mutable so poll() can record.
+  mutable boost::mutex mut_;
+  mutable std::vector<TraceEvent> events_;
+  // Tracers of rpc_'s other channels, made on first use.
+  boost::mutex channels_mu_;
+  std::map<int, TracingRPC*> channels_;
+
+  TracingRPC(RPC* rpc, TracingRPC* root);
+
+  void record(TraceEvent::Op op, int peer, int tag, size_t bytes, uint64_t start,
+              bool hit) const;
+
+public:
+  TracingRPC(RPC* rpc);
+  ~TracingRPC();
+
+  Request* send_data(int dst, int tag, const void* ptr, int bytes);
+  void recv_data(int src, int tag, void* ptr, int bytes);
+  Request* irecv_data(int src, int tag, void* ptr, int bytes);
+  Buffer::Ptr recv_buffer(int src, int tag);
+  Request* send_layout(int dst, int tag, const void* base, const Layout& layout);
+  void recv_layout(int src, int tag, void* base, const Layout& layout);
+  bool poll(int src, int tag) const;
+
+  int first() const {
+    return rpc_->first();
+  }
+
+  int last() const {
+    return rpc_->last();
+  }
+
+  int id() const {
+    return rpc_->id();
+  }
+
+  int num_workers() const {
+    return rpc_->num_workers();
+  }
+
+  std::vector<int> node_map() const {
+    return rpc_->node_map();
+  }
+
+  // Channel 'c' of the traced RPC.  Its events go into this rank's trace
+  // with the rest; the channel is not recorded.
+  RPC* channel(int c);
+
+  std::vector<TraceEvent> events();
+
+  // Write this rank's events as '<prefix>.<rank>'.
+  void write(const std::string& prefix);
+};
+
+struct ReplayOptions {
+  // Multiplies the recorded time between operations.
+  double compute_scale = 1.0;
+};
+
+// Re-run rank rpc->id()'s part of 'trace' on 'rpc', with dummy payloads.
+// Every rank of the trace must replay together.  Returns the elapsed
+// nanoseconds on this rank.
+uint64_t replay(RPC* rpc, const Trace& trace, const ReplayOptions& opts = ReplayOptions());
+
+// LogGP link parameters: latency, per-message CPU overhead, gap between
+// messages at the NIC, and gap per byte (inverse bandwidth).
+struct LogGP {
+  double L_ns;
+  double o_ns;
+  double g_ns;
+  double G_ns_per_byte;
+
+  // Rough figures for common links.
+  static LogGP ethernet() {
+    return LogGP { 10000, 2000, 1000, 0.8 };
+  }
+
+  static LogGP infiniband() {
+    return LogGP { 1500, 300, 200, 0.04 };
+  }
+
+  static LogGP shared_memory() {
+    return LogGP { 300, 100, 50, 0.1 };
+  }
+};
+
+struct SimOptions {
+  // Between and within nodes.
+  LogGP inter = LogGP::infiniband();
+  LogGP intra = LogGP::shared_memory();
+
+  // Node of each rank; empty puts every rank on its own node.
+  Topology topo;
+
+  // Multiplies the recorded time between operations.
+  double compute_scale = 1.0;
+};
+
+struct SimResult {
+  // Predicted finish time of the slowest rank, and of each rank.
+  double makespan_ns = 0;
+  std::vector<double> finish_ns;
+  // Time each rank spent blocked in receives.
+  std::vector<double> wait_ns;
+  uint64_t messages = 0;
+  uint64_t bytes = 0;
+  // The trace stopped with receives that nothing would match.
+  bool deadlocked = false;
+};
+
+// Predict the run time of 'trace' under the network model of 'opts'.
+SimResult simulate(const Trace& trace, const SimOptions& opts = SimOptions());
+
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_TRACE_H */
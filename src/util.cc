@@ -1,4 +1,283 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
 #include "util.h"
 
 boost::recursive_mutex log_mutex;
 LogLevel log_level = kInfo;
+
+namespace logging {
+
+// A single-producer, single-consumer byte ring of Records.  'head' and
+// 'tail' count bytes ever written and consumed.  A record that would
+// straddle the end of the buffer is preceded by a padding record (or, if
+// too little room is left for a header, an implicit skip) and starts again
+// at offset 0.
+struct Ring {
+  static const size_t kBytes = 1 << 18;
+
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  // Set while a live thread is appending to this ring.  Rings of exited
+  // threads are drained and then handed to new threads.
+  std::atomic<bool> owned;
+  char data[kBytes];
+
+  Ring() :
+      head(0), tail(0), owned(true) {
+  }
+};
+
+struct RingHolder {
+  Ring* ring;
+
+  RingHolder() :
+      ring(NULL) {
+  }
+
+  ~RingHolder() {
+    if (ring != NULL) {
+      ring->owned.store(false, std::memory_order_release);
+    }
+  }
+};
+
+// Guards the ring registry and serializes consumers.  Producers only take
+// it the first time a thread logs, or when their ring is full.
+static boost::mutex rings_mutex;
+static std::vector<Ring*> rings;
+static thread_local RingHolder local_ring;
+
+static std::once_flag drainer_once;
+static boost::thread* drainer = NULL;
+static std::atomic<bool> drainer_stop(false);
+
+static void drain_loop();
+
+static void stop_drainer() {
+  drainer_stop.store(true);
+  drainer->join();
+  flush();
+}
+
+static void start_drainer() {
+  drainer = new boost::thread(&drain_loop);
+  atexit(&stop_drainer);
+}
+
+static Ring* thread_ring() {
+  if (local_ring.ring != NULL) {
+    return local_ring.ring;
+  }
+
+  std::call_once(drainer_once, &start_drainer);
+
+  boost::mutex::scoped_lock l(rings_mutex);
+  for (auto r : rings) {
+    bool expected = false;
+    if (r->owned.compare_exchange_strong(expected, true)) {
+      local_ring.ring = r;
+      return r;
+    }
+  }
+
+  local_ring.ring = new Ring;
+  rings.push_back(local_ring.ring);
+  return local_ring.ring;
+}
+
+char* reserve(size_t bytes) {
+  Ring* r = thread_ring();
+  if (bytes > Ring::kBytes / 4) {
+    // Only possible with many maximum length strings.
+    fprintf(stderr, "Log record too large (%zu bytes).\n", bytes);
+    abort();
+  }
+
+  uint64_t head = r->head.load(std::memory_order_relaxed);
+  size_t pos = head % Ring::kBytes;
+  size_t skip = Ring::kBytes - pos < bytes ? Ring::kBytes - pos : 0;
+
+  while (Ring::kBytes - (head - r->tail.load(std::memory_order_acquire)) < skip + bytes) {
+    flush();
+  }
+
+  if (skip > 0) {
+    if (skip >= sizeof(Record)) {
+      Record* pad = (Record*) (r->data + pos);
+      pad->size = skip;
+      pad->fmt = NULL;
+    }
+    r->head.store(head + skip, std::memory_order_release);
+    pos = 0;
+  }
+  return r->data + pos;
+}
+
+void commit(size_t bytes) {
+  Ring* r = local_ring.ring;
+  r->head.store(r->head.load(std::memory_order_relaxed) + bytes, std::memory_order_release);
+}
+
+// Format a single conversion 'spec' (without length modifiers) against one
+// binary argument.
+static void format_arg(std::string* out, const std::string& spec, char conv,
+                       const char*& args) {
+  char buf[128];
+  int type = *args++;
+  if (type == kStrArg) {
+    uint32_t len;
+    memcpy(&len, args, sizeof(len));
+    std::string s(args + sizeof(len), len);
+    args += sizeof(len) + len;
+    if (conv == 's') {
+      std::vector<char> big(len + spec.size() + 64);
+      snprintf(big.data(), big.size(), (spec + "s").c_str(), s.c_str());
+      out->append(big.data());
+    } else {
+      out->append(s);
+    }
+    return;
+  }
+
+  uint64_t raw;
+  memcpy(&raw, args, sizeof(raw));
+  args += sizeof(raw);
+
+  long long i = (long long) raw;
+  double d;
+  memcpy(&d, &raw, sizeof(d));
+  if (type != kDoubleArg) {
+    d = type == kIntArg ? (double) i : (double) raw;
+  } else {
+    i = (long long) d;
+  }
+
+  switch (conv) {
+  case 'd':
+  case 'i':
+    snprintf(buf, sizeof(buf), (spec + "lld").c_str(), i);
+    break;
+  case 'o':
+  case 'u':
+  case 'x':
+  case 'X':
+    snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(),
+             type == kDoubleArg ? (unsigned long long) i : (unsigned long long) raw);
+    break;
+  case 'c':
+    snprintf(buf, sizeof(buf), (spec + "c").c_str(), (int) i);
+    break;
+  case 'p':
+    snprintf(buf, sizeof(buf), (spec + "p").c_str(), (void*) (uintptr_t) raw);
+    break;
+  case 's':
+    snprintf(buf, sizeof(buf), "%p", (void*) (uintptr_t) raw);
+    break;
+  default:
+    snprintf(buf, sizeof(buf), (spec + conv).c_str(), d);
+    break;
+  }
+  out->append(buf);
+}
+
+static void format_record(std::string* out, const Record* r) {
+  char prefix[256];
+  snprintf(prefix, sizeof(prefix), "%s:%d -- ", r->file, r->line);
+  out->append(prefix);
+
+  const char* args = (const char*) (r + 1);
+  const char* end = (const char*) r + r->size;
+  for (const char* f = r->fmt; *f; ++f) {
+    if (*f != '%') {
+      out->push_back(*f);
+      continue;
+    }
+    if (f[1] == '%') {
+      out->push_back('%');
+      ++f;
+      continue;
+    }
+
+    std::string spec("%");
+    ++f;
+    while (*f && strchr("-+ #0123456789.", *f)) {
+      spec.push_back(*f++);
+    }
+    while (*f && strchr("hlLqjzt", *f)) {
+      ++f;
+    }
+    if (!*f) {
+      break;
+    }
+    if (args >= end || *args == 0) {
+      out->append(spec).push_back(*f);
+      continue;
+    }
+    format_arg(out, spec, *f, args);
+  }
+  out->push_back('\n');
+}
+
+struct Pending {
+  uint64_t ts;
+  std::string line;
+
+  bool operator<(const Pending& o) const {
+    return ts < o.ts;
+  }
+};
+
+void flush() {
+  std::vector<Pending> pending;
+  {
+    boost::mutex::scoped_lock l(rings_mutex);
+    for (auto r : rings) {
+      uint64_t tail = r->tail.load(std::memory_order_relaxed);
+      uint64_t head = r->head.load(std::memory_order_acquire);
+      while (tail < head) {
+        size_t pos = tail % Ring::kBytes;
+        if (Ring::kBytes - pos < sizeof(Record)) {
+          tail += Ring::kBytes - pos;
+          continue;
+        }
+        const Record* rec = (const Record*) (r->data + pos);
+        if (rec->fmt != NULL) {
+          Pending p;
+          p.ts = rec->ts;
+          format_record(&p.line, rec);
+          pending.push_back(p);
+        }
+        tail += rec->size;
+      }
+      r->tail.store(tail, std::memory_order_release);
+    }
+  }
+
+  if (pending.empty()) {
+    return;
+  }
+
+  std::stable_sort(pending.begin(), pending.end());
+  std::string out;
+  for (auto& p : pending) {
+    out.append(p.line);
+  }
+
+  boost::recursive_mutex::scoped_lock l(log_mutex);
+  fwrite(out.data(), 1, out.size(), stderr);
+}
+
+static void drain_loop() {
+  while (!drainer_stop.load()) {
+    flush();
+    usleep(1000);
+  }
+}
+
+} // namespace logging
@@ -1,17 +1,20 @@
 #ifndef SYNCHROMESH_UTIL_H_
 #define SYNCHROMESH_UTIL_H_
 
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <type_traits>
 #include <boost/thread.hpp>
 
-extern boost::recursive_mutex log_mutex;
+// Monotonic time in nanoseconds.
+static inline uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-#define DO_LOG(...)\
-    {\
-    boost::recursive_mutex::scoped_lock log_lock_(log_mutex);\
-    fprintf(stderr, "%s:%d -- ", __FILE__, __LINE__);\
-    fprintf(stderr, ##__VA_ARGS__);\
-    fprintf(stderr, "\n");\
-    }
+extern boost::recursive_mutex log_mutex;
 
 enum LogLevel {
   kDebug = 0,
@@ -22,10 +25,140 @@ enum LogLevel {
 
 extern LogLevel log_level;
 
-#define Log_Debug(...) if (log_level <= kDebug) { DO_LOG(__VA_ARGS__); }
-#define Log_Info(...) if (log_level <= kInfo) { DO_LOG(__VA_ARGS__); }
-#define Log_Warn(...) if (log_level <= kWarn) { DO_LOG(__VA_ARGS__); }
-#define Log_Error(...) if (log_level <= kError) { DO_LOG(__VA_ARGS__); }
+// Levels below this are compiled out entirely; their arguments are never
+// evaluated.  Build with e.g. -DSYNCHROMESH_MIN_LOG_LEVEL=1 to drop
+// Log_Debug from the send/recv paths.
+#ifndef SYNCHROMESH_MIN_LOG_LEVEL
+#define SYNCHROMESH_MIN_LOG_LEVEL 0
+#endif
+
+// Asynchronous logging.
+//
+// Log_* calls never take a lock: each thread appends a binary record (the
+// format string pointer plus its raw arguments) to its own single-producer
+// ring, and a background thread formats and writes them.  Fatal paths
+// (PANIC, ASSERT) flush the rings and write synchronously.
+namespace logging {
+
+enum ArgType {
+  kIntArg = 1,
+  kUIntArg = 2,
+  kDoubleArg = 3,
+  kPtrArg = 4,
+  kStrArg = 5,
+};
+
+// Strings longer than this are truncated in the record.
+static const size_t kMaxStringBytes = 4096;
+
+struct Record {
+  // Total bytes in the record, including this header and its arguments.
+  uint32_t size;
+  int32_t line;
+  uint64_t ts;
+  const char* file;
+  // NULL for padding records.
+  const char* fmt;
+};
+
+char* reserve(size_t bytes);
+void commit(size_t bytes);
+
+static inline size_t string_bytes(const char* s) {
+  if (s == NULL) {
+    return 0;
+  }
+  return strnlen(s, kMaxStringBytes);
+}
+
+static inline size_t arg_size(const char* s) {
+  return 1 + sizeof(uint32_t) + string_bytes(s);
+}
+
+static inline size_t arg_size(char* s) {
+  return arg_size((const char*) s);
+}
+
+template<class T>
+static inline size_t arg_size(const T&) {
+  return 1 + sizeof(uint64_t);
+}
+
+static inline char* put_arg(char* p, const char* s) {
+  uint32_t len = string_bytes(s);
+  *p++ = kStrArg;
+  memcpy(p, &len, sizeof(len));
+  memcpy(p + sizeof(len), s, len);
+  return p + sizeof(len) + len;
+}
+
+static inline char* put_arg(char* p, char* s) {
+  return put_arg(p, (const char*) s);
+}
+
+template<class T>
+static inline char* put_arg(char* p, const T& v) {
+  if constexpr (std::is_floating_point<T>::value) {
+    double d = v;
+    *p++ = kDoubleArg;
+    memcpy(p, &d, sizeof(d));
+  } else if constexpr (std::is_pointer<T>::value) {
+    uint64_t u = (uintptr_t) v;
+    *p++ = kPtrArg;
+    memcpy(p, &u, sizeof(u));
+  } else if constexpr (std::is_signed<T>::value || std::is_enum<T>::value) {
+    int64_t i = (int64_t) v;
+    *p++ = kIntArg;
+    memcpy(p, &i, sizeof(i));
+  } else {
+    uint64_t u = (uint64_t) v;
+    *p++ = kUIntArg;
+    memcpy(p, &u, sizeof(u));
+  }
+  return p + sizeof(uint64_t);
+}
+
+template<class... Args>
+void append(const char* file, int line, const char* fmt, const Args&... args) {
+  size_t bytes = sizeof(Record);
+  ((bytes += arg_size(args)), ...);
+  bytes = (bytes + 7) & ~7;
+
+  char* p = reserve(bytes);
+  Record* r = (Record*) p;
+  r->size = bytes;
+  r->line = line;
+  r->ts = now_ns();
+  r->file = file;
+  r->fmt = fmt;
+  p += sizeof(Record);
+  ((p = put_arg(p, args)), ...);
+  commit(bytes);
+}
+
+// Write out everything logged so far.
+void flush();
+
+} // namespace logging
+
+#define DO_LOG(...)\
+    {\
+    logging::flush();\
+    boost::recursive_mutex::scoped_lock log_lock_(log_mutex);\
+    fprintf(stderr, "%s:%d -- ", __FILE__, __LINE__);\
+    fprintf(stderr, ##__VA_ARGS__);\
+    fprintf(stderr, "\n");\
+    }
+
+#define LOG_AT(level, ...)\
+    if (level >= SYNCHROMESH_MIN_LOG_LEVEL && log_level <= level) {\
+      logging::append(__FILE__, __LINE__, __VA_ARGS__);\
+    }
+
+#define Log_Debug(...) LOG_AT(kDebug, __VA_ARGS__)
+#define Log_Info(...) LOG_AT(kInfo, __VA_ARGS__)
+#define Log_Warn(...) LOG_AT(kWarn, __VA_ARGS__)
+#define Log_Error(...) LOG_AT(kError, __VA_ARGS__)
 
 #define PANIC(...)\
     DO_LOG("Something bad happened:");\
@@ -0,0 +1,198 @@
+#ifndef SYNCHROMESH_VIEW_H
+#define SYNCHROMESH_VIEW_H
+
+#include <algorithm>
+#include <map>
+#include <type_traits>
+#include <vector>
+
+#include "util.h"
+#include "rpc.h"
+#include "datatype.h"
+
+// Read-in-place views of received messages.
+//
+// send_view() packs a vector or map into a single flat message: a
+// ViewHeader followed by the arrays it gives offsets for.  On the receiving
+// side a VectorView or MapView points straight into the transport's
+// receive buffer, so nothing is deserialized; the buffer is released when
+// the last view referencing it is destroyed.
+//
+//   send_view(comm, m)->wait();          // std::map<int, double>
+//
+//   MapView<int, double> v;
+//   recv(comm, v);
+//   const double* d = v.find(42);
+//
+// Element, key and value types must be trivially copyable.
+namespace synchromesh {
+
+struct ViewHeader {
+  uint64_t count;
+  // Byte offsets from the start of the message.
+  uint64_t keys_offset;
+  uint64_t values_offset;
+};
+
+static inline size_t align_up(size_t n, size_t align) {
+  return (n + align - 1) / align * align;
+}
+
+template<class T>
+static const T* view_array(const Buffer& buf, uint64_t offset, uint64_t count) {
+  ASSERT_LE(offset + count * sizeof(T), buf.size());
+  const char* p = buf.data() + offset;
+  ASSERT_EQ((uintptr_t) p % alignof(T), 0);
+  return (const T*) p;
+}
+
+template<class T>
+class VectorView {
+  static_assert(std::is_trivially_copyable<T>::value, "VectorView needs trivially copyable elements.");
+private:
+  Buffer::Ptr buf_;
+  const T* data_;
+  size_t size_;
+public:
+  VectorView() :
+      data_(NULL), size_(0) {
+  }
+
+  explicit VectorView(Buffer::Ptr buf) :
+      buf_(buf) {
+    ViewHeader h;
+    ASSERT_GE(buf_->size(), sizeof(h));
+    memcpy(&h, buf_->data(), sizeof(h));
+    size_ = h.count;
+    data_ = view_array<T>(*buf_, h.keys_offset, size_);
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  const T* data() const {
+    return data_;
+  }
+
+  const T& operator[](size_t idx) const {
+    return data_[idx];
+  }
+
+  const T* begin() const {
+    return data_;
+  }
+
+  const T* end() const {
+    return data_ + size_;
+  }
+};
+
+// Keys are stored sorted and contiguously, so lookups binary search a
+// dense array.
+template<class K, class V>
+class MapView {
+  static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                "MapView needs trivially copyable keys and values.");
+private:
+  Buffer::Ptr buf_;
+  const K* keys_;
+  const V* values_;
+  size_t size_;
+public:
+  MapView() :
+      keys_(NULL), values_(NULL), size_(0) {
+  }
+
+  explicit MapView(Buffer::Ptr buf) :
+      buf_(buf) {
+    ViewHeader h;
+    ASSERT_GE(buf_->size(), sizeof(h));
+    memcpy(&h, buf_->data(), sizeof(h));
+    size_ = h.count;
+    keys_ = view_array<K>(*buf_, h.keys_offset, size_);
+    values_ = view_array<V>(*buf_, h.values_offset, size_);
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  const K& key(size_t idx) const {
+    return keys_[idx];
+  }
+
+  const V& value(size_t idx) const {
+    return values_[idx];
+  }
+
+  // The value for 'k', or NULL if it isn't present.
+  const V* find(const K& k) const {
+    const K* it = std::lower_bound(keys_, keys_ + size_, k);
+    if (it == keys_ + size_ || k < *it) {
+      return NULL;
+    }
+    return values_ + (it - keys_);
+  }
+
+  size_t count(const K& k) const {
+    return find(k) == NULL ? 0 : 1;
+  }
+};
+
+template<class T>
+Request* send_view(Comm& comm, const T* v, size_t len) {
+  static_assert(std::is_trivially_copyable<T>::value, "VectorView needs trivially copyable elements.");
+  ViewHeader h;
+  h.count = len;
+  h.keys_offset = align_up(sizeof(h), alignof(T));
+  h.values_offset = 0;
+
+  BufferRequest* br = new BufferRequest(h.keys_offset + len * sizeof(T));
+  memcpy(br->data(), &h, sizeof(h));
+  memcpy(br->data() + h.keys_offset, v, len * sizeof(T));
+  br->add(comm.send_pod(br->data(), br->size()));
+  return br;
+}
+
+template<class T>
+Request* send_view(Comm& comm, const std::vector<T>& v) {
+  return send_view(comm, v.data(), v.size());
+}
+
+template<class K, class V>
+Request* send_view(Comm& comm, const std::map<K, V>& m) {
+  static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                "MapView needs trivially copyable keys and values.");
+  ViewHeader h;
+  h.count = m.size();
+  h.keys_offset = align_up(sizeof(h), alignof(K));
+  h.values_offset = align_up(h.keys_offset + m.size() * sizeof(K), alignof(V));
+
+  BufferRequest* br = new BufferRequest(h.values_offset + m.size() * sizeof(V));
+  memcpy(br->data(), &h, sizeof(h));
+  char* k = br->data() + h.keys_offset;
+  char* v = br->data() + h.values_offset;
+  for (const auto& i : m) {
+    memcpy(k, &i.first, sizeof(K));
+    memcpy(v, &i.second, sizeof(V));
+    k += sizeof(K);
+    v += sizeof(V);
+  }
+  br->add(comm.send_pod(br->data(), br->size()));
+  return br;
+}
+
+template<class T>
+void recv(Comm& comm, VectorView<T>& v) {
+  v = VectorView<T>(comm.recv_buffer());
+}
+
+template<class K, class V>
+void recv(Comm& comm, MapView<K, V>& m) {
+  m = MapView<K, V>(comm.recv_buffer());
+}
+
+} // namespace synchromesh
+
+#endif /* SYNCHROMESH_VIEW_H */
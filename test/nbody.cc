@@ -1,70 +1,71 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <string>
+#include <vector>
 
 #include "datatype.h"
+#include "quantize.h"
 #include "rpc.h"
+#include "soa.h"
 
 using namespace synchromesh;
 
-struct Point {
-  double x;
-  double y;
-  double z;
-};
-
-static double d_squared(Point a, Point b) {
-  return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
-}
-
-static inline void operator+=(Point& a, const Point& b) {
-  a.x += b.x;
-  a.y += b.y;
-  a.z += b.z;
-}
-
-static inline Point operator+(const Point& a, const Point& b) {
-  Point p = { a.x + b.x, a.y + b.y, a.z + b.z };
-  return p;
-}
-
-static inline Point operator-(const Point& a, const Point& b) {
-  Point p = { a.x - b.x, a.y - b.y, a.z - b.z };
-  return p;
-}
-
-static inline Point operator*(const Point& a, double scale) {
-  Point p = { a.x * scale, a.y * scale, a.z * scale };
-  return p;
-}
+// Positions are stored as a structure of arrays so the force kernel walks
+// each coordinate with unit stride.
+typedef ShardedSoA<double, double, double> Points;
 
-static inline Point operator/(const Point& a, double scale) {
-  Point p = { a.x / scale, a.y / scale, a.z / scale };
-  return p;
-}
+enum {
+  kX = 0,
+  kY = 1,
+  kZ = 2,
+};
 
 static inline double uniform() {
   return rand() / double(RAND_MAX) * 2.0 - 1.0;
 }
 
-// return unit length vector
-static inline Point normalize(const Point& v) {
-    double vnorm = sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
-    return v / vnorm;
-}
-
-
 static const double kTimestep = 1e-3;
-static const int kNumRounds = 10;
-static const int kNumPoints = 1000;
 static const int kTag = 1987;
 
-static Point global_pts[kNumPoints];
+static int num_points = 1000;
+static int num_rounds = 10;
+
+static Points global_pts;
+static double round_ms;
+
+// How positions are synchronized each round.
+static Quantization quant;
+
+// Accumulate the (simplified, unit mass) acceleration on (xi, yi, zi) from
+// points [first, last).
+static inline void accumulate(const double* __restrict x, const double* __restrict y,
+                              const double* __restrict z, size_t first, size_t last,
+                              double xi, double yi, double zi,
+                              double* ax, double* ay, double* az) {
+  double sx = 0, sy = 0, sz = 0;
+#pragma omp simd reduction(+:sx,sy,sz)
+  for (size_t j = first; j < last; ++j) {
+    double dx = xi - x[j];
+    double dy = yi - y[j];
+    double dz = zi - z[j];
+    double d2 = dx * dx + dy * dy + dz * dz;
+    double inv = 1.0 / (d2 * sqrt(d2));
+    sx += dx * inv;
+    sy += dy * inv;
+    sz += dz * inv;
+  }
+  *ax += sx;
+  *ay += sy;
+  *az += sz;
+}
 
 void runner(RPC* rpc) {
-  Point* pts = new Point[kNumPoints];
-  Point* accel = new Point[kNumPoints];
-  Point* velocity = new Point[kNumPoints];
+  Points pts(num_points);
+  Points accel(num_points);
+  Points velocity(num_points);
 
   Log_Info("Running on worker: %d", rpc->id());
   Endpoint everyone(rpc->first(), rpc->last(), kTag);
@@ -75,92 +76,179 @@ void runner(RPC* rpc) {
 
   if (rpc->id() == 0) {
     // node 0: gen & send data
-    for (int i = 0; i < kNumPoints; i++) {
-      pts[i] = { uniform(), uniform(), uniform() };
+    for (int i = 0; i < num_points; i++) {
+      pts.field<kX>()[i] = uniform();
+      pts.field<kY>()[i] = uniform();
+      pts.field<kZ>()[i] = uniform();
     }
 
-    Endpoint ep(1, rpc->last(), kTag);
-    AllComm all(rpc, ep);
-    synchromesh::send(all, pts, kNumPoints);
+    if (rpc->last() > 0) {
+      Endpoint ep(1, rpc->last(), kTag);
+      AllComm all(rpc, ep);
+      synchromesh::send(all, pts)->wait();
+    }
   } else {
     // node != 0: recv data
     OneComm one(rpc, everyone, 0);
-    synchromesh::recv(one, pts, kNumPoints);
+    synchromesh::recv(one, pts);
   }
 
   //
   // PHASE 2: N-BODY SIMULATION
   //
-  ShardCalc shard_calc(kNumPoints, sizeof(double), everyone.count());
+  ShardCalc shard_calc(num_points, sizeof(double), everyone.count());
   const size_t start = shard_calc.start_elem(rpc->id());
   const size_t count = shard_calc.num_elems(rpc->id());
-  for (int i = start; i < start + count; ++i) {
-      velocity[i] = {0, 0, 0};
+
+  double* x = pts.field<kX>();
+  double* y = pts.field<kY>();
+  double* z = pts.field<kZ>();
+  double* ax = accel.field<kX>();
+  double* ay = accel.field<kY>();
+  double* az = accel.field<kZ>();
+  double* vx = velocity.field<kX>();
+  double* vy = velocity.field<kY>();
+  double* vz = velocity.field<kZ>();
+
+  for (size_t i = start; i < start + count; ++i) {
+    vx[i] = vy[i] = vz[i] = 0;
   }
-  for (int round = 0; round < kNumRounds; round++) {
-    for (size_t i = start; i < start + count; ++i) {
-      accel[i] = {0, 0, 0};
-    }
+  pts.set_quantization(quant);
 
+  uint64_t total_ns = 0;
+  for (int round = 0; round < num_rounds; round++) {
+    uint64_t round_start = now_ns();
     for (size_t i = start; i < start + count; ++i) {
-      for (int j = 0; j < kNumPoints; ++j) {
-        if (i == j) {
-          continue;
-        }
-        // simplified model, assume (gravity factor * mass) gives us 1.0
-        accel[i] = normalize(pts[i] - pts[j]) / d_squared(pts[i], pts[j]) * 1.0;
-      }
+      ax[i] = ay[i] = az[i] = 0;
+      // simplified model, assume (gravity factor * mass) gives us 1.0
+      accumulate(x, y, z, 0, i, x[i], y[i], z[i], &ax[i], &ay[i], &az[i]);
+      accumulate(x, y, z, i + 1, num_points, x[i], y[i], z[i], &ax[i], &ay[i], &az[i]);
     }
 
     // update
+    const double h = 0.5 * kTimestep * kTimestep;
     for (size_t i = start; i < start + count; ++i) {
-      pts[i] += velocity[i] * kTimestep + accel[i] * 0.5 * kTimestep * kTimestep;
-      velocity[i] += accel[i] * kTimestep;
+      x[i] += vx[i] * kTimestep + ax[i] * h;
+      y[i] += vy[i] * kTimestep + ay[i] * h;
+      z[i] += vz[i] * kTimestep + az[i] * h;
+      vx[i] += ax[i] * kTimestep;
+      vy[i] += ay[i] * kTimestep;
+      vz[i] += az[i] * kTimestep;
     }
 
-    // synchronize
-//    Log_Info("My id: %d, start: %d, count: %d", rpc->id(), start, count);
-
-    // Send the updates for my region to everyone
+    // synchronize: send the positions in my region to everyone, then read
+    // in the updates for other regions.
     AllComm all(rpc, everyone);
-    Request* req = synchromesh::send(all, pts + start, count);
+    Request* req = synchromesh::send_shard(all, pts, rpc->id(), everyone.count());
 
-    // Read in the updates for other regions
     ShardedComm sharded(rpc, everyone);
-    synchromesh::recv(sharded, pts, kNumPoints);
+    synchromesh::recv(sharded, pts);
 
     req->wait();
+    delete req;
+
+    uint64_t elapsed = now_ns() - round_start;
+    total_ns += elapsed;
+    Log_Debug("%d: round %d took %.3f ms", rpc->id(), round, elapsed * 1e-6);
   }
 
   // Copy back to the global array for testing.
   if (rpc->id() == 0) {
-    memcpy(global_pts, pts, sizeof(Point) * kNumPoints);
+    global_pts = pts;
+    round_ms = total_ns * 1e-6 / num_rounds;
   }
+}
+
+// A lossy sync mode and the largest position error allowed against the
+// exact run.
+struct QuantMode {
+  const char* name;
+  Quantization q;
+  double tolerance;
+};
+
+static std::vector<QuantMode> quant_modes() {
+  return {
+    { "float32", Quantization::float32(), 1e-5 },
+    { "bfloat16", Quantization::bfloat16().with_error_feedback(), 2e-2 },
+    { "float16", Quantization::float16().with_error_feedback(), 2e-3 },
+    { "fixed16", Quantization::fixed(16).with_error_feedback(), 5e-4 },
+  };
+}
 
-  delete[] pts;
-  delete[] accel;
-  delete[] velocity;
+static double max_error(const Points& a, const Points& b) {
+  double err = 0;
+  for (int i = 0; i < num_points; ++i) {
+    err = std::max(err, fabs(a.field<kX>()[i] - b.field<kX>()[i]));
+    err = std::max(err, fabs(a.field<kY>()[i] - b.field<kY>()[i]));
+    err = std::max(err, fabs(a.field<kZ>()[i] - b.field<kZ>()[i]));
+  }
+  return err;
 }
 
+// Usage: nbody [num_points] [num_rounds] [--quantize=MODE,...] [--tolerance=T]
+//
+// Runs the simulation with 1, 2, 4 and 8 workers, checks each against the
+// single worker reference and prints the mean time per round as JSON.
+// Then runs 4 workers with each lossy sync mode (by default all of
+// float32, bfloat16, float16 and fixed16, the last three with error
+// feedback) and checks the largest position error is within the mode's
+// tolerance, or T.
 int main(int argc, char** argv) {
+  std::vector<QuantMode> modes = quant_modes();
+  double tolerance = 0;
+  int positional = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--quantize=", 11) == 0) {
+      std::string list = std::string(",") + (argv[i] + 11) + ",";
+      std::vector<QuantMode> picked;
+      for (auto& m : quant_modes()) {
+        if (list.find(std::string(",") + m.name + ",") != std::string::npos) {
+          picked.push_back(m);
+        }
+      }
+      modes = picked;
+    } else if (strncmp(argv[i], "--tolerance=", 12) == 0) {
+      tolerance = strtod(argv[i] + 12, NULL);
+    } else if (positional++ == 0) {
+      num_points = atoi(argv[i]);
+    } else {
+      num_rounds = atoi(argv[i]);
+    }
+  }
+
   // Run with 1 worker to get a reference.
   Log_Info("Running with 1 worker.");
   srand(getpid());
   DummyRPC::run(1, &runner);
-  static Point* reference = new Point[kNumPoints];
-  memcpy(reference, global_pts, sizeof(Point) * kNumPoints);
+  Points reference = global_pts;
+  printf("{\"bench\": \"nbody\", \"workers\": 1, \"points\": %d, \"ms_per_round\": %.3f}\n",
+         num_points, round_ms);
   Log_Info("done.");
 
   for (int num_workers = 2; num_workers < 16; num_workers *= 2) {
     Log_Info("Running with %d workers.", num_workers);
     srand(getpid());
     DummyRPC::run(num_workers, &runner);
-    for (size_t i = 0; i < kNumPoints; ++i) {
-      Point diff = global_pts[i] - reference[i];
-      ASSERT_LT(fabs(diff.x), 1e-9);
-      ASSERT_LT(fabs(diff.y), 1e-9);
-      ASSERT_LT(fabs(diff.z), 1e-9);
+    printf("{\"bench\": \"nbody\", \"workers\": %d, \"points\": %d, \"ms_per_round\": %.3f}\n",
+           num_workers, num_points, round_ms);
+    for (size_t i = 0; i < num_points; ++i) {
+      ASSERT_LT(fabs(global_pts.field<kX>()[i] - reference.field<kX>()[i]), 1e-9);
+      ASSERT_LT(fabs(global_pts.field<kY>()[i] - reference.field<kY>()[i]), 1e-9);
+      ASSERT_LT(fabs(global_pts.field<kZ>()[i] - reference.field<kZ>()[i]), 1e-9);
     }
   }
-}
 
+  for (auto& m : modes) {
+    Log_Info("Running with 4 workers, %s.", m.name);
+    quant = m.q;
+    srand(getpid());
+    DummyRPC::run(4, &runner);
+    double err = max_error(global_pts, reference);
+    double tol = tolerance > 0 ? tolerance : m.tolerance;
+    printf("{\"bench\": \"nbody\", \"workers\": 4, \"points\": %d, \"ms_per_round\": %.3f, "
+           "\"quantize\": \"%s\", \"bytes_per_value\": %zu, \"max_error\": %.3g}\n",
+           num_points, round_ms, m.name, m.q.value_bytes(), err);
+    ASSERT(err <= tol, "%s: position error %g over %g.", m.name, err, tol);
+  }
+}
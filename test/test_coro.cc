@@ -0,0 +1,85 @@
+#include "rpc.h"
+#include "datatype.h"
+#include "coro.h"
+
+using namespace synchromesh;
+using std::vector;
+
+static const int kRingTag = 1;
+static const int kGatherTag = 2;
+static const int kNumRounds = 10;
+
+#define RUN_TEST(expr)\
+  Log_Info("Running %s", #expr);\
+  DummyRPC::run(8, &expr);;\
+  Log_Info("Done.");
+
+// Pass a counter around the ring; each round is a send phase followed by a
+// receive phase on a separate coroutine.
+static coro::Task<void> ring_sender(RPC* rpc) {
+  int next = (rpc->id() + 1) % rpc->num_workers();
+  Endpoint ep(next, next, kRingTag);
+  OneComm out(rpc, ep, next);
+  for (int round = 0; round < kNumRounds; ++round) {
+    int v = rpc->id() * 1000 + round;
+    co_await coro::send(out, v);
+  }
+}
+
+static coro::Task<int> ring_receiver(RPC* rpc) {
+  int prev = (rpc->id() + rpc->num_workers() - 1) % rpc->num_workers();
+  Endpoint ep(prev, prev, kRingTag);
+  OneComm in(rpc, ep, prev);
+  int total = 0;
+  for (int round = 0; round < kNumRounds; ++round) {
+    int v = co_await coro::recv<int>(in);
+    ASSERT_EQ(v, prev * 1000 + round);
+    total += v;
+  }
+  co_return total;
+}
+
+static coro::Task<void> ring(RPC* rpc, int* total) {
+  *total = co_await ring_receiver(rpc);
+}
+
+void test_coro_ring(RPC* rpc) {
+  int total = 0;
+  coro::Executor ex;
+  ex.spawn(ring(rpc, &total));
+  ex.spawn(ring_sender(rpc));
+  ex.run();
+
+  int prev = (rpc->id() + rpc->num_workers() - 1) % rpc->num_workers();
+  ASSERT_EQ(total, prev * 1000 * kNumRounds + kNumRounds * (kNumRounds - 1) / 2);
+}
+
+static coro::Task<void> gather(RPC* rpc, vector<int>* out) {
+  Endpoint everyone(rpc->first(), rpc->last(), kGatherTag);
+  ShardCalc sc(100, sizeof(int), everyone.count());
+
+  vector<int> local;
+  for (size_t i = sc.start_elem(rpc->id()); i < sc.end_elem(rpc->id()); ++i) {
+    local.push_back(i);
+  }
+
+  out->resize(100);
+  co_await coro::allgather(rpc, everyone, local.data(), local.size(),
+                           out->data(), out->size());
+}
+
+void test_coro_allgather(RPC* rpc) {
+  vector<int> out;
+  coro::Executor ex;
+  ex.spawn(gather(rpc, &out));
+  ex.run();
+
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(out[i], i);
+  }
+}
+
+int main(int argc, char** argv) {
+  RUN_TEST(test_coro_ring);
+  RUN_TEST(test_coro_allgather);
+}
@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <unistd.h>
+
+#include "rpc.h"
+#include "datatype.h"
+
+// MPIRPC's send protocol.  Runs on any number of ranks: each rank talks to
+// its pair (0-1, 2-3, ...), or to itself when it has none.
+//
+//   mpirun -n 4 build/test_mpi
+
+using namespace synchromesh;
+using std::vector;
+
+static const int kSizesTag = 1;
+static const int kCreditTag = 2;
+static const int kBufferedTag = 3;
+static const int kCancelTag = 4;
+static const int kPollTag = 5;
+static const int kGroupTag = 6;
+
+#define RUN_TEST(expr)\
+  Log_Info("Running %s", #expr);\
+  expr(&rpc, fc);\
+  Log_Info("Done.");
+
+static int peer_of(RPC* rpc) {
+  int p = rpc->id() ^ 1;
+  return p <= rpc->last() ? p : rpc->id();
+}
+
+static vector<char> pattern(size_t n, int seed) {
+  vector<char> v(n);
+  for (size_t i = 0; i < n; ++i) {
+    v[i] = (char) (i * 7 + seed);
+  }
+  return v;
+}
+
+// Poll 'r' for up to a second.
+static bool done_soon(Request* r) {
+  for (uint64_t end = now_ns() + 1000000000; now_ns() < end;) {
+    if (r->done()) {
+      return true;
+    }
+    usleep(1000);
+  }
+  return false;
+}
+
+// Eager, past the eager limit, and through layouts, into each kind of
+// receive.
+void test_sizes(RPC* rpc, const FlowControl& fc) {
+  const int peer = peer_of(rpc);
+  const size_t sizes[] = { 0, 100, fc.eager_bytes, fc.eager_bytes + 1, 100000 };
+  vector<vector<char> > out;
+  RequestGroup sends;
+  for (size_t s : sizes) {
+    out.push_back(pattern(s, 1));
+    sends.add(rpc->send_data(peer, kSizesTag, out.back().data(), s));
+  }
+  // Every other byte of a large and a small region.
+  vector<char> wide = pattern(200000, 2);
+  sends.add(rpc->send_layout(peer, kSizesTag, wide.data(), Layout::strided(100000, 1, 2)));
+  sends.add(rpc->send_layout(peer, kSizesTag, wide.data(), Layout::strided(100, 1, 2)));
+
+  for (size_t i = 0; i < 5; ++i) {
+    vector<char> expected = pattern(sizes[i], 1);
+    if (i % 2 == 0) {
+      Buffer::Ptr b = rpc->recv_buffer(peer, kSizesTag);
+      ASSERT_EQ(b->size(), sizes[i]);
+      ASSERT(memcmp(b->data(), expected.data(), sizes[i]) == 0, "size %zu corrupted", sizes[i]);
+    } else {
+      vector<char> in(sizes[i]);
+      Request* r = rpc->irecv_data(peer, kSizesTag, in.data(), in.size());
+      r->wait();
+      delete r;
+      ASSERT(in == expected, "size %zu corrupted", sizes[i]);
+    }
+  }
+  for (size_t n : { 100000, 100 }) {
+    vector<char> in(n);
+    rpc->recv_data(peer, kSizesTag, in.data(), n);
+    for (size_t i = 0; i < n; ++i) {
+      ASSERT_EQ(in[i], wide[2 * i]);
+    }
+  }
+  sends.wait();
+}
+
+// Past the credit, sends stay incomplete until the receiver takes them;
+// taking them returns the credit.
+void test_credits(RPC* rpc, const FlowControl& fc) {
+  const int peer = peer_of(rpc);
+  const int n = fc.credits_per_peer + 6;
+  vector<Request*> sends;
+  for (int i = 0; i < n; ++i) {
+    sends.push_back(send_pod(rpc, peer, kCreditTag, i));
+  }
+  for (int i = 0; i < n; ++i) {
+    if (i < fc.credits_per_peer) {
+      ASSERT(done_soon(sends[i]), "send %d within the credit did not complete", i);
+    } else {
+      ASSERT(!sends[i]->done(), "send %d past the credit completed unreceived", i);
+    }
+  }
+  Request* ready = send_pod(rpc, peer, kCreditTag + 100, 1);
+  recv_pod<int>(rpc, peer, kCreditTag + 100);
+  for (int i = 0; i < n; ++i) {
+    ASSERT_EQ(recv_pod<int>(rpc, peer, kCreditTag), i);
+  }
+  for (auto r : sends) {
+    r->wait();
+    delete r;
+  }
+  delete ready;
+
+  // The credit came back: these go eagerly again.
+  sends.clear();
+  for (int i = 0; i < fc.credits_per_peer / 2; ++i) {
+    sends.push_back(send_pod(rpc, peer, kCreditTag, i));
+  }
+  for (size_t i = 0; i < sends.size(); ++i) {
+    ASSERT(done_soon(sends[i]), "credit was not returned");
+  }
+  for (size_t i = 0; i < sends.size(); ++i) {
+    ASSERT_EQ(recv_pod<int>(rpc, peer, kCreditTag), (int) i);
+    delete sends[i];
+  }
+}
+
+// Copies waiting for a receiver count against max_buffered_bytes, so a
+// sender runs ahead of a sleeping receiver only so far.
+void test_max_buffered(RPC* rpc, const FlowControl& fc) {
+  const int peer = peer_of(rpc);
+  const int n = fc.credits_per_peer + fc.max_buffered_bytes / fc.eager_bytes + 4;
+  const uint64_t start = now_ns();
+  uint64_t last_send_ns = 0;
+  boost::thread sender([&]() {
+    vector<char> msg = pattern(fc.eager_bytes, 3);
+    for (int i = 0; i < n; ++i) {
+      delete rpc->send_data(peer, kBufferedTag, msg.data(), msg.size());
+    }
+    last_send_ns = now_ns() - start;
+  });
+  usleep(300000);
+  for (int i = 0; i < n; ++i) {
+    Buffer::Ptr b = rpc->recv_buffer(peer, kBufferedTag);
+    ASSERT_EQ(b->size(), fc.eager_bytes);
+  }
+  sender.join();
+  ASSERT_GE(last_send_ns, 250000000);
+}
+
+// A withdrawn receive does not take the next message.
+void test_irecv_cancel(RPC* rpc, const FlowControl& fc) {
+  const int peer = peer_of(rpc);
+  int unused = -1;
+  delete rpc->irecv_data(peer, kCancelTag, &unused, sizeof(unused));
+  ASSERT_EQ(unused, -1);
+  Request* ready = send_pod(rpc, peer, kCancelTag + 100, 1);
+  recv_pod<int>(rpc, peer, kCancelTag + 100);
+  delete ready;
+
+  Request* r = send_pod(rpc, peer, kCancelTag, 7);
+  ASSERT_EQ(recv_pod<int>(rpc, peer, kCancelTag), 7);
+  r->wait();
+  delete r;
+
+  // Withdrawing after the message is there still delivers it somewhere.
+  r = send_pod(rpc, peer, kCancelTag, 8);
+  int got = -1;
+  usleep(10000);
+  delete rpc->irecv_data(peer, kCancelTag, &got, sizeof(got));
+  if (got == -1) {
+    got = recv_pod<int>(rpc, peer, kCancelTag);
+  }
+  ASSERT_EQ(got, 8);
+  r->wait();
+  delete r;
+}
+
+// The lower rank of a pair sends 1MB, past the eager limit, then waits
+// for a reply by polling through an AnyComm; the payload only goes once
+// that rank answers the receiver's clear-to-send.
+void test_poll_progress(RPC* rpc, const FlowControl& fc) {
+  const int peer = peer_of(rpc);
+  vector<char> big = pattern(1 << 20, 4);
+  Request* r = NULL;
+  if (rpc->id() <= peer) {
+    r = rpc->send_data(peer, kPollTag, big.data(), big.size());
+  }
+  if (rpc->id() >= peer) {
+    Buffer::Ptr b = rpc->recv_buffer(peer, kPollTag);
+    ASSERT_EQ(b->size(), big.size());
+    ASSERT(memcmp(b->data(), big.data(), big.size()) == 0, "rendezvous payload corrupted");
+    delete send_pod(rpc, peer, kPollTag + 1, 42);
+  }
+  if (rpc->id() <= peer) {
+    int reply = 0;
+    AnyComm(rpc, Endpoint(peer, peer, kPollTag + 1)).recv_pod(&reply, sizeof(reply));
+    ASSERT_EQ(reply, 42);
+    r->wait();
+    delete r;
+  }
+}
+
+// Sub-communicators over endpoint groups, in endpoint order, built once
+// per group whatever the tag.
+void test_group_comm(MPIRPC* rpc, const FlowControl& fc) {
+  const int n = rpc->num_workers();
+  const int me = rpc->id();
+  int size, rank;
+  Endpoint everyone(0, n - 1, kGroupTag);
+  MPI_Comm all = rpc->group_comm(everyone);
+  MPI_Comm_size(all, &size);
+  MPI_Comm_rank(all, &rank);
+  ASSERT_EQ(size, n);
+  ASSERT_EQ(rank, me);
+  ASSERT(rpc->group_comm(everyone.with_tag(kGroupTag + 1)) == all, "group communicator not cached");
+
+  // Even ranks as a range, then in reverse as a list.
+  Endpoint evens = Endpoint::strided(0, (n + 1) / 2, 2, kGroupTag);
+  vector<int> reversed(evens.begin(), evens.end());
+  std::reverse(reversed.begin(), reversed.end());
+  if (evens.contains(me)) {
+    int sum = 0, expected = 0;
+    for (int r : evens) {
+      expected += r;
+    }
+    MPI_Comm range = rpc->group_comm(evens);
+    MPI_Comm_rank(range, &rank);
+    ASSERT_EQ(rank, evens.index_of(me));
+    MPI_Allreduce(&me, &sum, 1, MPI_INT, MPI_SUM, range);
+    ASSERT_EQ(sum, expected);
+
+    MPI_Comm list = rpc->group_comm(Endpoint::list(reversed, kGroupTag));
+    ASSERT(list != range, "list shares the range's communicator");
+    MPI_Comm_rank(list, &rank);
+    ASSERT_EQ(rank, (int) reversed.size() - 1 - evens.index_of(me));
+    ASSERT(rpc->group_comm(Endpoint::list(reversed, kGroupTag + 1)) == list,
+           "separately built list not cached");
+  } else {
+    ASSERT(rpc->group_comm(evens) == MPI_COMM_NULL, "non-member got a communicator");
+  }
+}
+
+int main(int argc, char** argv) {
+  FlowControl fc;
+  fc.eager_bytes = 1024;
+  fc.credits_per_peer = 4;
+  fc.max_buffered_bytes = 4096;
+  MPIRPC rpc(fc);
+
+  RUN_TEST(test_sizes);
+  RUN_TEST(test_credits);
+  RUN_TEST(test_max_buffered);
+  RUN_TEST(test_irecv_cancel);
+  RUN_TEST(test_poll_progress);
+  RUN_TEST(test_group_comm);
+}
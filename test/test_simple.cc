@@ -1,5 +1,16 @@
 #include "rpc.h"
 #include "datatype.h"
+#include "metrics.h"
+#include "soa.h"
+#include "view.h"
+#include "checkpoint.h"
+#include "topology.h"
+#include "ndarray.h"
+#include "shuffle.h"
+#include "sparse.h"
+#include "paramserver.h"
+#include "bsp.h"
+#include "trace.h"
 
 using namespace synchromesh;
 using std::map;
@@ -11,6 +22,32 @@ struct ABC {
   int c;
 };
 
+struct State {
+  int step;
+  double t;
+  std::string name;
+  vector<int> values;
+  map<int, std::string> labels;
+  int a;
+  int b;
+};
+
+SYNCHROMESH_FIELDS(State, step, t, name, values, labels, a, b)
+
+// step+t and a+b are each copied with one memcpy.
+static_assert(Reflect<State>::Fields::num_segments() == 5, "fields not fused");
+
+// 'note' is not sent, so 'a' and 'b' are copied separately around it.
+struct Gap {
+  int a;
+  std::string note;
+  int b;
+};
+
+SYNCHROMESH_FIELDS(Gap, a, b)
+
+static_assert(Reflect<Gap>::Fields::num_segments() == 2, "fused over an unlisted field");
+
 static const int kDefaultTag = 1;
 
 #define RUN_TEST(expr)\
@@ -105,9 +142,1143 @@ void test_sharded_recv(RPC* rpc) {
   }
 }
 
+void test_reflected_struct(RPC* rpc) {
+  Endpoint ep(1, rpc->last(), kDefaultTag);
+  if (rpc->id() == 0) {
+    vector<State> v(3);
+    for (int i = 0; i < 3; ++i) {
+      v[i].step = i;
+      v[i].t = i * 0.5;
+      v[i].name = "state";
+      v[i].values.assign(i * 10, i);
+      v[i].labels[i] = "label";
+      v[i].a = i + 1;
+      v[i].b = i + 2;
+    }
+    AllComm all(rpc, ep);
+    send(all, v)->wait();
+  } else {
+    vector<State> v;
+    OneComm one(rpc, ep, 0);
+    recv(one, v);
+    ASSERT_EQ(v.size(), 3);
+    for (int i = 0; i < 3; ++i) {
+      ASSERT_EQ(v[i].step, i);
+      ASSERT_EQ(v[i].t * 2, i);
+      ASSERT(v[i].name == "state", "Bad name: %s", v[i].name.c_str());
+      ASSERT_EQ(v[i].values.size(), i * 10);
+      ASSERT(v[i].labels[i] == "label", "Bad label");
+      ASSERT_EQ(v[i].a, i + 1);
+      ASSERT_EQ(v[i].b, i + 2);
+    }
+  }
+}
+
+// An unlisted field survives unpacking into it.
+void test_unlisted_field(RPC* rpc) {
+  Gap in = { 1, "sent? no", 2 };
+  vector<char> buf(Serializer<Gap>::size(in));
+  ASSERT_EQ(buf.size(), 2 * sizeof(int));
+  char* p = buf.data();
+  Serializer<Gap>::pack(p, in);
+
+  Gap out = { 0, "kept across the unpack", 0 };
+  const char* q = buf.data();
+  Serializer<Gap>::unpack(q, out);
+  ASSERT_EQ(out.a, 1);
+  ASSERT_EQ(out.b, 2);
+  ASSERT(out.note == "kept across the unpack", "unlisted field overwritten: %s", out.note.c_str());
+}
+
+void test_views(RPC* rpc) {
+  Endpoint ep(1, rpc->last(), kDefaultTag);
+  if (rpc->id() == 0) {
+    vector<double> v(100);
+    map<int, double> m;
+    for (int i = 0; i < 100; ++i) {
+      v[i] = i * 0.5;
+      m[i * 3] = i;
+    }
+    AllComm all(rpc, ep);
+    send_view(all, v)->wait();
+    send_view(all, m)->wait();
+  } else {
+    OneComm one(rpc, ep, 0);
+    VectorView<double> v = recv<VectorView<double> >(one);
+    ASSERT_EQ(v.size(), 100);
+    for (int i = 0; i < 100; ++i) {
+      ASSERT_EQ(v[i] * 2, i);
+    }
+
+    MapView<int, double> m;
+    recv(one, m);
+    ASSERT_EQ(m.size(), 100);
+    ASSERT_EQ(*m.find(78), 26);
+    ASSERT(m.find(79) == NULL, "Found missing key.");
+    ASSERT_EQ(m.key(99), 297);
+  }
+}
+
+void test_soa_field_subset(RPC* rpc) {
+  Endpoint ep(1, rpc->last(), kDefaultTag);
+  ShardedSoA<int, double> v(100);
+  for (int i = 0; i < 100; ++i) {
+    v.field<0>()[i] = -1;
+    v.field<1>()[i] = rpc->id() == 0 ? i * 0.5 : -1;
+  }
+
+  if (rpc->id() == 0) {
+    AllComm all(rpc, ep);
+    send(all, v, soa_fields(1))->wait();
+  } else {
+    OneComm one(rpc, ep, 0);
+    recv(one, v, soa_fields(1));
+    ASSERT_EQ(v.size(), 100);
+    ASSERT_EQ((uintptr_t) v.field<1>() % kSoAAlignment, 0);
+    for (int i = 0; i < 100; ++i) {
+      ASSERT_EQ(v.field<0>()[i], -1);
+      ASSERT_EQ(v.field<1>()[i] * 2, i);
+    }
+  }
+}
+
+void test_metrics(RPC* rpc) {
+  MetricsRPC m(rpc);
+  Endpoint ep(1, rpc->last(), kDefaultTag);
+  if (rpc->id() == 0) {
+    vector<int> v(100);
+    AllComm all(&m, ep);
+    send(all, v)->wait();
+  } else {
+    vector<int> v;
+    OneComm one(&m, ep, 0);
+    recv(one, v);
+  }
+}
+
+// A matrix column, a struct field and a list of ranges, each sent as one
+// message straight from (and into) place.
+void test_layout_send(RPC* rpc) {
+  const int kN = 16;
+  Endpoint ep(1, rpc->last(), kDefaultTag);
+  vector<double> matrix(kN * kN);
+  vector<ABC> abc(kN);
+  vector<int> ranges(100);
+  if (rpc->id() == 0) {
+    for (int i = 0; i < kN * kN; ++i) {
+      matrix[i] = i;
+    }
+    for (int i = 0; i < kN; ++i) {
+      abc[i].a = -i;
+      abc[i].b = i;
+      abc[i].c = -i;
+    }
+    for (int i = 0; i < 100; ++i) {
+      ranges[i] = i;
+    }
+
+    AllComm all(rpc, ep);
+    RequestGroup rg;
+    rg.add(send_strided(all, &matrix[3], kN, kN));
+    rg.add(send_field(all, abc.data(), kN, &ABC::b));
+    std::vector<Layout::Block> blocks = { { 40, 8 }, { 4, 12 }, { 360, 4 } };
+    rg.add(all.send_layout(ranges.data(), Layout::indexed(blocks)));
+    rg.wait();
+  } else {
+    OneComm one(rpc, ep, 0);
+    // Column 3 arrives as row 5.
+    recv_strided(one, &matrix[5 * kN], kN, 1);
+    for (int i = 0; i < kN; ++i) {
+      ASSERT_EQ(matrix[5 * kN + i], i * kN + 3);
+    }
+
+    recv_field(one, abc.data(), kN, &ABC::b);
+    for (int i = 0; i < kN; ++i) {
+      ASSERT_EQ(abc[i].a, 0);
+      ASSERT_EQ(abc[i].b, i);
+    }
+
+    std::vector<int> packed(6);
+    struct iovec iov = { packed.data(), packed.size() * sizeof(int) };
+    one.recv_layout(packed.data(), Layout::iovec(packed.data(), &iov, 1));
+    ASSERT_EQ(packed[0], 10);
+    ASSERT_EQ(packed[1], 11);
+    ASSERT_EQ(packed[2], 1);
+    ASSERT_EQ(packed[4], 3);
+    ASSERT_EQ(packed[5], 90);
+  }
+}
+
+// Receives posted ahead of their messages, withdrawn, and mixed with
+// queued messages and wildcards.
+void test_posted_recv(RPC* rpc) {
+  const int kGo = kDefaultTag + 1;
+  const int n = rpc->num_workers();
+  int go = 0;
+
+  // Receives posted before anything is sent are written by the senders.
+  if (rpc->id() == 0) {
+    vector<int> from(n, -1);
+    RequestGroup rg;
+    for (int i = 1; i < n; ++i) {
+      rg.add(rpc->irecv_data(i, kDefaultTag, &from[i], sizeof(int)));
+    }
+    for (int i = 1; i < n; ++i) {
+      delete send_pod(rpc, i, kGo, go);
+    }
+    rg.wait();
+    for (int i = 1; i < n; ++i) {
+      ASSERT_EQ(from[i], i * 10);
+    }
+  } else {
+    recv_pod(rpc, 0, kGo, &go);
+    int v = rpc->id() * 10;
+    delete rpc->send_data(0, kDefaultTag, &v, sizeof(v));
+  }
+
+  // Posted and queued receives match in order, including wildcards.
+  if (rpc->id() == 1) {
+    int a = -1, b = -1, c = -1;
+    Request* ra = rpc->irecv_data(2, kDefaultTag, &a, sizeof(int));
+    Request* rb = rpc->irecv_data(RPC::kAnyWorker, RPC::kAnyTag, &b, sizeof(int));
+    // Withdrawn before anything is sent; the message goes to 'c'.
+    delete rpc->irecv_data(2, kDefaultTag, &c, sizeof(int));
+    delete send_pod(rpc, 2, kGo, go);
+    ra->wait();
+    rb->wait();
+    rpc->recv_data(2, kDefaultTag, &c, sizeof(int));
+    ASSERT_EQ(a, 0);
+    ASSERT_EQ(b, 1);
+    ASSERT_EQ(c, 2);
+    delete ra;
+    delete rb;
+  } else if (rpc->id() == 2) {
+    recv_pod(rpc, 1, kGo, &go);
+    for (int i = 0; i < 3; ++i) {
+      delete send_pod(rpc, 1, kDefaultTag, i);
+    }
+  }
+}
+
+// Run with 3 workers per node and nothing else modelled.
+void test_node_map(RPC* rpc) {
+  vector<int> nodes = rpc->node_map();
+  for (int i = 0; i < rpc->num_workers(); ++i) {
+    ASSERT_EQ(nodes[i], i / 3);
+  }
+  Endpoint everyone(rpc->first(), rpc->last(), kDefaultTag);
+  HierComm hier(rpc, everyone, Topology(nodes), 0);
+  ASSERT_EQ(hier.is_leader(), rpc->id() % 3 == 0);
+}
+
+// Run under 2ms latency, 1ms jitter, 100MB/s links and 2 workers per node.
+void test_network_model(RPC* rpc) {
+  const int kPong = kDefaultTag + 1;
+  ASSERT_EQ(rpc->node_map()[rpc->id()], rpc->id() / 2);
+
+  // 1MB takes 10ms to serialize, then at least 2ms to arrive; the reply
+  // another 2ms.
+  vector<char> big(1 << 20, 7);
+  int pong = 0;
+  if (rpc->id() == 0) {
+    uint64_t start = now_ns();
+    Request* r = rpc->send_data(1, kDefaultTag, big.data(), big.size());
+    Request* reply = rpc->irecv_data(1, kPong, &pong, sizeof(pong));
+    ASSERT(!r->done(), "send completed before it was serialized");
+    ASSERT(!reply->done(), "reply arrived before the request");
+    r->wait();
+    ASSERT_GE(now_ns() - start, 9000000);
+    reply->wait();
+    ASSERT_GE(now_ns() - start, 14000000);
+    ASSERT_EQ(pong, 1);
+    delete r;
+    delete reply;
+  } else if (rpc->id() == 1) {
+    vector<char> in(big.size());
+    rpc->recv_data(0, kDefaultTag, in.data(), in.size());
+    ASSERT(in == big, "payload corrupted");
+    pong = 1;
+    delete send_pod(rpc, 0, kPong, pong);
+  }
+
+  // Jitter never reorders messages between a pair.
+  if (rpc->id() == 2) {
+    for (int i = 0; i < 50; ++i) {
+      delete send_pod(rpc, 3, kDefaultTag, i);
+    }
+  } else if (rpc->id() == 3) {
+    for (int i = 0; i < 50; ++i) {
+      int v = -1;
+      recv_pod(rpc, 2, kDefaultTag, &v);
+      ASSERT_EQ(v, i);
+    }
+  }
+
+  // Collectives follow the emulated nodes.
+  Endpoint everyone(rpc->first(), rpc->last(), kDefaultTag);
+  HierComm hier(rpc, everyone, Topology(rpc->node_map()), 0);
+  ASSERT_EQ(hier.is_leader(), rpc->id() % 2 == 0);
+  int id = rpc->id();
+  vector<int> all(rpc->num_workers(), -1);
+  hier.allgather(&id, sizeof(id), all.data());
+  for (int i = 0; i < rpc->num_workers(); ++i) {
+    ASSERT_EQ(all[i], i);
+  }
+}
+
+void test_quantized_sync(RPC* rpc) {
+  Endpoint others(1, rpc->last(), kDefaultTag);
+  const size_t n = 1000;
+
+  // Exactly representable values survive every encoding.
+  ShardedVector<float> exact;
+  if (rpc->id() == 0) {
+    exact.resize(4);
+    exact[0] = 1.0f;
+    exact[1] = -2.5f;
+    exact[2] = 65504.0f;
+    exact[3] = ldexpf(1, -24);
+    AllComm all(rpc, others);
+    Request* r = send(all, exact, Quantization::float16());
+    r->wait();
+    delete r;
+  } else {
+    OneComm one(rpc, others, 0);
+    recv(one, exact, Quantization::float16());
+    ASSERT_EQ(exact.size(), 4);
+    ASSERT(exact[0] == 1.0f && exact[1] == -2.5f && exact[2] == 65504.0f && exact[3] == ldexpf(1, -24),
+           "float16 round trip");
+  }
+
+  // With error feedback each epoch makes up the last one's error, so
+  // unchanging values converge to far below one bfloat16 step.
+  ShardedVector<double> v;
+  v.resize(n);
+  v.set_quantization(Quantization::bfloat16().with_error_feedback());
+  AllComm all(rpc, others);
+  OneComm one(rpc, others, 0);
+  double first_err = 0;
+  for (int epoch = 0; epoch < 3; ++epoch) {
+    if (rpc->id() == 0) {
+      for (size_t i = 0; i < n; ++i) {
+        v[i] = sin(i * 0.1) * 100;
+      }
+      Request* r = send(all, v);
+      r->wait();
+      delete r;
+      continue;
+    }
+    recv(one, v);
+    double err = 0;
+    for (size_t i = 0; i < n; ++i) {
+      err = std::max(err, fabs(v[i] - sin(i * 0.1) * 100));
+    }
+    if (epoch == 0) {
+      first_err = err;
+      ASSERT(err > 1e-3 && err < 1, "bfloat16 error %g", err);
+    } else {
+      ASSERT(err < first_err * 1e-2, "epoch %d error %g after %g", epoch, err, first_err);
+    }
+  }
+
+  // 8 bit fixed point scaled to the largest magnitude.
+  ShardedVector<double> w;
+  if (rpc->id() == 0) {
+    w.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      w[i] = (double) i - 500;
+    }
+    Request* r = send(all, w, Quantization::fixed(8));
+    r->wait();
+    delete r;
+  } else {
+    recv(one, w, Quantization::fixed(8));
+    ASSERT_EQ(w.size(), n);
+    for (size_t i = 0; i < n; ++i) {
+      ASSERT(fabs(w[i] - ((double) i - 500)) <= 500.0 / 127 / 2 + 1e-9, "fixed8 error at %zu", i);
+    }
+  }
+}
+
+void test_sparse(RPC* rpc) {
+  const size_t n = 8000;
+  const int workers = rpc->num_workers();
+  Endpoint everyone(rpc->first(), rpc->last(), kDefaultTag);
+  ShardCalc sc(n, sizeof(double), workers);
+
+  // Shard 1 is full, the rest hold one element in a hundred.
+  auto value = [&](size_t i) {
+    return sc.start_elem(1) <= i && i < sc.end_elem(1) ? i + 0.5 : (i % 100 == 3 ? -1.0 * i : 0);
+  };
+  if (rpc->id() == 0) {
+    vector<double> dense(n);
+    for (size_t i = 0; i < n; ++i) {
+      dense[i] = value(i);
+    }
+    SparseShardedVector<double> v = SparseShardedVector<double>::from_dense(dense.data(), n);
+    ASSERT(v.encodes_dense(sc.start_elem(1), sc.num_elems(1)), "full shard sent sparse");
+    ASSERT(!v.encodes_dense(sc.start_elem(2), sc.num_elems(2)), "sparse shard sent dense");
+    ShardedComm sharded(rpc, everyone);
+    delete send(sharded, v);
+  }
+  SparseShardedVector<double> shard;
+  OneComm one(rpc, everyone, 0);
+  recv(one, shard);
+  const int me = rpc->id();
+  ASSERT_EQ(shard.size(), sc.num_elems(me));
+  for (size_t i = 0; i < shard.size(); ++i) {
+    ASSERT(shard[i] == value(sc.start_elem(me) + i), "shard %d element %zu", me, i);
+  }
+
+  // Each rank contributes 20 entries plus a shared one.
+  SparseShardedVector<int64_t> sum(n);
+  vector<int64_t> expected(n, 0);
+  for (int r = 0; r < workers; ++r) {
+    for (size_t j = 0; j < 20; ++j) {
+      size_t i = (r * 7 + j * 397) % n;
+      expected[i] += r + 1;
+      if (r == me) {
+        sum.add(i, r + 1);
+      }
+    }
+    expected[5] += 1;
+  }
+  sum.add(5, 1);
+  allreduce(rpc, everyone, &sum);
+
+  size_t nnz = 0;
+  for (size_t i = 0; i < n; ++i) {
+    ASSERT_EQ(sum[i], expected[i]);
+    nnz += expected[i] != 0;
+  }
+  ASSERT_EQ(sum.nnz(), nnz);
+
+  // Other operators; a rank with nothing to contribute.
+  SparseShardedVector<double> top(n);
+  if (me != 1) {
+    top.set(n - 1 - me, me);
+    top.set(0, me);
+  }
+  allreduce(rpc, everyone, &top, [](double a, double b) { return std::max(a, b); });
+  ASSERT_EQ(top[0], workers - 1);
+  ASSERT_EQ(top.nnz(), (size_t) workers);
+
+  // Every element set, so each range goes dense.
+  SparseShardedVector<float> full(workers);
+  full.set(me, me + 0.5f);
+  allreduce(rpc, everyone, &full);
+  ASSERT_EQ(full.nnz(), (size_t) workers);
+  for (int r = 0; r < workers; ++r) {
+    ASSERT(full[r] == r + 0.5f, "element %d is %f", r, full[r]);
+  }
+}
+
+// Workers of the previous pooled run.
+static RPC* pooled[8];
+
+// Leaves a message unreceived and group state cached.
+void test_pool_first(RPC* rpc) {
+  pooled[rpc->id()] = rpc;
+  Endpoint everyone(rpc->first(), rpc->last(), kDefaultTag);
+  group_state<int>(rpc, everyone, 0, []() { return new int(1); });
+  if (rpc->id() == 0) {
+    delete send_pod(rpc, 1, kDefaultTag, 1);
+  }
+}
+
+// Same workers, with nothing left over.
+void test_pool_second(RPC* rpc) {
+  ASSERT(pooled[rpc->id()] == rpc, "worker not reused");
+  ASSERT(!rpc->poll(RPC::kAnyWorker, RPC::kAnyTag), "message left from the last run");
+  Endpoint everyone(rpc->first(), rpc->last(), kDefaultTag);
+  ASSERT_EQ(*group_state<int>(rpc, everyone, 0, []() { return new int(2); }), 2);
+}
+
+// Three "nodes" of 3, 3 and 2 ranks, rooted at a non-leader.
+void test_hier_collectives(RPC* rpc) {
+  Topology topo = Topology::blocked(rpc->num_workers(), 3);
+  Endpoint everyone(rpc->first(), rpc->last(), kDefaultTag);
+  const int root = 4;
+  HierComm hier(rpc, everyone, topo, root);
+  ASSERT_EQ(hier.is_leader(), rpc->id() % 3 == 0);
+
+  // Quantized and sparse vectors, which receivers take whole.
+  ShardedVector<double> q;
+  SparseShardedVector<float> sparse(5000);
+  if (rpc->id() == root) {
+    q.resize(300);
+    for (size_t i = 0; i < q.size(); ++i) {
+      q[i] = i * 0.5;
+    }
+    sparse.set(17, 1.5f);
+    sparse.set(4999, -2.0f);
+    delete send(hier, q, Quantization::float16());
+    delete send(hier, sparse);
+  } else {
+    recv(hier, q, Quantization::float16());
+    recv(hier, sparse);
+  }
+  ASSERT_EQ(q.size(), 300);
+  for (size_t i = 0; i < q.size(); ++i) {
+    ASSERT(q[i] == i * 0.5, "quantized element %zu is %f", i, q[i]);
+  }
+  ASSERT_EQ(sparse.size(), 5000);
+  ASSERT_EQ(sparse.nnz(), 2);
+  ASSERT(sparse[17] == 1.5f && sparse[4999] == -2.0f, "sparse broadcast corrupted");
+
+  for (int round = 0; round < 3; ++round) {
+    // Grows past the initial segment size on the last round.
+    size_t n = round == 2 ? 100000 : 10 + round;
+    vector<int> v(n);
+    if (rpc->id() == root) {
+      for (size_t i = 0; i < n; ++i) {
+        v[i] = i + round;
+      }
+      send(hier, v)->wait();
+    } else {
+      recv(hier, v);
+    }
+    ASSERT_EQ(v.size(), n);
+    ASSERT_EQ(v[n - 1], (int) (n - 1 + round));
+
+    int local[2] = { rpc->id(), round };
+    vector<int> all(2 * rpc->num_workers(), -1);
+    hier.allgather(local, sizeof(local), all.data());
+    for (int i = 0; i < rpc->num_workers(); ++i) {
+      ASSERT_EQ(all[2 * i], i);
+      ASSERT_EQ(all[2 * i + 1], round);
+    }
+
+    vector<int> gathered(2 * rpc->num_workers(), -1);
+    local[1] = -round;
+    hier.gather(local, sizeof(local), gathered.data());
+    if (rpc->id() == root) {
+      for (int i = 0; i < rpc->num_workers(); ++i) {
+        ASSERT_EQ(gathered[2 * i], i);
+        ASSERT_EQ(gathered[2 * i + 1], -round);
+      }
+    }
+  }
+
+  // A root outside the endpoint, as with AllComm.
+  Endpoint others(1, rpc->last(), kDefaultTag);
+  HierComm bcast(rpc, others, topo, 0);
+  double d = rpc->id() == 0 ? 1.5 : 0;
+  if (rpc->id() == 0) {
+    send(bcast, d)->wait();
+  } else {
+    recv(bcast, d);
+  }
+  ASSERT_EQ(d, 1.5);
+}
+
+static double ndarray_value(size_t i, size_t j) {
+  return i * 1000.0 + j;
+}
+
+template<class V>
+static void check_ndarray(const ShardedArray<V, 2>& a, bool transposed) {
+  for (size_t i = 0; i < a.local_shape(0); ++i) {
+    for (size_t j = 0; j < a.local_shape(1); ++j) {
+      size_t gi = a.global_index(0, i);
+      size_t gj = a.global_index(1, j);
+      double expect = transposed ? ndarray_value(gj, gi) : ndarray_value(gi, gj);
+      ASSERT_EQ(a.local(i, j), expect);
+    }
+  }
+}
+
+// Row blocks to column blocks, to 2-D block-cyclic, and transposed.
+void test_ndarray_redistribute(RPC* rpc) {
+  const size_t kRows = 37, kCols = 23;
+  Endpoint everyone(rpc->first(), rpc->last(), kDefaultTag);
+  const int n = rpc->num_workers();
+  std::array<Dist, 2> blocks = { Dist::block(), Dist::block() };
+
+  ProcessGrid rows(everyone, { n, 1 });
+  ShardedArray<double, 2> a(rpc, rows, { kRows, kCols }, blocks);
+  ASSERT_EQ(a.local_shape(1), kCols);
+  for (size_t i = 0; i < a.local_shape(0); ++i) {
+    for (size_t j = 0; j < kCols; ++j) {
+      a.local(i, j) = ndarray_value(a.global_index(0, i), j);
+    }
+  }
+
+  ProcessGrid cols(everyone, { 1, n });
+  ShardedArray<double, 2> b(rpc, cols, { kRows, kCols }, blocks);
+  redistribute(a, &b);
+  ASSERT_EQ(b.local_shape(0), kRows);
+  check_ndarray(b, false);
+
+  ProcessGrid grid = ProcessGrid::balanced(everyone, 2);
+  ASSERT_EQ(grid.dim(0) * grid.dim(1), n);
+  ShardedArray<double, 2> c(rpc, grid, { kRows, kCols }, { Dist::cyclic(3), Dist::cyclic(2) });
+  redistribute(b, &c);
+  check_ndarray(c, false);
+  size_t local = c.local_size(), total = 0;
+  vector<size_t> sizes(n);
+  HierComm(rpc, everyone, Topology::detect(rpc), 0).allgather(&local, sizeof(local), sizes.data());
+  for (auto sz : sizes) {
+    total += sz;
+  }
+  ASSERT_EQ(total, kRows * kCols);
+
+  ShardedArray<double, 2> t(rpc, rows, { kCols, kRows }, blocks);
+  transpose(c, &t);
+  check_ndarray(t, true);
+  ASSERT(t.is_local({ t.global_index(0, 0), 5 }), "row block not local");
+}
+
+// Rank i sends (i * j + 1) % 7 ints to rank j, including none.
+static void check_alltoallv(RPC* rpc, AlltoallOptions::Algorithm algorithm) {
+  Endpoint everyone(rpc->first(), rpc->last(), kDefaultTag);
+  const int n = rpc->num_workers();
+  const int me = rpc->id();
+  vector<int> send;
+  vector<size_t> send_bytes(n);
+  for (int j = 0; j < n; ++j) {
+    int count = (me * j + 1) % 7;
+    for (int k = 0; k < count; ++k) {
+      send.push_back(me * 100 + j);
+    }
+    send_bytes[j] = count * sizeof(int);
+  }
+
+  AlltoallOptions opts;
+  opts.algorithm = algorithm;
+  opts.max_inflight = 2;
+  vector<char> recv;
+  vector<size_t> recv_bytes;
+  alltoallv(rpc, everyone, (const char*) send.data(), send_bytes, &recv, &recv_bytes, opts);
+
+  const int* r = (const int*) recv.data();
+  for (int i = 0; i < n; ++i) {
+    int count = (i * me + 1) % 7;
+    ASSERT_EQ(recv_bytes[i], count * sizeof(int));
+    for (int k = 0; k < count; ++k) {
+      ASSERT_EQ(*r++, i * 100 + me);
+    }
+  }
+  ASSERT_EQ((const char*) r, recv.data() + recv.size());
+}
+
+struct Record {
+  uint64_t key;
+  int src;
+  int idx;
+};
+
+void test_shuffle(RPC* rpc) {
+  check_alltoallv(rpc, AlltoallOptions::kPairwise);
+  check_alltoallv(rpc, AlltoallOptions::kBruck);
+
+  Endpoint everyone(rpc->first(), rpc->last(), kDefaultTag);
+  const int kRecords = 1000;
+  vector<Record> records(kRecords);
+  uint64_t x = 0x9e3779b97f4a7c15ULL * (rpc->id() + 1);
+  for (int i = 0; i < kRecords; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    records[i].key = x;
+    records[i].src = rpc->id();
+    records[i].idx = i;
+  }
+
+  vector<Record> mine = shuffle(rpc, everyone, records, [](const Record& r) {
+    return r.key;
+  });
+  int last_src = -1, last_idx = -1;
+  for (auto& r : mine) {
+    ASSERT_EQ(key_partition(r.key, rpc->num_workers()), rpc->id());
+    // Grouped by source, in their original order.
+    ASSERT(r.src > last_src || (r.src == last_src && r.idx > last_idx), "out of order");
+    last_src = r.src;
+    last_idx = r.idx;
+  }
+
+  size_t count = mine.size();
+  vector<size_t> counts(rpc->num_workers());
+  HierComm(rpc, everyone, Topology::detect(rpc), 0).allgather(&count, sizeof(count), counts.data());
+  size_t total = 0;
+  for (auto c : counts) {
+    total += c;
+  }
+  ASSERT_EQ(total, kRecords * rpc->num_workers());
+}
+
+void test_endpoint_groups(RPC* rpc) {
+  Endpoint big(0, 99999, kDefaultTag);
+  ASSERT_EQ(big.count(), 100000);
+  ASSERT_EQ(big[99999], 99999);
+  ASSERT_EQ(big.index_of(54321), 54321);
+  ASSERT_EQ(big.index_of(100000), -1);
+
+  Endpoint odds = Endpoint::strided(1, rpc->num_workers() / 2, 2, kDefaultTag);
+  ASSERT_EQ(odds.index_of(5), 2);
+  ASSERT_EQ(odds.index_of(4), -1);
+  ASSERT(vector<int>(odds.begin(), odds.end()) == vector<int>({ 1, 3, 5, 7 }), "bad strided endpoint");
+
+  // Derived state is built once per group, whatever the tag.
+  int built = 0;
+  auto make = [&]() {
+    ++built;
+    return new int(rpc->id());
+  };
+  boost::shared_ptr<int> a = group_state<int>(rpc, odds, 0, make);
+  ASSERT_EQ(a.get(), group_state<int>(rpc, odds.with_tag(kDefaultTag + 1), 0, make).get());
+  ASSERT_EQ(a.get(), group_state<int>(rpc, Endpoint::strided(1, 4, 2, 0), 0, make).get());
+  ASSERT_EQ(built, 1);
+  ASSERT(a != group_state<int>(rpc, odds, 1, make), "salt ignored");
+  ASSERT_EQ(built, 2);
+  // Lists by their ranks, not by which list.
+  boost::shared_ptr<int> l = group_state<int>(rpc, Endpoint::list({ 3, 1 }, 0), 0, make);
+  ASSERT_EQ(l.get(), group_state<int>(rpc, Endpoint::list({ 3, 1 }, 1), 0, make).get());
+  ASSERT(l != group_state<int>(rpc, Endpoint::list({ 1, 3 }, 0), 0, make), "list order ignored");
+  ASSERT_EQ(built, 4);
+
+  if (odds.contains(rpc->id())) {
+    // Keys spread evenly: 32 records to each of the 4 ranks.
+    vector<Record> records(128);
+    for (int i = 0; i < 128; ++i) {
+      records[i].key = (uint64_t) i << 57;
+      records[i].src = rpc->id();
+      records[i].idx = i;
+    }
+    vector<Record> mine = shuffle(rpc, odds, records, [](const Record& r) {
+      return r.key;
+    });
+    ASSERT_EQ(mine.size(), 128u);
+    for (auto& r : mine) {
+      ASSERT_EQ(key_partition(r.key, odds.count()), odds.index_of(rpc->id()));
+    }
+  } else {
+    // Nodes are { 0, 1, 2 }, { 3, 4, 5 }, { 6, 7 }; 2 leads the first.
+    Endpoint evens = Endpoint::list({ 6, 4, 2, 0 }, kDefaultTag);
+    for (int round = 0; round < 2; ++round) {
+      HierComm hier(rpc, evens, Topology::blocked(rpc->num_workers(), 3), 6);
+      ASSERT_EQ(hier.is_leader(), rpc->id() != 0);
+      int me = rpc->id(), all[4];
+      hier.allgather(&me, sizeof(me), all);
+      ASSERT(vector<int>(all, all + 4) == vector<int>(evens.begin(), evens.end()), "bad allgather");
+    }
+  }
+}
+
+static const int kCheckpointElems = 1001;
+static std::string checkpoint_dir;
+
+void test_checkpoint_save(RPC* rpc) {
+  vector<double> all(kCheckpointElems);
+  for (int i = 0; i < kCheckpointElems; ++i) {
+    all[i] = i * 0.25;
+  }
+  FixedArray<double> v(all.data(), all.size());
+  Checkpoint ckpt(rpc, checkpoint_dir, kDefaultTag);
+  ckpt.add("values", &v, kCheckpointElems);
+  ckpt.save();
+}
+
+void test_checkpoint_restore(RPC* rpc) {
+  ShardedVector<double> v;
+  Checkpoint ckpt(rpc, checkpoint_dir, kDefaultTag);
+  ckpt.add("values", &v, 0);
+  ckpt.restore();
+
+  ShardCalc sc(kCheckpointElems, sizeof(double), rpc->num_workers());
+  ASSERT_EQ(v.count(), sc.num_elems(rpc->id()));
+  for (size_t i = 0; i < v.count(); ++i) {
+    ASSERT_EQ(v[i], (sc.start_elem(rpc->id()) + i) * 0.25);
+  }
+
+  if (rpc->num_workers() == 8) {
+    MappedArray<double> m = ckpt.map<double>("values");
+    ASSERT_EQ(m.count(), v.count());
+    ASSERT_EQ(m[0], m.start_elem() * 0.25);
+  }
+}
+
+// Keeps mutating the live shard while it is written out, and checks the
+// files and the peer's replica hold the values from the snapshot.
+void test_checkpoint_async(RPC* rpc) {
+  const size_t kShard = 300000;  // spans several blocks
+  vector<double> shard(kShard);
+  for (size_t i = 0; i < kShard; ++i) {
+    shard[i] = i * 0.5 + rpc->id();
+  }
+  FixedArray<double> v(shard.data(), shard.size());
+  Checkpoint ckpt(rpc, checkpoint_dir, kDefaultTag);
+  ckpt.add("async", &v, kShard * rpc->num_workers());
+
+  AsyncSave* save = ckpt.save_async();
+  AsyncSave* replicate = ckpt.replicate_async(rpc->id() ^ 1);
+  for (size_t i = 0; i < kShard; i += 1000) {
+    save->touch(v, i, 1000);
+    replicate->touch(v, i, 1000);
+    for (size_t j = i; j < i + 1000; ++j) {
+      shard[j] = -1;
+    }
+  }
+  std::vector<Replica> replicas = ckpt.recv_replica(rpc->id() ^ 1);
+  save->wait();
+  ASSERT(save->done(), "save not done after wait");
+  delete save;
+  delete replicate;
+
+  // Restoring reads other ranks' files, so wait for every save.
+  barrier(rpc, Endpoint(rpc->first(), rpc->last(), kDefaultTag));
+
+  ASSERT_EQ(replicas.size(), 1);
+  ASSERT_EQ(replicas[0].header.count, kShard);
+  const double* r = (const double*) replicas[0].data->data();
+  for (size_t i = 0; i < kShard; ++i) {
+    ASSERT_EQ(r[i], i * 0.5 + (rpc->id() ^ 1));
+  }
+
+  ShardedVector<double> restored;
+  Checkpoint reload(rpc, checkpoint_dir, kDefaultTag);
+  reload.add("async", &restored, 0);
+  reload.restore();
+  ASSERT_EQ(restored.count(), kShard);
+  for (size_t i = 0; i < kShard; ++i) {
+    ASSERT_EQ(restored[i], i * 0.5 + rpc->id());
+  }
+}
+
+static Trace replay_trace;
+
+void test_trace_capture(RPC* rpc) {
+  TracingRPC traced(rpc);
+  Endpoint everyone(rpc->first(), rpc->last(), kDefaultTag);
+  vector<double> v(10000, rpc->id());
+  if (rpc->id() == 0) {
+    AllComm others(&traced, Endpoint(1, rpc->last(), kDefaultTag));
+    send(others, v)->wait();
+  } else {
+    OneComm root(&traced, everyone, 0);
+    recv(root, v);
+  }
+
+  // A ring shift, received with a wildcard source.
+  int next = (rpc->id() + 1) % rpc->num_workers();
+  int from = -1;
+  Request* r = traced.irecv_data(RPC::kAnyWorker, kDefaultTag + 1, &from, sizeof(from));
+  delete send_pod(&traced, next, kDefaultTag + 1, rpc->id());
+  r->wait();
+  delete r;
+  ASSERT_EQ(from, (rpc->id() + rpc->last()) % rpc->num_workers());
+
+  size_t count = 1;
+  vector<size_t> counts(rpc->num_workers());
+  HierComm(&traced, everyone, Topology::detect(rpc), 0).allgather(&count, sizeof(count), counts.data());
+  traced.write(checkpoint_dir + "/trace");
+}
+
+// Ranks 0 and 1 serve, the rest train with staleness 1; rank 2 is slow.
+void test_param_server(RPC* rpc) {
+  const size_t n = 1000;
+  const int epochs = 6;
+  const int staleness = 1;
+  Endpoint servers(0, 1, kDefaultTag);
+  Endpoint workers(2, rpc->last(), kDefaultTag + 1);
+  const int64_t w = workers.count();
+  ParamServer<double> ps(rpc, servers, workers, n, staleness);
+
+  if (servers.contains(rpc->id())) {
+    std::fill(ps.shard(), ps.shard() + ps.shard_size(), 0.0);
+    ps.serve();
+    for (size_t i = 0; i < ps.shard_size(); ++i) {
+      double extra = ps.shard_start() + i == 7 ? 10 * epochs : 0;
+      ASSERT_EQ(ps.shard()[i], w * epochs + extra);
+    }
+    return;
+  }
+
+  vector<double> ones(n, 1.0);
+  SparseShardedVector<double> bump(n);
+  bump.set(7, 10);
+  for (int e = 0; e < epochs; ++e) {
+    if (rpc->id() == 2) {
+      usleep(2000);
+    }
+    const vector<double>& view = ps.pull();
+    // Every worker's epochs before e - staleness, all of ours, and no
+    // worker more than staleness + 1 epochs ahead.
+    const int64_t c = ps.epoch();
+    const int64_t lo = (w - 1) * std::max<int64_t>(0, c - staleness) + c;
+    const int64_t hi = (w - 1) * (c + staleness + 1) + c;
+    for (size_t i = 0; i < n; ++i) {
+      if (i != 7) {
+        ASSERT_GE(view[i], lo);
+        ASSERT_LE(view[i], hi);
+      }
+    }
+    delete ps.push(ones);
+    if (rpc->id() == 3) {
+      delete ps.push(bump);
+    }
+    ps.clock();
+  }
+  ps.finish();
+}
+
+// Each rank runs 4 threads, each syncing its own slice over its own
+// channel with the same tag.
+static void sync_channels(RPC* rpc) {
+  const int threads = 4;
+  const int workers = rpc->num_workers();
+  ASSERT(rpc->channel(0) == rpc, "channel 0 is the worker");
+  boost::thread_group group;
+  for (int t = 0; t < threads; ++t) {
+    group.create_thread([rpc, t, workers]() {
+      RPC* ch = rpc->channel(t);
+      ASSERT_EQ(ch->id(), rpc->id());
+      Endpoint everyone(ch->first(), ch->last(), kDefaultTag);
+      for (int round = 0; round < 20; ++round) {
+        vector<int> mine(100, rpc->id() * 1000 + t * 100 + round);
+        RequestGroup rg;
+        for (int r = 0; r < workers; ++r) {
+          rg.add(ch->send_data(r, kDefaultTag, mine.data(), mine.size() * sizeof(int)));
+        }
+        for (int r = 0; r < workers; ++r) {
+          Buffer::Ptr b = ch->recv_buffer(r, kDefaultTag);
+          ASSERT_EQ(b->size(), mine.size() * sizeof(int));
+          ASSERT_EQ(((const int*) b->data())[99], r * 1000 + t * 100 + round);
+        }
+        rg.wait();
+      }
+      // Comms over a channel.
+      if (rpc->id() == 0) {
+        ShardedVector<int> v;
+        v.resize(400);
+        for (size_t i = 0; i < v.size(); ++i) {
+          v[i] = (int) i * threads + t;
+        }
+        ShardedComm sharded(ch, everyone);
+        delete send(sharded, v);
+      }
+      ShardedVector<int> shard;
+      OneComm one(ch, everyone, 0);
+      recv(one, shard);
+      ShardCalc sc(400, sizeof(int), workers);
+      ASSERT_EQ(shard.size(), sc.num_elems(rpc->id()));
+      for (size_t i = 0; i < shard.size(); ++i) {
+        ASSERT_EQ(shard[i], (sc.start_elem(rpc->id()) + i) * threads + t);
+      }
+    });
+  }
+  group.join_all();
+}
+
+void test_channels(RPC* rpc) {
+  sync_channels(rpc);
+
+  // Decorators wrap each channel.
+  MetricsRPC metered(rpc);
+  sync_channels(&metered);
+  TracingRPC traced(rpc);
+  sync_channels(&traced);
+  ASSERT(traced.channel(2) == traced.channel(2), "channel wrapper not reused");
+  ASSERT(traced.channel(2) != rpc->channel(2), "channel not traced");
+  size_t sends = 0;
+  for (auto& e : traced.events()) {
+    sends += e.op == TraceEvent::kSend && e.tag == kDefaultTag;
+  }
+  ASSERT_GE(sends, 4 * 20 * rpc->num_workers());
+}
+
+// Breadth first search over a 20 x 15 grid from vertex 0, and summed
+// messages.
+void test_bsp(RPC* rpc) {
+  const int w = 20, h = 15;
+  const int me = rpc->id();
+  Endpoint everyone(rpc->first(), rpc->last(), kDefaultTag);
+
+  ASSERT(barrier_any(rpc, everyone, me == 3), "flag from rank 3 lost");
+  ASSERT(!barrier_any(rpc, everyone, false), "no rank set the flag");
+  barrier(rpc, everyone);
+
+  BSP<int, MinCombiner> bfs(rpc, everyone);
+  std::map<uint64_t, int> dist;
+  auto relax = [&](BSP<int, MinCombiner>& s, uint64_t v, int d) {
+    if (dist.count(v) && dist[v] <= d) {
+      return;
+    }
+    dist[v] = d;
+    int x = v % w, y = v / w;
+    if (x > 0) s.send(v - 1, d + 1);
+    if (x < w - 1) s.send(v + 1, d + 1);
+    if (y > 0) s.send(v - w, d + 1);
+    if (y < h - 1) s.send(v + w, d + 1);
+  };
+  int steps = bfs.run([&](BSP<int, MinCombiner>& s) {
+    if (s.superstep() == 0 && s.owns(0)) {
+      relax(s, 0, 0);
+    }
+    uint64_t last = 0;
+    for (size_t i = 0; i < s.inbox().size(); ++i) {
+      const BSP<int, MinCombiner>::Message& m = s.inbox()[i];
+      ASSERT(i == 0 || m.idx > last, "inbox not one per vertex, sorted");
+      ASSERT(s.owns(m.idx), "vertex %lu delivered to the wrong rank", m.idx);
+      last = m.idx;
+      relax(s, m.idx, m.val);
+    }
+    s.vote_to_halt();
+  });
+  // Out to the far corner, one more to hear back from it, one to settle.
+  ASSERT_EQ(steps, (w - 1) + (h - 1) + 2);
+  for (uint64_t v = 0; v < (uint64_t) (w * h); ++v) {
+    if (bfs.owns(v)) {
+      ASSERT_EQ(dist[v], v % w + v / w);
+    }
+  }
+
+  // Every rank sends i + 1 to vertex i, ten times over.
+  BSP<int64_t> sum(rpc, everyone);
+  const int n = rpc->num_workers();
+  sum.run([&](BSP<int64_t>& s) {
+    if (s.superstep() == 0) {
+      for (int k = 0; k < 10; ++k) {
+        for (uint64_t v = 0; v < 50; ++v) {
+          s.send(v, v + 1);
+        }
+      }
+    } else {
+      ASSERT_EQ(s.superstep(), 1);
+      for (auto& m : s.inbox()) {
+        ASSERT_EQ(m.val, 10 * n * (int64_t) (m.idx + 1));
+      }
+    }
+    s.vote_to_halt();
+  });
+  ASSERT_EQ(sum.emitted(), 500u);
+  ASSERT_EQ(sum.exchanged(), 50u);
+}
+
+void test_trace_replay(RPC* rpc) {
+  replay(rpc, replay_trace);
+}
+
+// Rank 1 sends 1MB to an irecv_data() receive of rank 0, posted before
+// the message arrives or after.  Either way rank 0 finishes once it is in:
+// sent at 0, it arrives o + L + G * bytes later and takes o to receive.
+static void check_simulated_irecv() {
+  SimOptions sim;
+  sim.inter = LogGP::ethernet();
+  for (uint64_t posted_ns : { 0, 100000 }) {
+    Trace trace(2);
+    TraceEvent e;
+    memset(&e, 0, sizeof(e));
+    e.tag = kDefaultTag;
+    e.bytes = 1000000;
+    e.op = TraceEvent::kSend;
+    e.peer = 0;
+    trace.events(1).push_back(e);
+    e.op = TraceEvent::kIrecv;
+    e.peer = 1;
+    e.start_ns = e.end_ns = posted_ns;
+    trace.events(0).push_back(e);
+
+    SimResult r = simulate(trace, sim);
+    ASSERT(!r.deadlocked, "irecv left unmatched");
+    ASSERT_EQ(r.finish_ns[0], 2000 + 10000 + 800000 + 2000);
+    ASSERT_EQ(r.makespan_ns, r.finish_ns[0]);
+  }
+}
+
 int main(int argc, char** argv) {
   RUN_TEST(test_sharded_map_to_one);
   RUN_TEST(test_all_to_one);
   RUN_TEST(test_sharded_send)
   RUN_TEST(test_sharded_recv);
+  RUN_TEST(test_reflected_struct);
+  RUN_TEST(test_unlisted_field);
+  RUN_TEST(test_soa_field_subset);
+  RUN_TEST(test_views);
+  RUN_TEST(test_layout_send);
+  RUN_TEST(test_posted_recv);
+  NetworkModel net;
+  net.latency_ns = 2000000;
+  net.jitter_ns = 1000000;
+  net.link_bytes_per_sec = 100e6;
+  net.ranks_per_node = 2;
+  DummyRPC::run(4, &test_network_model, net);
+  NetworkModel nodes;
+  nodes.ranks_per_node = 3;
+  DummyRPC::run(6, &test_node_map, nodes);
+  RUN_TEST(test_hier_collectives);
+  RUN_TEST(test_ndarray_redistribute);
+  DummyRPC::run(5, &test_ndarray_redistribute);
+  RUN_TEST(test_shuffle);
+  DummyRPC::run(5, &test_shuffle);
+  RUN_TEST(test_endpoint_groups);
+  RUN_TEST(test_quantized_sync);
+  RUN_TEST(test_sparse);
+  DummyRPC::run(3, &test_sparse);
+  RUN_TEST(test_param_server);
+  RUN_TEST(test_channels);
+  RUN_TEST(test_bsp);
+  DummyRPC::run(5, &test_bsp);
+
+  char dir[] = "/tmp/synchromesh_ckpt.XXXXXX";
+  ASSERT(mkdtemp(dir) != NULL, "mkdtemp failed");
+  checkpoint_dir = dir;
+  RUN_TEST(test_checkpoint_save);
+  RUN_TEST(test_checkpoint_restore);
+  Log_Info("Restoring with 3 workers.");
+  DummyRPC::run(3, &test_checkpoint_restore);
+  metrics::reset();
+  RUN_TEST(test_checkpoint_async);
+  Log_Info("%s", metrics::snapshot().to_json().c_str());
+  ASSERT_EQ(metrics::snapshot().snapshot_pause.total, 16);
+  ASSERT_EQ(metrics::snapshot().snapshot_bytes, 16 * 300000 * sizeof(double));
+
+  RUN_TEST(test_trace_capture);
+  replay_trace = Trace::load(checkpoint_dir + "/trace");
+  ASSERT_EQ(replay_trace.num_workers(), 8);
+  SimOptions sim;
+  SimResult fast = simulate(replay_trace, sim);
+  sim.inter = LogGP::ethernet();
+  SimResult slow = simulate(replay_trace, sim);
+  ASSERT(!fast.deadlocked && !slow.deadlocked, "simulation deadlocked");
+  ASSERT(slow.makespan_ns > fast.makespan_ns, "ethernet should be slower");
+  // The broadcast, the ring and the allgather (shared memory, bar leaders).
+  ASSERT_EQ(fast.messages, slow.messages);
+  ASSERT_GE(fast.messages, 7u + 8u);
+  Log_Info("Simulated %.0f us on infiniband, %.0f us on ethernet.",
+           fast.makespan_ns / 1000, slow.makespan_ns / 1000);
+  check_simulated_irecv();
+  RUN_TEST(test_trace_replay);
+
+  for (int i = 0; i < 8; ++i) {
+    unlink((checkpoint_dir + "/trace." + std::to_string(i)).c_str());
+    unlink((checkpoint_dir + "/values." + std::to_string(i)).c_str());
+    unlink((checkpoint_dir + "/async." + std::to_string(i)).c_str());
+  }
+  rmdir(dir);
+
+  metrics::reset();
+  RUN_TEST(test_metrics);
+  metrics::Snapshot snap = metrics::snapshot();
+  Log_Info("%s", snap.to_json().c_str());
+  uint64_t sent = 0, recvd = 0;
+  for (auto p : snap.peers) {
+    if (p.kind == metrics::kAllComm) {
+      ASSERT_EQ(p.rank, 0);
+      sent += p.bytes_sent;
+    }
+    if (p.kind == metrics::kOneComm) {
+      ASSERT_EQ(p.peer, 0);
+      recvd += p.bytes_recv;
+    }
+  }
+  ASSERT_EQ(sent, 7 * (sizeof(size_t) + 100 * sizeof(int)));
+  ASSERT_EQ(recvd, sent);
+  ASSERT_EQ(snap.recv_wait.total, 14);
+  ASSERT_EQ(snap.send_latency.total, 14);
+
+  RUN_TEST(test_pool_first);
+  DummyRPC::run(3, &test_pool_second);
+  DummyRPC::shutdown();
+  RUN_TEST(test_pool_first);
 }